@@ -0,0 +1,70 @@
+/*!\file  baudrate.cxx  Non-standard baud rate handling
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <core/baudrate.h>
+#include <core/defs.h>
+
+#ifdef __linux__
+
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+int
+SetCustomBaudRate(int fdDevice, unsigned int nBaudRate)
+{
+	struct termios2 stTio2;
+
+	if( ioctl(fdDevice, TCGETS2, &stTio2) != SUCCESS )
+		return FAILURE;
+
+	stTio2.c_cflag &= ~CBAUD;
+	stTio2.c_cflag |= BOTHER;
+	stTio2.c_ispeed = nBaudRate;
+	stTio2.c_ospeed = nBaudRate;
+
+	// the input speed follows the output speed
+	stTio2.c_cflag &= ~(CBAUD << IBSHIFT);
+
+	if( ioctl(fdDevice, TCSETS2, &stTio2) != SUCCESS )
+		return FAILURE;
+
+	return SUCCESS;
+}
+
+int
+GetCustomBaudRate(int fdDevice, unsigned int & nBaudRate)
+{
+	struct termios2 stTio2;
+
+	if( ioctl(fdDevice, TCGETS2, &stTio2) != SUCCESS )
+		return FAILURE;
+
+	nBaudRate = stTio2.c_ospeed;
+	return SUCCESS;
+}
+
+#else
+
+int
+SetCustomBaudRate(int fdDevice, unsigned int nBaudRate)
+{
+	return FAILURE;
+}
+
+int
+GetCustomBaudRate(int fdDevice, unsigned int & nBaudRate)
+{
+	return FAILURE;
+}
+
+#endif
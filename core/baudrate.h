@@ -0,0 +1,36 @@
+/*!\file  baudrate.h  Non-standard baud rate handling
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __BAUDRATE_H
+#define __BAUDRATE_H
+
+/*
+* NOTE: these live in their own file because the linux termios2 structure comes from
+* <asm/termbits.h> which can't be included together with <termios.h>.
+*/
+
+/**
+*\fn SetCustomBaudRate(int fdDevice, unsigned int nBaudRate)
+*\brief Sets any integer baud rate on the open port (termios2 with BOTHER on linux).
+*@return SUCCESS or FAILURE (always FAILURE where termios2 is not available).
+*/
+extern int SetCustomBaudRate(int fdDevice, unsigned int nBaudRate);
+
+/**
+*\fn GetCustomBaudRate(int fdDevice, unsigned int & nBaudRate)
+*\brief Reads the output baud rate the driver actually uses on the open port.
+*@return SUCCESS or FAILURE (always FAILURE where termios2 is not available).
+*/
+extern int GetCustomBaudRate(int fdDevice, unsigned int & nBaudRate);
+
+#endif
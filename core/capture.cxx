@@ -0,0 +1,361 @@
+/*!\file  capture.cxx  Binary capture of the traffic on the ports
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <core/capture.h>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+//! Longest piece of data shown by DumpCapture() on one line.
+#define DUMP_MAX_DATA		48
+//! Longer first words of a command are UU data, not a command name.
+#define DUMP_MAX_COMMAND	12
+
+CCaptureLog::CCaptureLog()
+{
+	m_fdFile = FAILURE;
+	m_nPorts = 0;
+	pthread_mutex_init(&m_stLock, NULL);
+}
+
+CCaptureLog::~CCaptureLog()
+{
+	Close();
+	pthread_mutex_destroy(&m_stLock);
+}
+
+int
+CCaptureLog::Open(const string & strPath)
+{
+	string strMagic(CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+
+	m_fdFile = open(strPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if( m_fdFile < 0 )
+	{
+		cerr << ERRSTR << "can't create the capture file " << strPath << ": " << strerror(errno) << endl;
+		return FAILURE;
+	}
+
+	return Append(strMagic);
+}
+
+void
+CCaptureLog::Close()
+{
+	if( m_fdFile >= 0 )
+		close(m_fdFile);
+
+	m_fdFile = FAILURE;
+}
+
+unsigned int
+CCaptureLog::AddPort(const string & strName)
+{
+	string strRecord;
+	unsigned int nPort;
+
+	pthread_mutex_lock(&m_stLock);
+	nPort = m_nPorts++;
+	pthread_mutex_unlock(&m_stLock);
+
+	AddRecord(strRecord, 0, nPort, CAPTURE_REC_PORT, (const unsigned char *)strName.data(), strName.length());
+	Append(strRecord);
+
+	return nPort;
+}
+
+int
+CCaptureLog::Append(const string & strRecords)
+{
+	string::size_type nWritten = 0;
+	ssize_t nRet;
+	int nResult = SUCCESS;
+
+	pthread_mutex_lock(&m_stLock);
+
+	while( nWritten < strRecords.length() )
+	{
+		nRet = write(m_fdFile, strRecords.data() + nWritten, strRecords.length() - nWritten);
+
+		if( nRet < 0 && errno == EINTR )
+			continue;
+
+		if( nRet <= 0 )
+		{
+			nResult = FAILURE;
+			break;
+		}
+
+		nWritten += nRet;
+	}
+
+	pthread_mutex_unlock(&m_stLock);
+
+	return nResult;
+}
+
+void
+CCaptureLog::AddRecord(string & strBuffer, uint64_t nTimeNs, unsigned int nPort,
+                       CaptureRecordType eType, const unsigned char *rgu8Data, unsigned int nLength)
+{
+	SCaptureRecord stRecord;
+
+	memset(&stRecord, 0, sizeof(stRecord));
+	stRecord.nTimeNs = nTimeNs;
+	stRecord.nPort   = nPort;
+	stRecord.nType   = eType;
+	stRecord.nLength = nLength;
+
+	strBuffer.append((const char *)&stRecord, sizeof(stRecord));
+	strBuffer.append((const char *)rgu8Data, nLength);
+}
+
+int
+CCaptureReader::Open(const string & strPath)
+{
+	char rgMagic[CAPTURE_MAGIC_LEN];
+
+	if( !(m_pFile = fopen(strPath.c_str(), "rb")) )
+	{
+		cerr << ERRSTR << "can't open the capture file " << strPath << endl;
+		return FAILURE;
+	}
+
+	if( fread(rgMagic, 1, CAPTURE_MAGIC_LEN, m_pFile) != CAPTURE_MAGIC_LEN ||
+	    memcmp(rgMagic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0 )
+	{
+		cerr << ERRSTR << strPath << " is not an armflash capture file" << endl;
+		Close();
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+void
+CCaptureReader::Close()
+{
+	if( m_pFile )
+		fclose(m_pFile);
+
+	m_pFile = NULL;
+}
+
+bool
+CCaptureReader::Next(SCaptureRecord & stRecord, string & strData)
+{
+	if( !m_pFile || fread(&stRecord, sizeof(stRecord), 1, m_pFile) != 1 )
+		return false;
+
+	strData.resize(stRecord.nLength);
+
+	if( stRecord.nLength && fread(&strData[0], 1, stRecord.nLength, m_pFile) != stRecord.nLength )
+		return false;
+
+	return true;
+}
+
+// One record of the file in memory
+typedef struct SDumpRecord_
+{
+	SCaptureRecord stHeader;
+	string strData;
+} SDumpRecord;
+
+static bool
+EarlierRecord(const SDumpRecord & x, const SDumpRecord & y)
+{
+	return x.stHeader.nTimeNs < y.stHeader.nTimeNs;
+}
+
+string
+PrintableCaptureData(const string & strData)
+{
+	string strToRet;
+	char rgHex[8];
+
+	for(string::size_type i=0; i<strData.length() && strToRet.length() < DUMP_MAX_DATA; i++)
+	{
+		unsigned char u8Byte = strData[i];
+
+		if( u8Byte == '\r' )
+			strToRet += "\\r";
+		else if( u8Byte == '\n' )
+			strToRet += "\\n";
+		else if( u8Byte < 0x20 || u8Byte > 0x7e )
+		{
+			sprintf(rgHex, "\\x%02x", u8Byte);
+			strToRet += rgHex;
+		}
+		else
+			strToRet += u8Byte;
+	}
+
+	if( strToRet.length() >= DUMP_MAX_DATA )
+		strToRet += "...";
+
+	return strToRet;
+}
+
+// Names the command sent by a TX record: its first word, numbers and UU data lumped together
+static string
+CommandName(const string & strData)
+{
+	string::size_type nEnd = strData.find_first_of(" \r\n");
+	string strWord = strData.substr(0, nEnd);
+
+	if( strWord.empty() )
+		return "<empty>";
+
+	if( strWord.find_first_not_of("0123456789") == string::npos )
+		return "<number>";
+
+	if( strWord.length() > DUMP_MAX_COMMAND )
+		return "<data>";
+
+	return strWord;
+}
+
+static double
+NsToMs(uint64_t nNs)
+{
+	return nNs / 1000000.0;
+}
+
+// Round trip statistics of one kind of command
+typedef struct SDumpStats_
+{
+	unsigned int nCount;
+	uint64_t nTotalNs;
+	uint64_t nMaxNs;
+} SDumpStats;
+
+static void
+DumpPortLatency(const vector<SDumpRecord> & clRecords, unsigned int nPort, const string & strName, uint64_t nStartNs)
+{
+	map<string, SDumpStats> mapStats;
+	bool bPending = false;
+	uint64_t nTxNs = 0, nFirstNs = 0, nLastNs = 0;
+	unsigned int nReplyBytes = 0;
+	string strCommand;
+
+	printf("\n%s (port %u): round trips\n", strName.c_str(), nPort);
+	printf("%14s  %-14s %12s %12s %6s\n", "time [ms]", "command", "first [ms]", "last [ms]", "bytes");
+
+	// one extra pass with i == size() closes the last round trip
+	for(vector<SDumpRecord>::size_type i=0; i<=clRecords.size(); i++)
+	{
+		bool bTx = i == clRecords.size();
+
+		if( !bTx )
+		{
+			const SCaptureRecord & stHeader = clRecords[i].stHeader;
+
+			if( stHeader.nPort != nPort || stHeader.nType == CAPTURE_REC_PORT )
+				continue;
+
+			if( stHeader.nType == CAPTURE_REC_RX )
+			{
+				if( bPending )
+				{
+					if( !nReplyBytes )
+						nFirstNs = stHeader.nTimeNs;
+					nLastNs = stHeader.nTimeNs;
+					nReplyBytes += stHeader.nLength;
+				}
+				continue;
+			}
+
+			bTx = true;
+		}
+
+		if( bTx && bPending )
+		{
+			if( nReplyBytes )
+			{
+				SDumpStats & stStats = mapStats[strCommand];
+
+				printf("%14.6f  %-14s %12.3f %12.3f %6u\n", NsToMs(nTxNs - nStartNs), strCommand.c_str(),
+				       NsToMs(nFirstNs - nTxNs), NsToMs(nLastNs - nTxNs), nReplyBytes);
+
+				stStats.nCount++;
+				stStats.nTotalNs += nLastNs - nTxNs;
+				stStats.nMaxNs = max(stStats.nMaxNs, nLastNs - nTxNs);
+			}
+			else
+				printf("%14.6f  %-14s %12s %12s %6u\n", NsToMs(nTxNs - nStartNs), strCommand.c_str(), "-", "-", 0);
+		}
+
+		if( i < clRecords.size() )
+		{
+			bPending    = true;
+			nTxNs       = clRecords[i].stHeader.nTimeNs;
+			nReplyBytes = 0;
+			strCommand  = CommandName(clRecords[i].strData);
+		}
+	}
+
+	printf("\n%s (port %u): summary\n", strName.c_str(), nPort);
+	printf("%-14s %8s %12s %12s %12s\n", "command", "count", "total [ms]", "avg [ms]", "max [ms]");
+
+	for(map<string, SDumpStats>::iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+		printf("%-14s %8u %12.3f %12.3f %12.3f\n", it->first.c_str(), it->second.nCount, NsToMs(it->second.nTotalNs),
+		       NsToMs(it->second.nTotalNs) / it->second.nCount, NsToMs(it->second.nMaxNs));
+}
+
+int
+DumpCapture(const string & strPath)
+{
+	CCaptureReader clReader;
+	vector<SDumpRecord> clRecords;
+	map<unsigned int, string> mapPorts;
+	SDumpRecord stRecord;
+
+	if( clReader.Open(strPath) != SUCCESS )
+		return FAILURE;
+
+	while( clReader.Next(stRecord.stHeader, stRecord.strData) )
+	{
+		if( stRecord.stHeader.nType == CAPTURE_REC_PORT )
+			mapPorts[stRecord.stHeader.nPort] = stRecord.strData;
+		else
+			clRecords.push_back(stRecord);
+	}
+
+	// the port buffers were flushed one after another, put them back in time order
+	stable_sort(clRecords.begin(), clRecords.end(), EarlierRecord);
+
+	uint64_t nStartNs = clRecords.empty() ? 0 : clRecords[0].stHeader.nTimeNs;
+
+	printf("Capture %s: %u port(s), %u record(s)\n\n", strPath.c_str(), (unsigned int)mapPorts.size(), (unsigned int)clRecords.size());
+	printf("%14s  %-16s %3s %6s  %s\n", "time [ms]", "port", "dir", "bytes", "data");
+
+	for(vector<SDumpRecord>::size_type i=0; i<clRecords.size(); i++)
+	{
+		const SCaptureRecord & stHeader = clRecords[i].stHeader;
+
+		printf("%14.6f  %-16s %3s %6u  %s\n", NsToMs(stHeader.nTimeNs - nStartNs), mapPorts[stHeader.nPort].c_str(),
+		       stHeader.nType == CAPTURE_REC_TX ? "TX" : "RX", stHeader.nLength, PrintableCaptureData(clRecords[i].strData).c_str());
+	}
+
+	for(map<unsigned int, string>::iterator it = mapPorts.begin(); it != mapPorts.end(); ++it)
+		DumpPortLatency(clRecords, it->first, it->second, nStartNs);
+
+	return SUCCESS;
+}
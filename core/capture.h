@@ -0,0 +1,166 @@
+/*!\file  capture.h  Binary capture of the traffic on the ports
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include <core/defs.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+using namespace std;
+
+/*
+* FILE FORMAT (host byte order):
+*
+*	8 bytes    CAPTURE_MAGIC
+*	records    SCaptureRecord header followed by nLength bytes of data
+*
+* Every port first gets a CAPTURE_REC_PORT record carrying its name, the TX and RX
+* records then refer to it by nPort. The records of different ports come in blocks
+* (one per flushed port buffer), the timestamps are what orders them.
+*/
+
+//! Identifies a capture file, also the format version.
+#define CAPTURE_MAGIC		"ARMFCAP1"
+//! Length of CAPTURE_MAGIC in the file.
+#define CAPTURE_MAGIC_LEN	8
+//! Size of the per port buffer, it is written to the file only when full or closed.
+#define CAPTURE_BUFFER_SIZE	(64*1024)
+
+//! Type of the capture record.
+enum CaptureRecordType {
+	CAPTURE_REC_TX   = 0,	//!< bytes written to the port
+	CAPTURE_REC_RX   = 1,	//!< bytes read from the port
+	CAPTURE_REC_PORT = 2	//!< new port, the data is its name
+};
+
+//! Header of one record in the capture file.
+typedef struct SCaptureRecord_
+{
+	//! Monotonic time of the read/write in nanoseconds.
+	uint64_t nTimeNs;
+	//! Port number, assigned in the order the ports were attached.
+	uint16_t nPort;
+	//! One of CaptureRecordType.
+	uint8_t  nType;
+	uint8_t  nReserved;
+	//! Number of data bytes following the header.
+	uint32_t nLength;
+} SCaptureRecord;
+
+/**
+*\class CCaptureLog
+*\brief The capture file shared by all the ports.
+*
+* The ports keep their records in their own buffer (see CTransport::StartCapture())
+* and hand it over in big blocks, so the flashing threads only meet on the lock of
+* this class once per CAPTURE_BUFFER_SIZE bytes of traffic.
+*/
+class CCaptureLog
+{
+private:
+	int m_fdFile;
+	unsigned int m_nPorts;
+	pthread_mutex_t m_stLock;
+
+	CCaptureLog(const CCaptureLog &);
+	CCaptureLog & operator=(const CCaptureLog &);
+
+public:
+	CCaptureLog();
+	~CCaptureLog();
+
+	/**
+	*\brief Creates (truncates) the capture file and writes the magic.
+	*@return SUCCESS or FAILURE.
+	*/
+	int Open(const string & strPath);
+
+	//! Closes the file.
+	void Close();
+
+	/**
+	*\brief Assigns a number to a new port and records its name.
+	*@return The port number to be used in the records.
+	*/
+	unsigned int AddPort(const string & strName);
+
+	/**
+	*\brief Appends a block of ready made records to the file.
+	*@return SUCCESS or FAILURE.
+	*/
+	int Append(const string & strRecords);
+
+	/**
+	*\brief Appends one record to a port buffer.
+	*
+	* A helper for the ports, does not touch the file.
+	*/
+	static void AddRecord(string & strBuffer, uint64_t nTimeNs, unsigned int nPort,
+	                      CaptureRecordType eType, const unsigned char *rgu8Data, unsigned int nLength);
+};
+
+/**
+*\class CCaptureReader
+*\brief Reads the records of a capture file one by one.
+*/
+class CCaptureReader
+{
+private:
+	FILE *m_pFile;
+
+public:
+	CCaptureReader() : m_pFile(NULL) {}
+	~CCaptureReader() { Close(); }
+
+	/**
+	*\brief Opens the capture file and checks the magic.
+	*@return SUCCESS or FAILURE.
+	*/
+	int Open(const string & strPath);
+
+	//! Closes the file.
+	void Close();
+
+	/**
+	*\brief Reads the next record.
+	*@return false at the end of the file (or on a truncated record).
+	*/
+	bool Next(SCaptureRecord & stRecord, string & strData);
+};
+
+/**
+*\fn PrintableCaptureData(const string & strData)
+*\brief Makes the captured bytes printable, \r, \n and binary bytes are shown escaped.
+*
+* Long data are cut and end with "...".
+*/
+extern string PrintableCaptureData(const string & strData);
+
+/**
+*\fn DumpCapture(const string & strPath)
+*\brief Prints the capture file in readable form.
+*
+* Prints all the records in time order and then, for every port (with its number
+* as used by the replay: transport), the round trip latency of every command (from
+* the TX to the first and to the last byte of the reply), followed by a summary per
+* command.
+*
+*@return SUCCESS or FAILURE if the file could not be read.
+*/
+extern int DumpCapture(const string & strPath);
+
+#endif
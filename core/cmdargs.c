@@ -15,13 +15,24 @@
 #include <stdio.h>
 #include "cmdargs.h"
 
-const char * pszArmFlashSo = "hvdb:";
+const char * pszArmFlashSo = "hvdb:sc:D:wLrVJ:H:B:S:";
 
 const struct option rgstArmFlashLo[] = {
 	{ "help",         no_argument, 	     NULL, 'h'},
 	{ "version",      no_argument, 	     NULL, 'v'},
 	{ "detect_rs232", no_argument, 	     NULL, 'd'},
 	{ "dump_binary",  required_argument, NULL, 'b'},
+	{ "single_thread", no_argument,      NULL, 's'},
+	{ "capture",      required_argument, NULL, 'c'},
+	{ "dump_capture", required_argument, NULL, 'D'},
+	{ "watch",        no_argument,       NULL, 'w'},
+	{ "low_latency",  no_argument,       NULL, 'L'},
+	{ "read_back",    no_argument,       NULL, 'r'},
+	{ "verify",       no_argument,       NULL, 'V'},
+	{ "journal",      required_argument, NULL, 'J'},
+	{ "hash_cache",   required_argument, NULL, 'H'},
+	{ "board_id",     required_argument, NULL, 'B'},
+	{ "sync_baud",    required_argument, NULL, 'S'},
 	{ NULL, 0, NULL, 0 } //this is required in the end of the struct
 };
 
@@ -50,14 +61,29 @@ print_help(const char * pszPrgName)
 	printf("\t--version (-v)\n\t  displays your version of %s\n", pszPrgName);
 	printf("\t--detect_rs232 (-d)\n\t  autodetects your serial port devices and lists them. USE THIS OPTION ALONE\n");
 	printf("\t--dump_binary BINFILE (-b BINFILE)\n\t  dumps raw BINFILE data with memory adresses\n");
+	printf("\t--single_thread (-s)\n\t  flashes all the devices from one thread instead of one thread per PORT\n");
+	printf("\t--capture FILE (-c FILE)\n\t  records the traffic on all the ports with timestamps into FILE\n");
+	printf("\t--dump_capture FILE (-D FILE)\n\t  prints FILE recorded with -c, with the round trip time of every command\n");
+	printf("\t--watch (-w)\n\t  the PORTs are glob patterns, flashes every matching port as soon as it is plugged in, until Ctrl-C\n");
+	printf("\t--low_latency (-L)\n\t  tunes the serial ports for low latency (ASYNC_LOW_LATENCY, 1 ms latency timer of USB adapters)\n");
+	printf("\t--read_back (-r)\n\t  reads the whole flash of every board into FIRMWARE instead of flashing it (.hex or .bin)\n");
+	printf("\t--verify (-V)\n\t  compares every programmed part of the flash with the RAM it was copied from (\"M\"), a mismatch fails the board\n");
+	printf("\t--journal DIR (-J DIR)\n\t  journals the programmed sectors of every board in DIR, an interrupted flashing is resumed by the next run\n");
+	printf("\t--hash_cache FILE (-H FILE)\n\t  remembers what every board holds in FILE, only the sectors that changed are flashed\n");
+	printf("\t--board_id [PORT=]ID (-B [PORT=]ID)\n\t  identifies the board on PORT (all the ports) in the -H cache and the -J journal instead of the port name\n");
+	printf("\t--sync_baud BAUD (-S BAUD)\n\t  synchronizes at BAUD (38400 by default) and raises BAUDRATE with \"B\" after, falls back to BAUD if the board doesn't keep up. 0 syncs at BAUDRATE\n");
 	printf("PORT:\n");
 	printf("\tSome serial port used to program the device. Use -d to detect available ports\n");
+	printf("\tpty:PATH      - pseudo terminal, ie. of the lpcsim simulator\n");
+	printf("\ttcp:HOST:PORT - serial port exported by a TCP serial server (raw mode)\n");
+	printf("\tloop:[E[:C]]  - simulated board inside armflash, E/C = erase/copy delays in ms\n");
+	printf("\treplay:FILE[,N[,S]] - plays port N of capture FILE back, delays scaled by S (0 = no delays)\n");
 	printf("FIRMWARE:\n");
 	printf("\tThe firmware to program.\n");
 	printf("\tSupported formats:\n");
 	printf("\t\t - Intel hex 32-bit\n");
 	printf("BAUDRATE:\n");
-	printf("\tBaudrate used to program the device\n");
+	printf("\tBaudrate used to program the device, any integer rate (ie. 38400, 115200, 230400)\n");
     printf("CRYSTAL_HZ:\n");
     printf("\tCrystal speed in Hz\n");
 	printf("DEVICE:\n");
@@ -67,6 +93,8 @@ print_help(const char * pszPrgName)
 	printf("EXAMPLE:\n");
 	printf(":: programmes devices connected to ttyS0 and ttyUSB0 with selected firmwares at the same time\n");
 	printf("\t%s /dev/ttyS0 firmware1.hex 38400 10000 LPC2103 /dev/ttyUSB0 firmware2.hex 38400 10000 LPC2103\n\n", pszPrgName);
+	printf(":: flashes every FTDI adapter plugged in from now on (a production fixture)\n");
+	printf("\t%s '/dev/serial/by-id/usb-FTDI*' firmware.hex 38400 10000 LPC2103 -w\n\n", pszPrgName);
 	printf(":: detects available serial ports on the system and lists them\n");
 	printf("\t%s -d, %s --detect_rs232\n\n", pszPrgName, pszPrgName);
 }
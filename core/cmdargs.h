@@ -25,6 +25,28 @@
 #define OPT_DETECT_RS232 'd'
 //! constant for raw assembler dump argument
 #define OPT_RAWDUMP 'b'
+//! constant for single threaded (epoll driven) flashing argument
+#define OPT_SINGLE_THREAD 's'
+//! constant for capturing the port traffic argument
+#define OPT_CAPTURE 'c'
+//! constant for printing a capture file argument
+#define OPT_DUMP_CAPTURE 'D'
+//! constant for the hot-plug watch mode argument
+#define OPT_WATCH 'w'
+//! constant for the low latency serial port tuning argument
+#define OPT_LOW_LATENCY 'L'
+//! constant for the flash readback argument
+#define OPT_READ_BACK 'r'
+//! constant for the verify after programming argument
+#define OPT_VERIFY 'V'
+//! constant for the sector journal (resumable flashing) argument
+#define OPT_JOURNAL 'J'
+//! constant for the sector hash cache (delta flashing) argument
+#define OPT_HASH_CACHE 'H'
+//! constant for the board ID argument
+#define OPT_BOARD_ID 'B'
+//! constant for the synchronization baud rate argument
+#define OPT_SYNC_BAUD 'S'
 
 //! long options definitions
 extern const struct option rgstArmFlashLo[];
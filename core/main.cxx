@@ -21,14 +21,22 @@
 #include "serial.h"
 #include "CDeviceLPC2103.h"
 #include "UUcoder.h"
+#include <core/capture.h>
 #include <tools/CFlashData.h>
+#include <tools/CFlashEngine.h>
+#include <tools/CPortWatcher.h>
+#include <tools/CSectorCache.h>
 #include <device/CDeviceSupport.h>
 #include <pthread.h>
 #include <vector>
+#include <map>
+#include <set>
 #include <string>
 #include <iterator>
 #include <algorithm>
 #include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
 #include <sys/types.h>
 
 using namespace std;
@@ -44,23 +52,298 @@ extern "C"
 
 
 
+// Capture file of all the ports, NULL unless -c was given
+static CCaptureLog *g_pclCaptureLog = NULL;
+
+// Tune the serial ports for low latency, set by -L
+static bool g_bLowLatency = false;
+
+// Verify every programmed chunk on the device, set by -V
+static bool g_bVerify = false;
+
+// Sector hash cache for delta flashing, NULL unless -H was given
+static CSectorCache *g_pclSectorCache = NULL;
+
+// Directory of the sector journals, set by -J
+static string g_strJournalDir;
+
+// Baud rate the boards are synchronized at before BAUDRATE is negotiated, set by -S
+#define DEFAULT_SYNC_BAUD_RATE 38400
+static unsigned int g_nSyncBaudRate = DEFAULT_SYNC_BAUD_RATE;
+
+// Board IDs from -B by port, the one of all the ports under ""
+static map<string, string> g_clBoardIds;
+
+// Returns the board ID given for the port, the port name is used if there is none
+static string GetBoardId(const string & strPort)
+{
+    if( g_clBoardIds.count(strPort) )
+        return g_clBoardIds[strPort];
+
+    return g_clBoardIds.count("") ? g_clBoardIds[""] : "";
+}
+
+// Creates the device object for the flashing sequence, NULL if the device is not supported
+static CDeviceBase *CreateDevice(const SFlashData & rfstData)
+{
+    CDeviceBase *pclDevice = NULL;
+
+    if( rfstData.strDevice == "LPC2103" )
+        pclDevice = new CDeviceLPC2103( rfstData.strPortName, rfstData.nCrystalSpeed, rfstData.nBaudRate );
+
+    if( pclDevice )
+    {
+        if( g_pclCaptureLog )
+            pclDevice->SetCaptureLog( g_pclCaptureLog );
+        pclDevice->SetLowLatency( g_bLowLatency );
+        pclDevice->SetVerify( g_bVerify );
+        pclDevice->SetSectorCache( g_pclSectorCache, GetBoardId(rfstData.strPortName) );
+        pclDevice->SetJournalDir( g_strJournalDir );
+        pclDevice->SetSyncBaudRate( g_nSyncBaudRate );
+        return pclDevice;
+    }
+
+    cerr << ERRSTR << rfstData.strPortName << ": device " << rfstData.strDevice << " is not supported!" << endl;
+    return NULL;
+}
+
 void *FlashThread(void *pData)
 {
     SFlashData  *pRealData = (SFlashData *)pData;
-    CDeviceBase *pFlashDevice;
+    CDeviceBase *pFlashDevice = CreateDevice( *pRealData );
   
-    if( pRealData->strDevice == "LPC2103" )
+    if( pFlashDevice )
     {
-        pFlashDevice = new CDeviceLPC2103( pRealData->strPortName, pRealData->nCrystalSpeed, pRealData->stBaudRate );
+	    if( pFlashDevice->InitializeDevice() )
+	        pFlashDevice->FlashDevice(pRealData->strFirmwarePath);
 
-	    pFlashDevice->InitializeDevice();
-	    pFlashDevice->FlashDevice(pRealData->strFirmwarePath);
+        delete pFlashDevice;
     }
 
     delete pRealData;
     return NULL;
 }
 
+// Reads the flash of one board into the file given in place of the firmware
+void *ReadThread(void *pData)
+{
+    SFlashData  *pRealData = (SFlashData *)pData;
+    CDeviceBase *pReadDevice = CreateDevice( *pRealData );
+
+    if( pReadDevice )
+    {
+        if( pReadDevice->InitializeDevice() )
+            pReadDevice->ReadDevice(pRealData->strFirmwarePath);
+
+        delete pReadDevice;
+    }
+
+    delete pRealData;
+    return NULL;
+}
+
+// Flashes all the devices from the current thread using one CFlashEngine
+static void FlashSingleThread(CFlashData & rfclFlashData)
+{
+    CFlashEngine clEngine;
+    vector<CDeviceBase *> clDevices;
+
+    for(unsigned int i=0; i<rfclFlashData.GetDataCount(); i++)
+    {
+        SFlashData stData = rfclFlashData.GetData(i);
+        CDeviceBase *pFlashDevice = CreateDevice( stData );
+
+        if( !pFlashDevice )
+            continue;
+
+        clDevices.push_back( pFlashDevice );
+        clEngine.AddDevice( pFlashDevice, stData.strFirmwarePath );
+    }
+
+    unsigned int nSucceeded = clEngine.Run();
+
+    cout << nSucceeded << " device(s) flashed, " << clEngine.GetFailedCount() << " failed." << endl;
+
+    for(unsigned int i=0; i<clDevices.size(); i++)
+        delete clDevices[i];
+}
+
+//! How often the watch mode looks for finished jobs (ms).
+#define WATCH_REAP_MS 200
+
+// Set by SIGINT/SIGTERM to end the watch mode
+static volatile sig_atomic_t g_bStopWatching = 0;
+
+static void OnStopWatching(int nSignal)
+{
+    g_bStopWatching = 1;
+}
+
+// One board being flashed in the watch mode
+typedef struct SWatchJob_
+{
+    SFlashData stData;
+    pthread_t stThread;
+    pthread_mutex_t stLock;
+    bool bDone;
+    bool bSucceeded;
+} SWatchJob;
+
+static void *WatchJobThread(void *pData)
+{
+    SWatchJob *pstJob = (SWatchJob *)pData;
+    CDeviceBase *pFlashDevice = CreateDevice( pstJob->stData );
+    bool bSucceeded = false;
+
+    if( pFlashDevice )
+    {
+        bSucceeded = pFlashDevice->InitializeDevice() && pFlashDevice->FlashDevice( pstJob->stData.strFirmwarePath );
+        delete pFlashDevice;
+    }
+
+    pthread_mutex_lock( &pstJob->stLock );
+    pstJob->bSucceeded = bSucceeded;
+    pstJob->bDone = true;
+    pthread_mutex_unlock( &pstJob->stLock );
+
+    return NULL;
+}
+
+static SWatchJob *StartWatchJob(const SFlashData & rfstTemplate, const string & strPort)
+{
+    SWatchJob *pstJob = new SWatchJob;
+
+    pstJob->stData = rfstTemplate;
+    pstJob->stData.strPortName = strPort;
+    pstJob->bDone = false;
+    pstJob->bSucceeded = false;
+    pthread_mutex_init( &pstJob->stLock, NULL );
+
+    cout << strPort << ": new port, flashing " << rfstTemplate.strFirmwarePath << " into " << rfstTemplate.strDevice << endl;
+
+    if( pthread_create( &pstJob->stThread, NULL, &WatchJobThread, pstJob ) != SUCCESS )
+    {
+        cerr << ERRSTR << strPort << ": can't start the flashing thread" << endl;
+        pthread_mutex_destroy( &pstJob->stLock );
+        delete pstJob;
+        return NULL;
+    }
+
+    return pstJob;
+}
+
+static bool IsWatchJobDone(SWatchJob *pstJob)
+{
+    pthread_mutex_lock( &pstJob->stLock );
+    bool bDone = pstJob->bDone;
+    pthread_mutex_unlock( &pstJob->stLock );
+
+    return bDone;
+}
+
+/*
+* Watch mode: the PORT of every sequence is a glob pattern, whenever a matching port
+* shows up (an adapter is plugged in) its board is flashed with the rest of the
+* sequence. Runs until SIGINT/SIGTERM, then waits for the running jobs.
+*/
+static int WatchPorts(CFlashData & rfclFlashData)
+{
+    CPortWatcher clWatcher;
+    vector<SFlashData> clTemplates;
+    vector<SPortEvent> clEvents;
+    map<string, SWatchJob *> mapJobs;
+    set<string> setPending;
+    unsigned int nSucceeded = 0, nFailed = 0;
+
+    if( clWatcher.Open() != SUCCESS )
+        return -1;
+
+    for(unsigned int i=0; i<rfclFlashData.GetDataCount(); i++)
+    {
+        clTemplates.push_back( rfclFlashData.GetData(i) );
+        clWatcher.AddPattern( clTemplates[i].strPortName );
+        cout << "Watching " << clTemplates[i].strPortName << " for " << clTemplates[i].strDevice << " boards." << endl;
+    }
+
+    signal(SIGINT, OnStopWatching);
+    signal(SIGTERM, OnStopWatching);
+
+    // the adapters plugged in already are flashed right away
+    clWatcher.Scan( clEvents );
+
+    while( !g_bStopWatching )
+    {
+        for(unsigned int i=0; i<clEvents.size(); i++)
+        {
+            const SPortEvent & stEvent = clEvents[i];
+
+            if( !stEvent.bAdded )
+                cout << stEvent.strPort << ": port removed" << endl;
+            else if( mapJobs.count(stEvent.strPort) )
+                setPending.insert( stEvent.strPort );	// replugged while still flashing
+            else if( SWatchJob *pstJob = StartWatchJob( clTemplates[stEvent.nPattern], stEvent.strPort ) )
+                mapJobs[stEvent.strPort] = pstJob;
+        }
+        clEvents.clear();
+
+        for(map<string, SWatchJob *>::iterator it = mapJobs.begin(); it != mapJobs.end(); )
+        {
+            SWatchJob *pstJob = it->second;
+
+            if( !IsWatchJobDone(pstJob) )
+            {
+                ++it;
+                continue;
+            }
+
+            pthread_join( pstJob->stThread, NULL );
+            pthread_mutex_destroy( &pstJob->stLock );
+
+            if( pstJob->bSucceeded )
+                nSucceeded++;
+            else
+                nFailed++;
+
+            cout << it->first << ": board " << (pstJob->bSucceeded ? "flashed" : "FAILED") << ", "
+                 << nSucceeded << " flashed and " << nFailed << " failed so far." << endl;
+
+            string strPort = it->first;
+            SFlashData stTemplate = pstJob->stData;
+            delete pstJob;
+            mapJobs.erase(it++);
+
+            if( setPending.erase(strPort) )
+            {
+                if( SWatchJob *pstNext = StartWatchJob( stTemplate, strPort ) )
+                    mapJobs[strPort] = pstNext;
+            }
+        }
+
+        if( !clWatcher.Wait( clEvents, WATCH_REAP_MS ) )
+            break;
+    }
+
+    if( !mapJobs.empty() )
+        cout << "Waiting for " << mapJobs.size() << " board(s) being flashed." << endl;
+
+    for(map<string, SWatchJob *>::iterator it = mapJobs.begin(); it != mapJobs.end(); ++it)
+    {
+        pthread_join( it->second->stThread, NULL );
+        pthread_mutex_destroy( &it->second->stLock );
+
+        if( it->second->bSucceeded )
+            nSucceeded++;
+        else
+            nFailed++;
+
+        delete it->second;
+    }
+
+    cout << nSucceeded << " board(s) flashed, " << nFailed << " failed." << endl;
+
+    return 0;
+}
+
 int 
 main(int argc, char ** argv)
 {
@@ -72,10 +355,17 @@ main(int argc, char ** argv)
 	     bPrintVer = false,
 	     bDetectSerial = false,
 	     bRawDump = false,
+	     bSingleThread = false,
+	     bDumpCapture = false,
+	     bWatch = false,
+	     bReadBack = false,
          bFlashingData = false,
          bIsRoot = false;
 
-	string strRawDumpFirmware;
+	string strRawDumpFirmware,
+	       strCaptureFile,
+	       strDumpCaptureFile,
+	       strHashCacheFile;
 
 	if( argc == 1 ) //only the program name is parameter
 	{
@@ -83,6 +373,9 @@ main(int argc, char ** argv)
 		bPrintHelp = true;
 	}
 
+    // a board (TCP server, loopback, replay) hanging up must fail the write, not kill us
+    signal(SIGPIPE, SIG_IGN);
+
     uid_t uid = geteuid();
     gid_t gid = getegid();
 
@@ -112,6 +405,57 @@ main(int argc, char ** argv)
 				bRawDump = true;
 				strRawDumpFirmware = optarg;	
 				break;
+			case OPT_SINGLE_THREAD:
+				bSingleThread = true;
+				break;
+			case OPT_CAPTURE:
+				strCaptureFile = optarg;
+				break;
+			case OPT_DUMP_CAPTURE:
+				bDumpCapture = true;
+				strDumpCaptureFile = optarg;
+				break;
+			case OPT_WATCH:
+				bWatch = true;
+				break;
+			case OPT_LOW_LATENCY:
+				g_bLowLatency = true;
+				break;
+			case OPT_READ_BACK:
+				bReadBack = true;
+				break;
+			case OPT_VERIFY:
+				g_bVerify = true;
+				break;
+			case OPT_JOURNAL:
+				g_strJournalDir = optarg;
+				break;
+			case OPT_HASH_CACHE:
+				strHashCacheFile = optarg;
+				break;
+			case OPT_BOARD_ID:
+				{
+					string strBoardId = optarg;
+					string::size_type nEq = strBoardId.find('=');
+
+					if( nEq == string::npos )
+						g_clBoardIds[""] = strBoardId;
+					else
+						g_clBoardIds[ strBoardId.substr(0, nEq) ] = strBoardId.substr(nEq + 1);
+				}
+				break;
+			case OPT_SYNC_BAUD:
+				{
+					char *pszEnd;
+
+					g_nSyncBaudRate = strtoul(optarg, &pszEnd, 10);
+					if( *optarg == '\0' || *pszEnd != '\0' )
+					{
+						cerr << ERRSTR << "invalid sync baud rate " << optarg << endl;
+						return -1;
+					}
+				}
+				break;
 			case -1:
 				break;
 			default:
@@ -186,16 +530,12 @@ main(int argc, char ** argv)
 		return 0;
 	}
 
+	if( bDumpCapture )
+		return DumpCapture(strDumpCaptureFile) == SUCCESS ? 0 : -1;
+
 	if( bDetectSerial )
 	{
-        if( !bIsRoot )
-        {
-            cerr << "ERROR: Detection of serial ports only works if you are logged in as root!" << endl;
-            return -1;
-        }
-
-		//serial_autodetect();
-        vector<string> clPorts = CSerial::SerialAutodetect();
+        vector<SSerialPortInfo> clPorts = CSerial::SerialAutodetect();
         
         if( clPorts.empty() )
         {
@@ -205,7 +545,34 @@ main(int argc, char ** argv)
         {
             cout << "The following serial ports were detected on your system:" << endl;
             cout << "--------------------------------------------------------" << endl;
-            copy(clPorts.begin(), clPorts.end(), ostream_iterator<string>(cout, "\n"));
+
+            for(unsigned int i=0; i<clPorts.size(); i++)
+            {
+                const SSerialPortInfo & stPort = clPorts[i];
+
+                cout << left << setw(16) << stPort.strDevice;
+
+                if( !stPort.strVendorId.empty() )
+                {
+                    cout << " usb " << stPort.strVendorId << ":" << stPort.strProductId;
+                    if( !stPort.strManufacturer.empty() )
+                        cout << " " << stPort.strManufacturer;
+                    if( !stPort.strProduct.empty() )
+                        cout << " " << stPort.strProduct;
+                    if( !stPort.strSerial.empty() )
+                        cout << " serial " << stPort.strSerial;
+                }
+                else if( !stPort.strDriver.empty() )
+                    cout << " " << stPort.strDriver;
+
+                if( !stPort.bAccessible )
+                    cout << " (no permission, check the group of the device)";
+
+                cout << endl;
+
+                if( !stPort.strById.empty() )
+                    cout << "                 " << stPort.strById << endl;
+            }
         }
 
         return 0;
@@ -219,7 +586,39 @@ main(int argc, char ** argv)
             return -1;
         }
 
-        pthread_t flash_threads[32];
+        CCaptureLog clCaptureLog;
+
+        if( !strCaptureFile.empty() )
+        {
+            if( clCaptureLog.Open(strCaptureFile) != SUCCESS )
+                return -1;
+            g_pclCaptureLog = &clCaptureLog;
+        }
+
+        CSectorCache clSectorCache(strHashCacheFile);
+
+        if( !strHashCacheFile.empty() )
+            g_pclSectorCache = &clSectorCache;
+
+        if( bReadBack && bWatch )
+        {
+            cerr << ERRSTR << "--read_back can't be used in the watch mode" << endl;
+            return -1;
+        }
+
+        if( bWatch )
+            return WatchPorts( clFlashDataArgs );
+
+        if( bReadBack )
+            bSingleThread = false;
+
+        if( bSingleThread )
+        {
+            FlashSingleThread( clFlashDataArgs );
+            return 0;
+        }
+
+        vector<pthread_t> flash_threads( clFlashDataArgs.GetDataCount() );
 
         for(unsigned int i=0; i<clFlashDataArgs.GetDataCount(); i++)
         {
@@ -227,7 +626,7 @@ main(int argc, char ** argv)
             *tmp_data = clFlashDataArgs.GetData(i);
             //cout << *tmp_data << endl;
 
-            pthread_create(&flash_threads[i], NULL, &FlashThread, tmp_data);
+            pthread_create(&flash_threads[i], NULL, bReadBack ? &ReadThread : &FlashThread, tmp_data);
         }
 
         for(unsigned int i=0; i<clFlashDataArgs.GetDataCount(); i++)
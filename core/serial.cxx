@@ -20,12 +20,27 @@
 #include <sstream>
 #include <string>
 #include <set>
+#include <map>
+#include <cstring>
 #include <core/serial.h>
+#include <core/baudrate.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 using namespace std;
 
+//! Latency timer (ms) of the USB serial adapters in the low latency mode.
+#define LOW_LATENCY_TIMER_MS 1
+
+static string ReadSysfsAttr(const string & strPath);
+static string RealPath(const string & strPath);
+
 int
 serial_autodetect(void)
 {
@@ -168,6 +183,91 @@ serial_autodetect(void)
 	return setAlivePorts.size();
 }
 
+// Baud rates which have their own termios constant
+static const struct {
+	unsigned int nBaud;
+	speed_t      stSpeed;
+} rgstStandardSpeeds[] = {
+	{ 50, B50 }, { 75, B75 }, { 110, B110 }, { 134, B134 }, { 150, B150 },
+	{ 200, B200 }, { 300, B300 }, { 600, B600 }, { 1200, B1200 }, { 1800, B1800 },
+	{ 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 }, { 19200, B19200 },
+	{ 38400, B38400 },
+#ifdef B57600
+	{ 57600, B57600 },
+#endif
+#ifdef B115200
+	{ 115200, B115200 },
+#endif
+#ifdef B230400
+	{ 230400, B230400 },
+#endif
+#ifdef B460800
+	{ 460800, B460800 },
+#endif
+#ifdef B500000
+	{ 500000, B500000 },
+#endif
+#ifdef B576000
+	{ 576000, B576000 },
+#endif
+#ifdef B921600
+	{ 921600, B921600 },
+#endif
+#ifdef B1000000
+	{ 1000000, B1000000 },
+#endif
+#ifdef B1152000
+	{ 1152000, B1152000 },
+#endif
+#ifdef B1500000
+	{ 1500000, B1500000 },
+#endif
+#ifdef B2000000
+	{ 2000000, B2000000 },
+#endif
+#ifdef B2500000
+	{ 2500000, B2500000 },
+#endif
+#ifdef B3000000
+	{ 3000000, B3000000 },
+#endif
+#ifdef B3500000
+	{ 3500000, B3500000 },
+#endif
+#ifdef B4000000
+	{ 4000000, B4000000 },
+#endif
+};
+
+#define STANDARD_SPEEDS_COUNT (sizeof(rgstStandardSpeeds) / sizeof(*rgstStandardSpeeds))
+
+bool
+CSerial::BaudToSpeed(unsigned int nBaud, speed_t & stSpeed)
+{
+	for( unsigned int i=0; i<STANDARD_SPEEDS_COUNT; i++ )
+	{
+		if( rgstStandardSpeeds[i].nBaud == nBaud )
+		{
+			stSpeed = rgstStandardSpeeds[i].stSpeed;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+unsigned int
+CSerial::SpeedToBaud(speed_t stSpeed)
+{
+	for( unsigned int i=0; i<STANDARD_SPEEDS_COUNT; i++ )
+	{
+		if( rgstStandardSpeeds[i].stSpeed == stSpeed )
+			return rgstStandardSpeeds[i].nBaud;
+	}
+
+	return 0;
+}
+
 int
 CSerial::Init(void)
 {
@@ -179,14 +279,6 @@ CSerial::Init(void)
 			return FAILURE;
 	}
 
-
-	// Set the port baud rate speed (WARNING: non-standard function this should be resolved) 
-	//if( cfsetspeed(&stTioNew, stBaudRate) != SUCCESS )
-	//	return FAILURE;
-
-	cfsetispeed(&stTioNew, stBaudRate);
-	cfsetospeed(&stTioNew, stBaudRate);
-
 	stTioNew.c_iflag = (IGNBRK | IGNPAR);
 	//stTioNew.c_cflag = (stBaudRate | CS8 | CREAD | CLOCAL | HUPCL);
 	stTioNew.c_cflag |= (CLOCAL | CREAD | HUPCL);
@@ -212,7 +304,9 @@ CSerial::Init(void)
  	//stTioNew.c_lflag |= (ICANON | ECHO | ECHOE);
 
 
-	//stTioNew.c_cc[VTIME] = 5;
+	// reads return whatever is there, the waiting is done with poll()
+	stTioNew.c_cc[VMIN]  = 1;
+	stTioNew.c_cc[VTIME] = 0;
 
 
 	// Clean the port line and activate the settings for the port
@@ -220,18 +314,90 @@ CSerial::Init(void)
 	{
 		if( tcflush(fdSerialDevice, TCIFLUSH | TCOFLUSH) != SUCCESS )
 			return FAILURE;
-	}
 
-	if( fdSerialDevice > BAD_DEVICE )
-	{
-		if( tcsetattr(fdSerialDevice, TCSANOW, &stTioNew) != SUCCESS )
+		if( ApplyBaudRate(TCSANOW) != SUCCESS )
 			return FAILURE;
+
+		if( bLowLatency )
+			ApplyLowLatency();
 	}
 
 	//if we get here then everything went fine
 	return SUCCESS;
 }
 
+int
+CSerial::ApplyBaudRate(int nWhen)
+{
+	speed_t stSpeed;
+	bool bStandardSpeed = BaudToSpeed(nBaudRate, stSpeed);
+
+	// Set the port baud rate speed (WARNING: non-standard function this should be resolved) 
+	//if( cfsetspeed(&stTioNew, stBaudRate) != SUCCESS )
+	//	return FAILURE;
+
+	if( !bStandardSpeed )
+	{
+#ifdef __linux__
+		// just a placeholder, the real rate is set with termios2 below
+		stSpeed = B38400;
+#else
+		// speed_t is the plain baud rate on the BSDs
+		stSpeed = nBaudRate;
+#endif
+	}
+
+	cfsetispeed(&stTioNew, stSpeed);
+	cfsetospeed(&stTioNew, stSpeed);
+
+	if( tcsetattr(fdSerialDevice, nWhen, &stTioNew) != SUCCESS )
+		return FAILURE;
+
+#ifdef __linux__
+	if( !bStandardSpeed && SetCustomBaudRate(fdSerialDevice, nBaudRate) != SUCCESS )
+		return FAILURE;
+#endif
+
+	// find out what the driver really made of our request
+	if( GetCustomBaudRate(fdSerialDevice, nActualBaudRate) != SUCCESS )
+	{
+		struct termios stTioActual;
+
+		nActualBaudRate = 0;
+		if( tcgetattr(fdSerialDevice, &stTioActual) == SUCCESS )
+		{
+			nActualBaudRate = SpeedToBaud( cfgetospeed(&stTioActual) );
+#ifndef __linux__
+			if( nActualBaudRate == 0 )
+				nActualBaudRate = cfgetospeed(&stTioActual);
+#endif
+		}
+	}
+
+	return SUCCESS;
+}
+
+int
+CSerial::SetBaudRate(unsigned int _nBaudRate)
+{
+	unsigned int nOldBaudRate = nBaudRate;
+
+	nBaudRate = _nBaudRate;
+
+	if( fdSerialDevice <= BAD_DEVICE )
+		return SUCCESS;
+
+	// what is still in the output queue goes out at the old rate
+	if( ApplyBaudRate(TCSADRAIN) != SUCCESS )
+	{
+		nBaudRate = nOldBaudRate;
+		ApplyBaudRate(TCSANOW);
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
 
 int
 CSerial::Restore(void)
@@ -252,27 +418,129 @@ CSerial::Open(void)
 	// Open serial device for reading and writing and not as controlling tty
 	// because we don't want to get killed if linenoise sends CTRL-C.
 
-    fdSerialDevice = open(pszDeviceName, O_RDWR | O_NOCTTY ); 
+	// The port stays in non-blocking mode for its whole life, waiting for data
+	// is done with poll() in WaitReadable() instead of toggling the flags.
+    fdSerialDevice = open(strDeviceName.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK ); 
 
 	if (fdSerialDevice < 0) {
-		cout << ERRSTR << "Can't open file " << pszDeviceName << endl;
+		cout << ERRSTR << "Can't open file " << strDeviceName << endl;
 		return FAILURE;
 	}
 	
 	return SUCCESS;
 }
 
+#ifdef __linux__
+// latency_timer of the usb-serial device behind the tty, symlinks like /dev/serial/by-id resolved
+static string
+LatencyTimerPath(const string & strPort)
+{
+	string strDevice = RealPath(strPort);
+
+	return "/sys/class/tty/" + strDevice.substr(strDevice.rfind('/') + 1) + "/device/latency_timer";
+}
+#endif
+
+void
+CSerial::ApplyLowLatency(void)
+{
+	strTuning = "VMIN 1 VTIME 0";
+
+#ifdef __linux__
+	struct serial_struct stSerial;
+
+	if( ioctl(fdSerialDevice, TIOCGSERIAL, &stSerial) != SUCCESS )
+		strTuning += ", no ASYNC_LOW_LATENCY (not supported by the driver)";
+	else if( stSerial.flags & ASYNC_LOW_LATENCY )
+		strTuning += ", ASYNC_LOW_LATENCY (already set)";
+	else
+	{
+		stSerial.flags |= ASYNC_LOW_LATENCY;
+		bSetAsyncLowLatency = ioctl(fdSerialDevice, TIOCSSERIAL, &stSerial) == SUCCESS;
+		strTuning += bSetAsyncLowLatency ? ", ASYNC_LOW_LATENCY" : ", no ASYNC_LOW_LATENCY (refused)";
+	}
+
+	string strTimer = LatencyTimerPath(strDeviceName);
+	string strOld = ReadSysfsAttr(strTimer);
+	unsigned int nOld = atoi(strOld.c_str());
+	stringstream ssReport;
+
+	// not an adapter with a latency timer
+	if( strOld.empty() )
+		return;
+
+	if( nOld <= LOW_LATENCY_TIMER_MS )
+		ssReport << ", latency_timer " << nOld << " ms";
+	else
+	{
+		ofstream fTimer(strTimer.c_str());
+
+		fTimer << LOW_LATENCY_TIMER_MS << endl;
+		fTimer.close();
+
+		if( !fTimer.fail() && atoi(ReadSysfsAttr(strTimer).c_str()) == LOW_LATENCY_TIMER_MS )
+		{
+			nOldLatencyTimer = nOld;
+			ssReport << ", latency_timer " << nOld << " -> " << LOW_LATENCY_TIMER_MS << " ms";
+		}
+		else
+			ssReport << ", latency_timer " << nOld << " ms (" << strTimer << " not writable)";
+	}
+
+	strTuning += ssReport.str();
+#endif
+}
+
+void
+CSerial::UndoLowLatency(void)
+{
+#ifdef __linux__
+	struct serial_struct stSerial;
+
+	if( bSetAsyncLowLatency && ioctl(fdSerialDevice, TIOCGSERIAL, &stSerial) == SUCCESS )
+	{
+		stSerial.flags &= ~ASYNC_LOW_LATENCY;
+		ioctl(fdSerialDevice, TIOCSSERIAL, &stSerial);
+	}
+
+	if( nOldLatencyTimer )
+	{
+		ofstream fTimer(LatencyTimerPath(strDeviceName).c_str());
+
+		fTimer << nOldLatencyTimer << endl;
+	}
+#endif
+
+	bSetAsyncLowLatency = false;
+	nOldLatencyTimer = 0;
+}
+
 void
 CSerial::Close(void)
 {
-	close(fdSerialDevice);
+	if( fdSerialDevice > BAD_DEVICE )
+	{
+		UndoLowLatency();
+		close(fdSerialDevice);
+	}
+
+	fdSerialDevice = BAD_DEVICE;
 }
 
 unsigned char
 CSerial::Read(void)
 {
-	unsigned char uByte;
-	read(fdSerialDevice, &uByte, 1);
+	unsigned char uByte = 0;
+
+	while( read(fdSerialDevice, &uByte, 1) != 1 )
+	{
+		if( errno != EAGAIN && errno != EINTR )
+			break;
+
+		if( WaitReadable(-1) == FAILURE )
+			break;
+	}
+
 	return uByte;
 }
 
@@ -306,31 +574,10 @@ CSerial::GetReady(void)
 
 }
 
-int 
-CSerial::Read_NonBlock(unsigned char *rgBuffer, int nToRead)
-{
-	int current_settings = fcntl( fdSerialDevice, F_GETFL );
-
-	fcntl( fdSerialDevice, F_SETFL, current_settings | O_NONBLOCK );
-	int to_ret = read( fdSerialDevice, rgBuffer, nToRead );
-	fcntl( fdSerialDevice, F_SETFL, current_settings );
-
-	return to_ret;
-}
-
 void
 CSerial::Write(unsigned char u8Byte)
 {
-	write(fdSerialDevice, &u8Byte, 1);
-	//tcdrain(fdSerialDevice);
-}
-
-size_t
-CSerial::Write(const unsigned char *rgu8Bytes, const unsigned int nLength)
-{
-	//Flush();
-	//FlushI();
-	return write(fdSerialDevice, (void *)rgu8Bytes, nLength);
+	Write(&u8Byte, 1);
 	//tcdrain(fdSerialDevice);
 }
 
@@ -354,5 +601,202 @@ CSerial::FlushO(void)
 	tcflush(fdSerialDevice, TCOFLUSH);
 }
 
+int
+CPtyPort::Init(void)
+{
+	if( tcgetattr(fdSerialDevice, &stTioNew) != SUCCESS )
+		return FAILURE;
+
+	stTioNew.c_iflag = (IGNBRK | IGNPAR);
+	stTioNew.c_oflag = 0;
+	stTioNew.c_lflag = 0;
+	stTioNew.c_cflag &= ~(PARENB | CSTOPB | CSIZE);
+	stTioNew.c_cflag |= (CS8 | CLOCAL | CREAD);
+	// a read of 0 bytes is the hang up then, not an empty line
+	stTioNew.c_cc[VMIN]  = 1;
+	stTioNew.c_cc[VTIME] = 0;
+
+	if( tcflush(fdSerialDevice, TCIOFLUSH) != SUCCESS )
+		return FAILURE;
+
+	return tcsetattr(fdSerialDevice, TCSANOW, &stTioNew);
+}
+
+// Reads the first line of a sysfs attribute, empty if there is no such attribute
+static string
+ReadSysfsAttr(const string & strPath)
+{
+	ifstream fAttr(strPath.c_str());
+	string strLine;
+
+	getline(fAttr, strLine);
+
+	string::size_type nEnd = strLine.find_last_not_of(" \t\r\n");
+	return nEnd == string::npos ? "" : strLine.substr(0, nEnd + 1);
+}
+
+// Resolves all the links in the path, empty if it does not exist
+static string
+RealPath(const string & strPath)
+{
+	char rgResolved[PATH_MAX];
+
+	if( !realpath(strPath.c_str(), rgResolved) )
+		return "";
+
+	return rgResolved;
+}
+
+// ttyUSB2 goes before ttyUSB10
+static bool
+EarlierPort(const SSerialPortInfo & x, const SSerialPortInfo & y)
+{
+	string::size_type nX = x.strDevice.find_last_not_of("0123456789") + 1;
+	string::size_type nY = y.strDevice.find_last_not_of("0123456789") + 1;
+	int nCmp = x.strDevice.compare(0, nX, y.strDevice, 0, nY);
+
+	if( nCmp != 0 )
+		return nCmp < 0;
+
+	return atol(x.strDevice.c_str() + nX) < atol(y.strDevice.c_str() + nY);
+}
+
+/*
+* Linux: every tty backed by a device is in /sys/class/tty, everything about it can
+* be read from there without opening (and so without toggling DTR/RTS of) the port.
+* Returns false if there is no sysfs.
+*/
+static bool
+ScanSysfsPorts(vector<SSerialPortInfo> & clPorts)
+{
+	DIR *pDir = opendir("/sys/class/tty");
+	struct dirent *pEntry;
+	map<string, string> mapById;
+
+	if( !pDir )
+		return false;
+
+	// the persistent names udev made for the ports, by the device they point to
+	DIR *pByIdDir = opendir("/dev/serial/by-id");
+	if( pByIdDir )
+	{
+		while( (pEntry = readdir(pByIdDir)) != NULL )
+		{
+			string strLink = string("/dev/serial/by-id/") + pEntry->d_name;
+
+			if( pEntry->d_name[0] != '.' )
+				mapById[RealPath(strLink)] = strLink;
+		}
+		closedir(pByIdDir);
+	}
+
+	while( (pEntry = readdir(pDir)) != NULL )
+	{
+		string strSys = string("/sys/class/tty/") + pEntry->d_name;
+		string strDevice = RealPath(strSys + "/device");
+		SSerialPortInfo stPort;
+
+		// virtual consoles, ptys and friends have no device
+		if( pEntry->d_name[0] == '.' || strDevice.empty() )
+			continue;
+
+		// serial8250 registers all its slots, the ones without a UART have type 0
+		string strType = ReadSysfsAttr(strSys + "/type");
+		if( !strType.empty() && atoi(strType.c_str()) == 0 )
+			continue;
+
+		stPort.strDevice = string("/dev/") + pEntry->d_name;
+		stPort.strById   = mapById[stPort.strDevice];
+
+		string strDriver = RealPath(strSys + "/device/driver");
+		stPort.strDriver = strDriver.substr(strDriver.rfind('/') + 1);
+
+		// the USB device is the first parent having the ids
+		for(string strDir = strDevice; strDir.length() > strlen("/sys/devices"); strDir.erase(strDir.rfind('/')))
+		{
+			if( access((strDir + "/idVendor").c_str(), R_OK) != SUCCESS )
+				continue;
+
+			stPort.strVendorId     = ReadSysfsAttr(strDir + "/idVendor");
+			stPort.strProductId    = ReadSysfsAttr(strDir + "/idProduct");
+			stPort.strManufacturer = ReadSysfsAttr(strDir + "/manufacturer");
+			stPort.strProduct      = ReadSysfsAttr(strDir + "/product");
+			stPort.strSerial       = ReadSysfsAttr(strDir + "/serial");
+			break;
+		}
+
+		stPort.bAccessible = access(stPort.strDevice.c_str(), R_OK | W_OK) == SUCCESS;
+		clPorts.push_back(stPort);
+	}
+
+	closedir(pDir);
+	return true;
+}
+
+// Elsewhere the serial port names of the known systems are looked for in /dev
+static void
+ScanDevPorts(vector<SSerialPortInfo> & clPorts)
+{
+	const char *rgPrefixes[] = {
+		"ttyS", "ttyUSB", "ttyACM",		// Linux
+		"ttyU", "cuaU", "ttyu", "cuau",	// the BSDs
+		"tty0",							// OpenBSD / Digital UNIX
+		"ttyf",							// IRIX
+		"ttya", "ttyb", "ttyc", "ttyd"	// Sun-OS/Solaris
+	};
+	DIR *pDir = opendir("/dev");
+	struct dirent *pEntry;
+
+	if( !pDir )
+		return;
+
+	while( (pEntry = readdir(pDir)) != NULL )
+	{
+		string strName = pEntry->d_name;
+		bool bCandidate = false;
 
+		for(unsigned int i=0; i<sizeof(rgPrefixes) / sizeof(*rgPrefixes) && !bCandidate; i++)
+			bCandidate = strName.compare(0, strlen(rgPrefixes[i]), rgPrefixes[i]) == 0;
 
+		if( !bCandidate )
+			continue;
+
+		SSerialPortInfo stPort;
+		struct termios stTio;
+
+		stPort.strDevice = "/dev/" + strName;
+
+		// non-blocking, so a port without carrier does not hang the scan
+		int fdPort = open(stPort.strDevice.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+		if( fdPort < 0 )
+		{
+			// it is there, only not ours
+			stPort.bAccessible = false;
+			if( errno == EACCES )
+				clPorts.push_back(stPort);
+			continue;
+		}
+
+		stPort.bAccessible = true;
+		if( tcgetattr(fdPort, &stTio) == SUCCESS )
+			clPorts.push_back(stPort);
+
+		close(fdPort);
+	}
+
+	closedir(pDir);
+}
+
+vector<SSerialPortInfo>
+CSerial::SerialAutodetect(void)
+{
+	vector<SSerialPortInfo> clPorts;
+
+	if( !ScanSysfsPorts(clPorts) )
+		ScanDevPorts(clPorts);
+
+	sort(clPorts.begin(), clPorts.end(), EarlierPort);
+
+	return clPorts;
+}
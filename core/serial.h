@@ -16,6 +16,7 @@
 
 #include <termios.h>
 #include <core/defs.h>
+#include <core/transport.h>
 #include <string>
 #include <vector>
 #include <iostream>
@@ -30,9 +31,6 @@ using namespace std;
 //	#define DEF_PREFIX "/dev/" 
 //#endif
 
-//! Represents an unitialized file descriptor.
-#define BAD_DEVICE -1
-
 /**
 *\fn serial_autodetect(void)
 *\author Gabriel Zabusek
@@ -46,6 +44,28 @@ using namespace std;
 */
 extern int serial_autodetect(void);
 
+/**
+* Serial port found by CSerial::SerialAutodetect().
+*/
+typedef struct SSerialPortInfo_
+{
+	//! Device node, ie. /dev/ttyUSB0
+	string strDevice;
+	//! Persistent /dev/serial/by-id link to the device, empty if there is none
+	string strById;
+	//! Kernel driver of the port, empty if unknown
+	string strDriver;
+	//! USB vendor and product id (hex), empty for ports not on USB
+	string strVendorId,
+	       strProductId;
+	//! USB manufacturer, product and serial number strings, if the device has them
+	string strManufacturer,
+	       strProduct,
+	       strSerial;
+	//! The port could be opened by this user (otherwise ie. not in the dialout group)
+	bool bAccessible;
+} SSerialPortInfo;
+
 /**
 *\class CSerial
 *\author Gabriel Zabusek
@@ -56,9 +76,9 @@ extern int serial_autodetect(void);
 * use it in our project.
 */
 
-class CSerial {
+class CSerial : public CTransport {
 
-	private:
+	protected:
 		//! File descriptor of currently open serial port
 		int fdSerialDevice;
 
@@ -66,24 +86,57 @@ class CSerial {
 		struct termios stTioOld,
                        stTioNew;
 
-		//! Zero terminated string for the serial device
-		const char *pszDeviceName;
+		//! Name of the serial device, a copy so the caller's string may go away
+		string strDeviceName;
 
 		//! Baud rate used to communicate with the currently open serial device
-		speed_t stBaudRate;
+		unsigned int nBaudRate;
+
+		//! Baud rate the driver reported back after Init(), 0 if not known
+		unsigned int nActualBaudRate;
+
+		//! Tune the port for low latency in Init()
+		bool bLowLatency;
+
+		//! The tunings applied by Init(), for the report
+		string strTuning;
+
+		//! Set if we turned ASYNC_LOW_LATENCY on, so Close() turns it off again
+		bool bSetAsyncLowLatency;
+
+		//! Latency timer of the USB adapter before we lowered it, 0 if not touched
+		unsigned int nOldLatencyTimer;
+
+		/**
+		*\brief Sets ASYNC_LOW_LATENCY and lowers the latency timer of the USB adapter.
+		*
+		* Everything is optional, what could be done is described in strTuning.
+		*/
+		void ApplyLowLatency(void);
+
+		//! Puts back what ApplyLowLatency() changed.
+		void UndoLowLatency(void);
+
+		/**
+		*\brief Sets nBaudRate into stTioNew and activates it on the port.
+		*@param nWhen TCSANOW or TCSADRAIN, passed to tcsetattr().
+		*/
+		int ApplyBaudRate(int nWhen);
 
 	public:
 
 		/**
 		*\brief CSerial constructor
 		*@param _pszDeviceName The device to open, for instance /dev/ttyS0
-		*@param _stBaudRate The baud rate used to communicate with this device
+		*@param _nBaudRate The baud rate used to communicate with this device
 		*
 		* Simply sets the device we want to work with and the baud rate we want to use
-		* to communicate with this device.
+		* to communicate with this device. Any integer baud rate is accepted, the standard
+		* Bxxx speeds are used where they exist, see Init().
 		*/
-		CSerial(const char *_pszDeviceName, speed_t _stBaudRate)
-			: pszDeviceName(_pszDeviceName), stBaudRate(_stBaudRate) 
+		CSerial(const char *_pszDeviceName, unsigned int _nBaudRate)
+			: strDeviceName(_pszDeviceName), nBaudRate(_nBaudRate), nActualBaudRate(0),
+			  bLowLatency(false), bSetAsyncLowLatency(false), nOldLatencyTimer(0)
 		{
 			fdSerialDevice = BAD_DEVICE;
 		};
@@ -95,11 +148,56 @@ class CSerial {
 		*\brief Initializes the serial port.
 		*@return FAILURE if error occures and SUCCESS if everything went fine.
 		*
-		* Initializes the serial port with speed given in the constructor.
-		*@see CSerial(const char *_pszDeviceName, speed_t _stBaudRate)
+		* Initializes the serial port with speed given in the constructor. Rates without
+		* a Bxxx constant are set with termios2/BOTHER on linux and passed to cfsetspeed
+		* directly on the BSDs. The rate the driver really uses is then available from
+		* GetActualBaudRate().
+		*@see CSerial(const char *_pszDeviceName, unsigned int _nBaudRate)
 		*/
 		int Init(void);
 
+		//! Returns DEVICE_CONN_TYPE_SERIAL.
+		DeviceConnectionType GetType(void) const { return DEVICE_CONN_TYPE_SERIAL; }
+
+		//! Returns the baud rate requested in the constructor.
+		unsigned int GetBaudRate(void) const { return nBaudRate; }
+
+		//! Returns the baud rate reported by the driver after Init(), 0 if unknown.
+		unsigned int GetActualBaudRate(void) const { return nActualBaudRate; }
+
+		/**
+		*\brief Changes the baud rate of the port.
+		*@return FAILURE if the driver refuses the rate.
+		*
+		* On an open port the rate is switched on the live descriptor once the output
+		* queue drained, the other settings stay. Otherwise it is just remembered for Init().
+		*/
+		int SetBaudRate(unsigned int _nBaudRate);
+
+		/**
+		*\brief Asks Init() for the low latency tuning.
+		*
+		* The port gets ASYNC_LOW_LATENCY (TIOCSSERIAL), the latency timer of a USB
+		* adapter (FTDI and friends, 16 ms by default) is lowered to 1 ms where the
+		* sysfs attribute is writable and reads return every byte at once (VMIN 1,
+		* VTIME 0). Close() puts the driver settings back.
+		*/
+		void SetLowLatency(bool _bLowLatency) { bLowLatency = _bLowLatency; }
+
+		//! Returns the tunings applied by Init(), empty without SetLowLatency().
+		string GetTuning(void) const { return strTuning; }
+
+		/**
+		*\brief Looks up the standard termios constant for the baud rate.
+		*@param nBaud The baud rate, ie. 115200.
+		*@param stSpeed Output, the matching Bxxx constant.
+		*@return false if there is no such constant.
+		*/
+		static bool BaudToSpeed(unsigned int nBaud, speed_t & stSpeed);
+
+		//! Converts the standard termios constant back to the baud rate, 0 if unknown.
+		static unsigned int SpeedToBaud(speed_t stSpeed);
+
 		/**
 		*\brief Restores the original serial port settings.
 		*@return FAILURE on error SUCCESS if everything goes ok.
@@ -113,7 +211,8 @@ class CSerial {
 		*@return FAILURE on error SUCCESS if everything goes ok.
 		*
 		* Open serial device for reading and writing, however not as controlling tty
-		* since we dont want to get killed if we recieve ctrl+c character.
+		* since we dont want to get killed if we recieve ctrl+c character. The port is
+		* opened in O_NONBLOCK mode, use WaitReadable() to wait for incoming data.
 		*/
 		int Open(void);
 
@@ -130,23 +229,16 @@ class CSerial {
 		*@return The byte read.
 		*
 		* Reads one byte from the serial line, note that this function blocks the 
-		* current thread until there is some byte/character available on the line.
+		* current thread (in WaitReadable) until there is some byte/character available
+		* on the line.
 		*/
 		unsigned char Read(void);
 
 		string ReadLine(void);
 		unsigned int GetReady(void);
 
-		/**
-		*\brief Reads nToRead bytes from the serial line.
-		*
-		* Reads nToRead bytes from the serial line, note that this function doesnt block
-		*
-		*@return The number of bytes actually read		
-		*@param rgBuffer the output buffer
-		*@param nToRead number of bytes to read
-		*/
-		int Read_NonBlock(unsigned char *rgBuffer, int nToRead);
+		//! Returns the file descriptor of the open port (BAD_DEVICE if not open).
+		int GetFd(void) const { return fdSerialDevice; }
 
 		/**
 		*\brief Writes one byte to the serial line.
@@ -154,129 +246,52 @@ class CSerial {
 		*/
 		void Write(unsigned char u8Byte);
 
-		/**
-		*\brief Writes an array of bytes to the serial line.
-		*@param pu8Byte The array byte to be written.
-		*@param nLength The length of the given array.
-		*/
-		size_t Write(const unsigned char *rgu8Bytes, const unsigned int nLength);
+		// the array version comes from CTransport
+		using CTransport::Write;
 
-        /**
-		*\brief Returns array of available serial ports on the system.
+		/**
+		*\brief Returns the serial ports available on the system.
 		*
-		* Returns vector of strings containing names of available serial port devices.
+		* On Linux the ports are enumerated from /sys/class/tty (only the ttys backed by
+		* a device, the 8250 slots without a UART are skipped using their sysfs type) and
+		* matched with the /dev/serial/by-id links, the USB ones get the vendor, product
+		* and serial number of their USB device. No port is opened there, access() tells
+		* whether we may use it, so DTR/RTS of the boards attached are not toggled.
+		* Without sysfs the usual serial port names in /dev are tried, each candidate is
+		* opened non-blocking once to see whether it is a tty we may use. No shell is run,
+		* root is not needed and the scan takes milliseconds.
 		*
-		*@return Vector of strings containing names of available serial port devices
+		*@return The detected ports sorted by name.
+		*/
+		static vector<SSerialPortInfo> SerialAutodetect(void);
+};
+
+/**
+*\class CPtyPort
+*\author Gabriel Zabusek
+*\brief Slave side of a pseudo terminal, for instance a board simulator.
+*
+* A pty is a tty, so everything works like with CSerial, only Init() puts the line
+* into raw mode without touching the speed, which means nothing on a pty.
+*/
+
+class CPtyPort : public CSerial {
+
+	public:
+		//! Sets the pty slave to open, ie. /dev/pts/3
+		CPtyPort(const char *_pszDeviceName) : CSerial(_pszDeviceName, 0) {}
+
+		//! Returns DEVICE_CONN_TYPE_PTY.
+		DeviceConnectionType GetType(void) const { return DEVICE_CONN_TYPE_PTY; }
+
+		//! The speed means nothing on a pty, accepted so the ISP side can still negotiate it.
+		int SetBaudRate(unsigned int _nBaudRate) { return SUCCESS; }
+
+		/**
+		*\brief Puts the pty into raw mode.
+		*@return FAILURE if error occures and SUCCESS if everything went fine.
 		*/
-		static vector<string> SerialAutodetect()
-        {
-                vector<string> clToRet;
-                char * rgDevices[] = {
-                    "/dev/ttyS0", //Linux
-                    "/dev/ttyS1",
-                    "/dev/ttyS2",
-                    "/dev/ttyS3",
-                    "/dev/tty00", // OpenBSD / Digital UNIX
-                    "/dev/tty01",
-                    "/dev/tty02",
-                    "/dev/tty03",
-                    "/dev/ttyU0",
-                    "/dev/ttyU1",
-                    "/dev/ttyU2",
-                    "/dev/ttyU3",
-                    "/dev/ttyUSB0", //Linux
-                    "/dev/ttyUSB1",
-                    "/dev/ttyUSB2",
-                    "/dev/ttyUSB3",
-                    "/dev/ttyf0", // IRIX
-                    "/dev/ttyf1",
-                    "/dev/ttyf2",
-                    "/dev/ttyf3",
-                    "/dev/tty1p0", // HP-UX
-                    "/dev/tty2p0",
-                    "/dev/tty3p0",
-                    "/dev/tty3p0",
-                    "/dev/ttya", // Sun-OS/Solaris
-                    "/dev/ttyb",
-                    "/dev/ttyc",
-                    "/dev/ttyd"
-                };
-                char rgPipeBuffer[4096];
-                vector<string> clPossiblePorts(rgDevices, rgDevices + (sizeof(rgDevices) / sizeof(*rgDevices)) );
-                FILE *fd;
-                string strPipeResult;
-                bool bSttyArgument = false; // false for -f true for -F
-
-                // first we must find out if we want to execute stty -f OR stty -F instead... :*(
-                fd = popen("stty -f /dev/ttyS0 2>&1", "r");
-                if (fd == NULL)
-                {
-                    cerr << "Error opening pipe while detecting serial ports!" << endl;
-                    return clToRet;                    
-                }
-
-                while (fgets(rgPipeBuffer, 4096, fd) != NULL)
-                {
-                    strPipeResult += rgPipeBuffer;
-                }
-                if( pclose(fd) == -1 )
-                {
-                    cout << "Pipe closing error!" << endl;
-                    return clToRet;
-                }
-
-                //cout << endl << "::" << strPipeResult << endl << "::" << endl;
-
-                // if the result contains 'invalid' we must use -F
-                if( strPipeResult.find( "invalid" ) != string::npos )
-                    bSttyArgument = true;
-                else
-                    bSttyArgument = false;
-
-                string strCmdStart, strCmdEnd;
-                
-                if( bSttyArgument )
-                    strCmdStart = "stty -F ";
-                else
-                    strCmdStart = "stty -f ";
-
-                strCmdEnd = " 2>&1";
-
-                for(unsigned int i=0; i<clPossiblePorts.size(); i++)
-                {
-                    string strCurrentCommand = strCmdStart + clPossiblePorts[i] + strCmdEnd;
-                    strPipeResult = "";
-
-                    fd = popen(strCurrentCommand.c_str(), "r");
-                    if (fd == NULL)
-                    {
-                        cerr << "Error opening pipe while detecting serial ports!" << endl;
-                        return clToRet;                    
-                    }
-
-                    while (fgets(rgPipeBuffer, 4096, fd) != NULL)
-                    {
-                        strPipeResult += rgPipeBuffer;
-                    }
-
-                    if( pclose(fd) == -1 )
-                    {
-                        cout << "Pipe closing error!" << endl;
-                        return clToRet;
-                    }
-
-                    if( (strPipeResult.find("speed") != string::npos)  || 
-                        (strPipeResult.find("baud") != string::npos)   ||
-                        (strPipeResult.find("ispeed") != string::npos) ||
-                        (strPipeResult.find("ospeed") != string::npos) 
-                      )
-                    {
-                        clToRet.push_back( clPossiblePorts[i] );
-                    }
-                }
-          
-                return clToRet;
-        }
+		int Init(void);
 };
 
 #endif
@@ -0,0 +1,88 @@
+/*!\file  tcpport.cxx  Connection to a TCP serial server
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <core/tcpport.h>
+#include <iostream>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+int
+CTcpPort::Open(void)
+{
+	struct addrinfo stHints, *pstResult, *pstAddr;
+	string::size_type nColon = strAddress.rfind(':');
+	int nErr;
+
+	if( nColon == string::npos || nColon == 0 || nColon + 1 == strAddress.length() )
+	{
+		cout << ERRSTR << "TCP port must be given as host:port, not " << strAddress << endl;
+		return FAILURE;
+	}
+
+	string strHost = strAddress.substr(0, nColon);
+	string strService = strAddress.substr(nColon + 1);
+
+	memset(&stHints, 0, sizeof(stHints));
+	stHints.ai_family   = AF_UNSPEC;
+	stHints.ai_socktype = SOCK_STREAM;
+
+	if( (nErr = getaddrinfo(strHost.c_str(), strService.c_str(), &stHints, &pstResult)) != 0 )
+	{
+		cout << ERRSTR << "Can't resolve " << strAddress << ": " << gai_strerror(nErr) << endl;
+		return FAILURE;
+	}
+
+	// connecting blocks, it happens only once per session
+	for(pstAddr = pstResult; pstAddr; pstAddr = pstAddr->ai_next)
+	{
+		fdSocket = socket(pstAddr->ai_family, pstAddr->ai_socktype, pstAddr->ai_protocol);
+		if( fdSocket < 0 )
+			continue;
+
+		if( connect(fdSocket, pstAddr->ai_addr, pstAddr->ai_addrlen) == SUCCESS )
+			break;
+
+		close(fdSocket);
+		fdSocket = BAD_DEVICE;
+	}
+
+	freeaddrinfo(pstResult);
+
+	if( fdSocket < 0 )
+	{
+		cout << ERRSTR << "Can't connect to " << strAddress << endl;
+		fdSocket = BAD_DEVICE;
+		return FAILURE;
+	}
+
+	int nOn = 1;
+	setsockopt(fdSocket, IPPROTO_TCP, TCP_NODELAY, &nOn, sizeof(nOn));
+	fcntl(fdSocket, F_SETFL, fcntl(fdSocket, F_GETFL) | O_NONBLOCK);
+
+	return SUCCESS;
+}
+
+void
+CTcpPort::Close(void)
+{
+	if( fdSocket > BAD_DEVICE )
+		close(fdSocket);
+
+	fdSocket = BAD_DEVICE;
+}
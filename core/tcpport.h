@@ -0,0 +1,67 @@
+/*!\file  tcpport.h  Connection to a TCP serial server
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __TCPPORT_H
+#define __TCPPORT_H
+
+#include <core/transport.h>
+#include <string>
+
+using namespace std;
+
+/**
+*\class CTcpPort
+*\author Gabriel Zabusek
+*\brief Serial port exported over TCP by a serial server (ser2net in raw mode etc.).
+*
+* The bytes go to the board unchanged, the line settings (baud rate included) are
+* the business of the server. Nagle is switched off, the ISP talk is made of
+* small commands waiting for small replies.
+*/
+
+class CTcpPort : public CTransport {
+
+	private:
+		//! The socket, BAD_DEVICE if not connected.
+		int fdSocket;
+
+		//! "host:port" as given after the tcp: prefix.
+		string strAddress;
+
+	public:
+		//! Sets the server to connect to, ie. "localhost:3001".
+		CTcpPort(const string & _strAddress) : fdSocket(BAD_DEVICE), strAddress(_strAddress) {}
+
+		//! Closes the connection.
+		~CTcpPort(void) { Close(); }
+
+		/**
+		*\brief Connects to the server.
+		*@return FAILURE on error SUCCESS if everything goes ok.
+		*/
+		int Open(void);
+
+		//! Nothing to set up, the server owns the line settings.
+		int Init(void) { return SUCCESS; }
+
+		//! Closes the connection.
+		void Close(void);
+
+		//! Returns the socket (BAD_DEVICE if not connected).
+		int GetFd(void) const { return fdSocket; }
+
+		//! Returns DEVICE_CONN_TYPE_TCP.
+		DeviceConnectionType GetType(void) const { return DEVICE_CONN_TYPE_TCP; }
+};
+
+#endif
@@ -0,0 +1,31 @@
+/*!\file  timer.cxx  Monotonic time helpers
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <core/timer.h>
+#include <time.h>
+
+uint64_t
+GetMonotonicNs(void)
+{
+	struct timespec stNow;
+
+	clock_gettime(CLOCK_MONOTONIC, &stNow);
+
+	return (uint64_t)stNow.tv_sec * 1000000000 + (uint64_t)stNow.tv_nsec;
+}
+
+uint64_t
+GetMonotonicMs(void)
+{
+	return GetMonotonicNs() / 1000000;
+}
@@ -0,0 +1,35 @@
+/*!\file  timer.h  Monotonic time helpers
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __TIMER_H
+#define __TIMER_H
+
+#include <stdint.h>
+
+/**
+*\fn GetMonotonicMs(void)
+*\brief Returns the monotonic clock in milliseconds.
+*
+* The value has no meaning on its own, it is only good for measuring intervals and
+* computing deadlines since it does not jump when the wall clock is changed.
+*/
+extern uint64_t GetMonotonicMs(void);
+
+/**
+*\fn GetMonotonicNs(void)
+*\brief Returns the monotonic clock in nanoseconds.
+*@see GetMonotonicMs()
+*/
+extern uint64_t GetMonotonicNs(void);
+
+#endif
@@ -0,0 +1,198 @@
+/*!\file  transport.cxx  Byte stream connection to a device
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <core/transport.h>
+#include <core/serial.h>
+#include <core/tcpport.h>
+#include <core/timer.h>
+#include <sim/CLoopbackPort.h>
+#include <sim/CReplayPort.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+int
+CTransport::WaitForEvents(int fdDevice, short nEvents, int nTimeoutMs)
+{
+	struct pollfd stPollFd;
+	int nRet;
+
+	stPollFd.fd      = fdDevice;
+	stPollFd.events  = nEvents;
+	stPollFd.revents = 0;
+
+	do {
+		nRet = poll(&stPollFd, 1, nTimeoutMs);
+	} while( nRet < 0 && errno == EINTR );
+
+	if( nRet < 0 )
+		return FAILURE;
+
+	// a hung up port stays "ready" forever, nothing would ever come from it
+	if( nRet > 0 && (stPollFd.revents & (POLLERR | POLLHUP | POLLNVAL)) )
+		return FAILURE;
+
+	return nRet;
+}
+
+int
+CTransport::WaitReadable(int nTimeoutMs)
+{
+	return WaitForEvents(GetFd(), POLLIN, nTimeoutMs);
+}
+
+int
+CTransport::WaitWritable(int nTimeoutMs)
+{
+	return WaitForEvents(GetFd(), POLLOUT, nTimeoutMs);
+}
+
+int
+CTransport::Read_NonBlock(unsigned char *rgBuffer, int nToRead)
+{
+	// the descriptor is always O_NONBLOCK (see the Open() of the transports)
+	int nRead = read( GetFd(), rgBuffer, nToRead );
+
+	if( m_pclCapture && nRead > 0 )
+		Capture(GetMonotonicNs(), CAPTURE_REC_RX, rgBuffer, nRead);
+
+	return nRead;
+}
+
+size_t
+CTransport::Write(const unsigned char *rgu8Bytes, const unsigned int nLength)
+{
+	size_t nWritten = 0;
+
+	while( nWritten < nLength )
+	{
+		uint64_t nTimeNs = m_pclCapture ? GetMonotonicNs() : 0;
+		ssize_t nRet = write(GetFd(), (void *)(rgu8Bytes + nWritten), nLength - nWritten);
+
+		if( nRet > 0 )
+		{
+			if( m_pclCapture )
+				Capture(nTimeNs, CAPTURE_REC_TX, rgu8Bytes + nWritten, nRet);
+
+			nWritten += nRet;
+			continue;
+		}
+
+		if( nRet < 0 && errno == EINTR )
+			continue;
+
+		// output queue is full, wait until the line takes some more data
+		if( nRet < 0 && errno == EAGAIN && WaitWritable(SERIAL_WRITE_TIMEOUT_MS) > 0 )
+			continue;
+
+		break;
+	}
+
+	return nWritten;
+}
+
+void
+CTransport::Flush(void)
+{
+	FlushI();
+	FlushO();
+}
+
+void
+CTransport::FlushI(void)
+{
+	unsigned char rgBuffer[256];
+
+	// a stream has no input queue to drop, so read out whatever arrived
+	while( Read_NonBlock(rgBuffer, sizeof(rgBuffer)) > 0 )
+		;
+}
+
+void
+CTransport::FlushO(void)
+{
+	// what was written to a stream is gone already
+}
+
+int
+CTransport::GetOutputQueue(void) const
+{
+	int nQueued;
+
+	// TIOCOUTQ works on ttys, ptys and (as SIOCOUTQ) on the sockets
+	if( ioctl(GetFd(), TIOCOUTQ, &nQueued) != SUCCESS )
+		return FAILURE;
+
+	return nQueued;
+}
+
+void
+CTransport::StartCapture(CCaptureLog *pclLog, const string & strName)
+{
+	FlushCapture();
+
+	m_pclCapture   = pclLog;
+	m_nCapturePort = pclLog ? pclLog->AddPort(strName) : 0;
+}
+
+void
+CTransport::Capture(uint64_t nTimeNs, CaptureRecordType eType, const unsigned char *rgu8Data, unsigned int nLength)
+{
+	CCaptureLog::AddRecord(m_strCapture, nTimeNs, m_nCapturePort, eType, rgu8Data, nLength);
+
+	if( m_strCapture.length() >= CAPTURE_BUFFER_SIZE )
+		FlushCapture();
+}
+
+void
+CTransport::FlushCapture(void)
+{
+	if( m_pclCapture && !m_strCapture.empty() )
+		m_pclCapture->Append(m_strCapture);
+
+	m_strCapture.clear();
+}
+
+// Returns true and the rest of the name if it starts with the prefix
+static bool
+StripPrefix(const string & strName, const char *pszPrefix, string & strRest)
+{
+	string strPrefix(pszPrefix);
+
+	if( strName.compare(0, strPrefix.length(), strPrefix) != 0 )
+		return false;
+
+	strRest = strName.substr(strPrefix.length());
+	return true;
+}
+
+CTransport *
+CreateTransport(const string & strPortName, unsigned int nBaudRate)
+{
+	string strRest;
+
+	if( StripPrefix(strPortName, TRANSPORT_PREFIX_PTY, strRest) )
+		return new CPtyPort(strRest.c_str());
+
+	if( StripPrefix(strPortName, TRANSPORT_PREFIX_TCP, strRest) )
+		return new CTcpPort(strRest);
+
+	if( StripPrefix(strPortName, TRANSPORT_PREFIX_LOOPBACK, strRest) )
+		return new CLoopbackPort(strRest);
+
+	if( StripPrefix(strPortName, TRANSPORT_PREFIX_REPLAY, strRest) )
+		return new CReplayPort(strRest);
+
+	return new CSerial(strPortName.c_str(), nBaudRate);
+}
@@ -0,0 +1,204 @@
+/*!\file  transport.h  Byte stream connection to a device
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __TRANSPORT_H
+#define __TRANSPORT_H
+
+#include <core/defs.h>
+#include <core/capture.h>
+#include <string>
+#include <stddef.h>
+
+using namespace std;
+
+//! Represents an unitialized file descriptor.
+#define BAD_DEVICE -1
+
+//! How long a write may wait for the output queue of the port to drain (ms).
+#define SERIAL_WRITE_TIMEOUT_MS 1000
+
+//! Port name prefix selecting a pseudo terminal, ie. pty:/dev/pts/3
+#define TRANSPORT_PREFIX_PTY		"pty:"
+//! Port name prefix selecting a TCP serial server, ie. tcp:localhost:3001
+#define TRANSPORT_PREFIX_TCP		"tcp:"
+//! Port name prefix selecting the built-in simulated board, ie. loop: or loop:100:1
+#define TRANSPORT_PREFIX_LOOPBACK	"loop:"
+//! Port name prefix selecting the replay of a capture file, ie. replay:slow.cap,1,0.5
+#define TRANSPORT_PREFIX_REPLAY		"replay:"
+
+/**
+* The kind of connection between the PC and the board.
+*/
+enum DeviceConnectionType {
+	DEVICE_CONN_TYPE_SERIAL,	//!< termios serial port
+	DEVICE_CONN_TYPE_PTY,		//!< pseudo terminal, ie. a simulator
+	DEVICE_CONN_TYPE_TCP,		//!< raw TCP serial server (ser2net and friends)
+	DEVICE_CONN_TYPE_LOOPBACK,	//!< simulated board inside armflash
+	DEVICE_CONN_TYPE_REPLAY,	//!< the board side of a capture file played back
+	DEVICE_CONN_TYPE_UNSPECIFIED
+};
+
+/**
+*\class CTransport
+*\brief Byte stream to the board, the devices talk to the board only through it.
+*
+* All the connections are a non-blocking file descriptor underneath, so the default
+* implementations of reading, writing and waiting work on GetFd() and only opening,
+* setting up and closing is left to the actual transport. This way the device code
+* (and CFlashEngine polling the descriptors) runs unchanged over serial ports,
+* pseudo terminals, TCP serial servers or the loopback simulator.
+*
+*@see CreateTransport()
+*/
+class CTransport {
+	private:
+		//! Capture file, NULL if the traffic is not captured.
+		CCaptureLog *m_pclCapture;
+		//! Number of this port in the capture file.
+		unsigned int m_nCapturePort;
+		//! Records waiting to be written to the capture file.
+		string m_strCapture;
+
+		//! Records the bytes in the capture buffer.
+		void Capture(uint64_t nTimeNs, CaptureRecordType eType, const unsigned char *rgu8Data, unsigned int nLength);
+
+	protected:
+		/**
+		*\brief Waits for the poll events on the descriptor, restarts on EINTR.
+		*@return 1 if ready, 0 on timeout, FAILURE on error or hang up.
+		*/
+		static int WaitForEvents(int fdDevice, short nEvents, int nTimeoutMs);
+
+	public:
+		CTransport() : m_pclCapture(NULL), m_nCapturePort(0) {}
+
+		//! Virtual destructor, writes out what is left in the capture buffer.
+		virtual ~CTransport() { FlushCapture(); }
+
+		/**
+		*\brief Starts recording every chunk read and written into the capture file.
+		*
+		* The records are kept in a buffer of the port and written to the file only when
+		* it fills up, at FlushCapture() or when the transport is destroyed, so capturing
+		* does not add system calls to the ISP round trips.
+		*
+		*@param pclLog The capture file, shared by all the ports, it has to outlive the transport.
+		*@param strName Name of the port in the capture.
+		*/
+		void StartCapture(CCaptureLog *pclLog, const string & strName);
+
+		//! Writes the buffered records to the capture file.
+		void FlushCapture(void);
+
+		/**
+		*\brief Opens the connection in non-blocking mode.
+		*@return FAILURE on error SUCCESS if everything goes ok.
+		*/
+		virtual int Open(void) = 0;
+
+		/**
+		*\brief Sets the connection up for the ISP communication (line settings).
+		*@return FAILURE on error SUCCESS if everything goes ok.
+		*/
+		virtual int Init(void) = 0;
+
+		//! Closes the connection.
+		virtual void Close(void) = 0;
+
+		//! Returns the descriptor of the open connection (BAD_DEVICE if not open).
+		virtual int GetFd(void) const = 0;
+
+		//! Returns the kind of the connection.
+		virtual DeviceConnectionType GetType(void) const = 0;
+
+		//! Returns the baud rate requested, 0 if the connection has none.
+		virtual unsigned int GetBaudRate(void) const { return 0; }
+
+		//! Returns the baud rate really used, 0 if unknown or if the connection has none.
+		virtual unsigned int GetActualBaudRate(void) const { return 0; }
+
+		/**
+		*\brief Changes the baud rate, on the open connection without reopening it.
+		*@return FAILURE if the connection has no baud rate to change.
+		*/
+		virtual int SetBaudRate(unsigned int nBaudRate) { return FAILURE; }
+
+		/**
+		*\brief Asks for the lowest latency tuning the connection can do, applied by Init().
+		*
+		* Only the serial ports have something to tune, the others ignore it.
+		*/
+		virtual void SetLowLatency(bool bLowLatency) {}
+
+		//! Returns what Init() tuned for low latency, empty if nothing.
+		virtual string GetTuning(void) const { return ""; }
+
+		//! Throws away both received and not yet sent data.
+		virtual void Flush(void);
+
+		//! Throws away the received data.
+		virtual void FlushI(void);
+
+		//! Throws away the data not sent yet (if the connection can do that).
+		virtual void FlushO(void);
+
+		/**
+		*\brief Returns the number of bytes written but not sent yet (TIOCOUTQ).
+		*@return The number of bytes, -1 if the connection can't tell.
+		*/
+		virtual int GetOutputQueue(void) const;
+
+		/**
+		*\brief Reads up to nToRead bytes without blocking.
+		*@return The number of bytes read, -1 with errno set to EAGAIN if there is nothing to read.
+		*/
+		virtual int Read_NonBlock(unsigned char *rgBuffer, int nToRead);
+
+		/**
+		*\brief Writes an array of bytes.
+		*
+		* Partial writes are continued after waiting in WaitWritable() until the whole
+		* array is written or an error occures.
+		*
+		*@return The number of bytes actually written.
+		*/
+		virtual size_t Write(const unsigned char *rgu8Bytes, const unsigned int nLength);
+
+		/**
+		*\brief Waits until there are some data to read.
+		*@param nTimeoutMs Maximal time to wait in milliseconds, -1 waits forever.
+		*@return 1 if data are ready, 0 on timeout, FAILURE on error.
+		*/
+		virtual int WaitReadable(int nTimeoutMs);
+
+		/**
+		*\brief Waits until the connection can accept more data.
+		*@param nTimeoutMs Maximal time to wait in milliseconds, -1 waits forever.
+		*@return 1 if writable, 0 on timeout, FAILURE on error.
+		*/
+		virtual int WaitWritable(int nTimeoutMs);
+};
+
+/**
+*\fn CreateTransport(const string & strPortName, unsigned int nBaudRate)
+*\brief Creates the transport for the port name given on the command line.
+*
+* The prefix of the name selects the transport: "pty:", "tcp:host:port",
+* "loop:[erase_ms[:copy_ms]]" and "replay:file[,port[,scale]]", anything else
+* is a termios serial port.
+*
+*@return The new transport (never NULL), not opened yet.
+*/
+extern CTransport *CreateTransport(const string & strPortName, unsigned int nBaudRate);
+
+#endif
@@ -16,6 +16,10 @@
 CDeviceBase::CDeviceBase()
 {
 	m_DeviceType = DEVICE_CONN_TYPE_UNSPECIFIED;
+	m_pclPort = NULL;
+	m_pclSectorCache = NULL;
+	m_bVerify = false;
+	m_nSyncBaudRate = 0;
 }
 
 void 
@@ -90,3 +94,41 @@ CDeviceBase::SetFirmwarePath(string strFirmwarePath)
 	m_strFirmwarePath = strFirmwarePath;
 }
 
+void
+CDeviceBase::SetCaptureLog(CCaptureLog *pclLog)
+{
+	if( m_pclPort )
+		m_pclPort->StartCapture(pclLog, GetConnDeviceName());
+}
+
+void
+CDeviceBase::SetSectorCache(CSectorCache *pclCache, const string & strBoardId)
+{
+	m_pclSectorCache = pclCache;
+	m_strBoardId = strBoardId;
+}
+
+void
+CDeviceBase::SetVerify(bool bVerify)
+{
+	m_bVerify = bVerify;
+}
+
+void
+CDeviceBase::SetJournalDir(const string & strJournalDir)
+{
+	m_strJournalDir = strJournalDir;
+}
+
+void
+CDeviceBase::SetSyncBaudRate(unsigned int nSyncBaudRate)
+{
+	m_nSyncBaudRate = nSyncBaudRate;
+}
+
+void
+CDeviceBase::SetLowLatency(bool bLowLatency)
+{
+	if( m_pclPort )
+		m_pclPort->SetLowLatency(bLowLatency);
+}
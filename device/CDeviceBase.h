@@ -18,16 +18,12 @@
 #include <string>
 #include <vector>
 #include <map>
-#include <core/serial.h>
+#include <core/transport.h>
 #include <device/CFlashingStatus.h>
+#include <tools/CSectorCache.h>
 
 using namespace std;
 
-enum DeviceConnectionType {
-	DEVICE_CONN_TYPE_SERIAL,
-	DEVICE_CONN_TYPE_UNSPECIFIED
-};
-
 #define STR_DEVICE_ERROR "DEVICE ERROR: "
 
 /**
@@ -58,10 +54,20 @@ class CDeviceBase {
 		string m_strFirmwarePath;
 		//! The device type of PC port where the board is connected.
 		DeviceConnectionType m_DeviceType;
-		//! Serial port support object
-		CSerial *m_pclSerialPort;
+		//! Connection to the board (serial port, pty, TCP, loopback)
+		CTransport *m_pclPort;
 		//! This map should explain all the error codes for the device: for instance m_mapErrorCodes[BAD_ADDR] == "The device received an invalid address"
 		map<int,string> m_mapErrorCodes;
+		//! Hashes of the sectors the boards hold, NULL unless delta flashing is on.
+		CSectorCache *m_pclSectorCache;
+		//! Identity of the board in the sector cache, the port name if empty.
+		string m_strBoardId;
+		//! Compare what was programmed with the data it was programmed from.
+		bool m_bVerify;
+		//! Directory of the journals of the programmed sectors, empty if there are none.
+		string m_strJournalDir;
+		//! Baud rate to synchronize at before the configured one is negotiated, 0 to sync at the configured rate.
+		unsigned int m_nSyncBaudRate;
         //! This class holds all status information about flashing.
         CFlashingStatus *m_pclFlashingStatus;
 
@@ -113,8 +119,6 @@ class CDeviceBase {
 			reinterpret_cast<CDeviceBase *>(obj)->FlashDevice( reinterpret_cast<CDeviceBase *>(obj)->GetFirmwarePath() );
 		}
 
-		virtual int SendCommand(string strCmd, string strExpRep, unsigned int nTimeoutSec) = 0;
-
 
 	public:
 		CDeviceBase();
@@ -143,6 +147,47 @@ class CDeviceBase {
 		*/
 		string GetFirmwarePath() const;
 
+		/**
+		*\brief Records the traffic with the board into the capture file.
+		*@param pclLog The capture file, it has to outlive the device.
+		*@see CTransport::StartCapture()
+		*/
+		void SetCaptureLog(CCaptureLog *pclLog);
+
+		/**
+		*\brief Asks the connection to tune itself for the lowest latency.
+		*@see CTransport::SetLowLatency()
+		*/
+		void SetLowLatency(bool bLowLatency);
+
+		/**
+		*\brief Turns on delta flashing, only the sectors the board doesn't hold already are programmed.
+		*@param pclCache The cache of the sector hashes, it has to outlive the device. NULL turns it off.
+		*@param strBoardId Identity of the board in the cache, the port name is used if empty.
+		*/
+		void SetSectorCache(CSectorCache *pclCache, const string & strBoardId);
+
+		/**
+		*\brief Turns on the verification of every programmed part of the flash on the device.
+		*/
+		void SetVerify(bool bVerify);
+
+		/**
+		*\brief Makes the flashing resumable, the programmed sectors are journaled in the directory.
+		*
+		* The journal of the board is named after its board ID (see SetSectorCache()) or
+		* the port name. A session interrupted midway is continued by the next one.
+		*/
+		void SetJournalDir(const string & strJournalDir);
+
+		/**
+		*\brief Synchronizes at a conservative baud rate, the configured rate is negotiated after.
+		*
+		* If the board doesn't keep up with the configured rate the session falls back to
+		* nSyncBaudRate. 0 synchronizes right at the configured rate.
+		*/
+		void SetSyncBaudRate(unsigned int nSyncBaudRate);
+
 		/**
 		*\brief Sets the speed of the connected crystal in Hz.
 		*@param speed_hz The speed in Hz.
@@ -192,6 +237,57 @@ class CDeviceBase {
 		*/
 		virtual bool FlashDevice(string strFirmwarePath) = 0;
 
+		/**
+		*\brief Reads the whole flash of the device into a file.
+		*@param strOutputPath The file, Intel HEX32 if it ends with ".hex", binary otherwise.
+		*@return true if everything went OK, false otherwise (the file is removed then).
+		*/
+		virtual bool ReadDevice(string strOutputPath) = 0;
+
+		/**
+		*\brief Starts a resumable flashing session (synchronization + flashing).
+		*
+		* Pure virtual member. Opens the connection and sends the first command, but never
+		* waits for the device. The session is then moved forward by ProcessSession()
+		* calls whenever GetSessionFd() becomes readable or GetSessionTimeout() expires.
+		* This is what allows one thread to drive many devices at once.
+		*
+		*@param strFirmwarePath The path to the firmware file.
+		*@return false if the session couldn't be started at all.
+		*@see CFlashEngine
+		*/
+		virtual bool StartSession(string strFirmwarePath) = 0;
+
+		/**
+		*\brief Moves the session forward.
+		*
+		* Pure virtual member. Consumes whatever the device sent and handles expired
+		* deadlines. Never blocks, so it is safe to call it at any time.
+		*/
+		virtual void ProcessSession() = 0;
+
+		//! Returns the descriptor to wait on for the session, BAD_DEVICE if there is none.
+		virtual int GetSessionFd() const = 0;
+
+		//! Returns milliseconds until the next session deadline, -1 if there is none.
+		virtual int GetSessionTimeout() const = 0;
+
+		//! Returns true once the session is finished (successfully or not).
+		virtual bool IsSessionDone() const = 0;
+
+		//! Returns true if the session finished successfully.
+		virtual bool IsSessionOk() const = 0;
+
+		/**
+		*\brief Ends the session as failed and closes the connection.
+		*
+		* Pure virtual member. Called by the session itself when the device gives up and by
+		* CFlashEngine when the descriptor of the session hung up or failed.
+		*
+		*@param strMessage Why, printed with the name of the port.
+		*/
+		virtual void AbortSession(string strMessage) = 0;
+
 		//! Virtual destructor, does nothing in our case.
 		virtual ~CDeviceBase() {}
 };
@@ -15,82 +15,209 @@
 #include <iostream>
 #include <unistd.h>
 #include <string.h>
+#include <stdio.h>
 #include <sstream>
 #include <firmware/CFirmwareHEX32.h>
 #include <tools/UUcoder.h>
+#include <core/timer.h>
 #include <errno.h>
+#include <cctype>
+#include <algorithm>
 
 using namespace std;
 
 #define CR_LF '\n'
 #define CRYSTAL_STR_LENGTH 7
-#define MAXIMUM_ROOLS 0xFFFF
 
 #define CMD_SYNCHRONIZED "Synchronized\r\n"
 #define CMD_OK		 "OK\r\n"
 #define CMD_RESEND	 "RESEND\r\n"
+#define REP_SYNCHRONIZED "Synchronized"
+#define REP_OK		 "OK"
+#define REP_RESEND	 "RESEND"
 #define CMD_INIT	 "?"
 #define CMD_UNLOCK	 "U 23130\r\n"
+#define CMD_ECHO_OFF	 "A 0\r\n"
+#define CMD_READ_PART_ID "J\r\n"
 #define CMD_MAX_TRIES	 5
 
 #define FULL_CHUNK_SIZE	 900
 #define UU_MAX_LINE_BYTES 45
-#define SECTOR_SIZE 4096
-#define SECTOR_SIZE_STR "4096"
-
-#define MAX_REPS	1000
+#define UU_LINES_PER_BLOCK 20
+#define SECTOR_SIZE LPC2103_SECTOR_SIZE
+//! Smallest byte count of "C", parts of a sector this big which stay erased are not sent.
+#define COPY_GRANULE	256
+
+#define RAM_ADDRESS	0x40000200
+
+/*
+* In ISP mode the boot block's vectors are mapped over the first bytes of the flash,
+* "M" over them compares those and not the flash (the user manual says it is not valid),
+* "R" reads those.
+*/
+#define BOOT_REMAP_SIZE	0x40
+
+#define COPY_DELAY_MS	10
+
+/*
+* Reply deadlines of the ISP commands in ms. The time the command and the reply line
+* take on the line at the set baud rate is added, see IssueCommand().
+*/
+#define TIMEOUT_SYNC_PROBE_MS	50	//!< "?", a board in ISP answers at once
+#define TIMEOUT_SYNC_MS		100	//!< "Synchronized" and the crystal frequency
+#define TIMEOUT_COMMAND_MS	100	//!< U, P, W and the checksum ack
+#define TIMEOUT_ERASE_MS	400	//!< E, per sector of the range
+#define TIMEOUT_COPY_MS		200	//!< C of one sector
+//! How long we keep probing for the board to be reset into ISP mode.
+#define SYNC_WAIT_MS		60000
+//! Bytes of the reply line counted into the deadline.
+#define REPLY_LINE_BYTES	16
+//! A byte on the line is 10 bits (8N1).
+#define BITS_PER_BYTE		10
+
+/*
+* Bytes of the flash read by one "R". The board waits for the "OK" of every block of
+* UU_LINES_PER_BLOCK lines anyway, larger requests only save the "R" round trips.
+*/
+#define READ_REQUEST_BYTES	(8*SECTOR_SIZE)
+
+//! Typical erase time of a sector (datasheet), for the saving of the blank check if no sector was erased.
+#define ERASE_SECTOR_TYP_MS	100
+
+/*
+* An unchanged sector is confirmed by comparing this many samples of it, spread over the
+* sector, with the flash of the board. Only the samples go over the line, not the sector.
+*/
+#define CONFIRM_SAMPLES		4
+#define CONFIRM_SAMPLE_BYTES	16
+
+//! Bytes of a command (the UU block) on the way to the board at once, two UU lines.
+#define PACING_WINDOW_BYTES	128
+
+// Converts the number to its decimal string representation
+static string
+NumToStr(unsigned int nNumber)
+{
+	stringstream ssNumber;
+	ssNumber << nNumber;
+	return ssNumber.str();
+}
 
-#define USEC_PER_SEC	1000000
-#define USEC_POLL	100000
+// Converts the number to its hexadecimal string representation (without "0x")
+static string
+NumToHex(unsigned int nNumber)
+{
+	stringstream ssNumber;
+	ssNumber << hex << nNumber;
+	return ssNumber.str();
+}
 
-//#define USE_ROLLING_STICK
+// Returns how many bytes from the flash address on "M" has to leave out, see BOOT_REMAP_SIZE
+static unsigned int
+RemapSkip(unsigned int nAddress)
+{
+	return nAddress < BOOT_REMAP_SIZE ? BOOT_REMAP_SIZE - nAddress : 0;
+}
 
-// Tries to parse numeric reply from the input buffer
-int
-GetRep(const char *rgRepBuffer, int nLen)
+// Returns the offset of the sample in the sector, past the remapped boot vectors in sector 0
+static unsigned int
+SampleOffset(unsigned int nSector, unsigned int nSample)
 {
-	string strNumRep;
-	stringstream ssParser;
-	int rnds = 0;
-	int nToRet;
+	unsigned int nOffset = nSample * (SECTOR_SIZE / CONFIRM_SAMPLES);
 
-	while(--nLen)
-	{
-		if( rgRepBuffer[nLen] >= '0' && rgRepBuffer[nLen] <= '9' )
-		{
-			strNumRep = rgRepBuffer[nLen] + strNumRep;
-		}
-		rnds++;
+	return nOffset + RemapSkip(nSector * SECTOR_SIZE + nOffset);
+}
 
-		if( rnds >= 4 )
-			break;
+// Returns the phase of the timing line the command of the state belongs to
+static LPC2103Phase
+PhaseOf(LPC2103SessionState eState)
+{
+	switch( eState )
+	{
+		case LPC_STATE_READ_PART_ID:
+		case LPC_STATE_COMPARE:
+			return LPC_PHASE_DELTA_CHECK;
+
+		case LPC_STATE_BLANK_CHECK:
+			return LPC_PHASE_BLANK_CHECK;
+
+		case LPC_STATE_PREPARE:
+		case LPC_STATE_ERASE:
+			return LPC_PHASE_ERASE;
+
+		case LPC_STATE_RAM_WRITE:
+		case LPC_STATE_CHECKSUM:
+		case LPC_STATE_PREPARE_COPY:
+		case LPC_STATE_COPY:
+		case LPC_STATE_COPY_DELAY:
+		case LPC_STATE_VERIFY:
+			return LPC_PHASE_PROGRAM;
+
+		default:
+			return LPC_PHASE_SYNC;
 	}
-	
-	//cout << "REPLY: " << strNumRep << endl;
-	ssParser << strNumRep;
-	ssParser >> nToRet;
-
-	return nToRet;
-}	
+}
 
 
 CDeviceLPC2103::CDeviceLPC2103()
+	: m_clImage(LPC2103_FLASH_SIZE, SECTOR_SIZE)
 {
 	SetConnDeviceType(DEVICE_CONN_TYPE_SERIAL); 	//this device can only be programmed through ISP or JTAG
 	SetRomSize( 32*1024 );	 			// 32Kb of ROM
 	SetRamSize( 8*1024 ); 	 			// 8Kb of RAM
+
+	m_pclPort = NULL;
+	m_pclFlashingStatus = NULL;
+	m_bInitialized = false;
+	m_eState = LPC_STATE_IDLE;
+	m_bFlashPending = false;
+	m_nRollCount = 0;
+	m_nDeadlineMs = 0;
+	m_nSyncDeadlineMs = 0;
+	m_nBaudRate = 0;
+	m_nConfBaudRate = 0;
+	m_bBaudRaised = false;
+	m_bBaudFellBack = false;
+	m_nBaudTries = 0;
+	m_eResumeState = LPC_STATE_IDLE;
+	m_nCmdSent = 0;
+	m_nCmdTimeoutMs = 0;
+	m_bEcho = true;
+	m_nTotalSectors = 0;
+	m_nDoneSectors = 0;
+	m_nCurSample = 0;
+	m_bConfirming = false;
+	m_pUpload = NULL;
+	m_nUploadSize = 0;
+	m_u32ReadAddress = 0;
+	m_u32ReadEnd = 0;
+	m_nReadResends = 0;
+	m_nBlankSectors = 0;
+	m_nEraseStart = 0;
+	m_nEraseEnd = 0;
+	m_nPhaseStartMs = 0;
+	m_nSessionStartMs = 0;
+	memset(m_rgnPhaseMs, 0, sizeof(m_rgnPhaseMs));
+	m_nChunkStart = 0;
+	m_nChunkSize = 0;
+	m_nBlockTries = 0;
+	m_nResendsAsked = 0;
+	m_nResendsTimedOut = 0;
+	m_bChunkSuspect = false;
 }
 
 
-CDeviceLPC2103::CDeviceLPC2103(string strDevName, unsigned int unCrystalHz, speed_t stBaudRate)
+CDeviceLPC2103::CDeviceLPC2103(string strDevName, unsigned int unCrystalHz, unsigned int nBaudRate)
+	: m_clImage(LPC2103_FLASH_SIZE, SECTOR_SIZE)
 {
-	SetConnDeviceType( DEVICE_CONN_TYPE_SERIAL );
 	SetConnDeviceName( strDevName );
 	SetRomSize( 32*1024 );	 			// 32Kb of ROM
 	SetRamSize( 8*1024 ); 	 			// 8Kb of RAM
 	SetCrystalSpeedHz( unCrystalHz );
 
-	m_pclSerialPort = new CSerial( strDevName.c_str(), stBaudRate );
+	// the ISP talk is the same over any byte stream, the name picks the transport
+	m_pclPort = CreateTransport( strDevName, nBaudRate );
+	SetConnDeviceType( m_pclPort->GetType() );
     m_pclFlashingStatus = new CFlashingStatus();
 
 	// fill in the ERROR code explanations:
@@ -115,566 +242,1733 @@ CDeviceLPC2103::CDeviceLPC2103(string strDevName, unsigned int unCrystalHz, spee
 	m_mapErrorCodes[CODE_READ_PROTECTION_ENABLED] = "Code read protection enabled.";
 
 	m_bInitialized = false;
+	m_eState = LPC_STATE_IDLE;
+	m_bFlashPending = false;
+	m_nRollCount = 0;
+	m_nDeadlineMs = 0;
+	m_nSyncDeadlineMs = 0;
+	m_nBaudRate = nBaudRate;
+	m_nConfBaudRate = nBaudRate;
+	m_bBaudRaised = false;
+	m_bBaudFellBack = false;
+	m_nBaudTries = 0;
+	m_eResumeState = LPC_STATE_IDLE;
+	m_nCmdSent = 0;
+	m_nCmdTimeoutMs = 0;
+	m_bEcho = true;
+	m_nTotalSectors = 0;
+	m_nDoneSectors = 0;
+	m_nCurSample = 0;
+	m_bConfirming = false;
+	m_pUpload = NULL;
+	m_nUploadSize = 0;
+	m_u32ReadAddress = 0;
+	m_u32ReadEnd = 0;
+	m_nReadResends = 0;
+	m_nBlankSectors = 0;
+	m_nEraseStart = 0;
+	m_nEraseEnd = 0;
+	m_nPhaseStartMs = 0;
+	m_nSessionStartMs = 0;
+	memset(m_rgnPhaseMs, 0, sizeof(m_rgnPhaseMs));
+	m_nChunkStart = 0;
+	m_nChunkSize = 0;
+	m_nBlockTries = 0;
+	m_nResendsAsked = 0;
+	m_nResendsTimedOut = 0;
+	m_bChunkSuspect = false;
 }
 
 CDeviceLPC2103::~CDeviceLPC2103()
 {
-	delete m_pclSerialPort;
+	delete m_pclPort;
     delete m_pclFlashingStatus;
 }
 
 bool 
 CDeviceLPC2103::InitializeDevice()
 {
-	if( GetConnDeviceName() == "" )
+	if( !BeginSync() )
+		return false;
+
+	// runs until the device is synchronized or we give up
+	return RunSession();
+}
+
+bool 
+CDeviceLPC2103::InitializeDevice(string strDevName)
+{
+	SetConnDeviceName(strDevName);
+	return InitializeDevice();
+}
+
+vector<string> 
+CDeviceLPC2103::GetDeviceInfo()
+{
+	vector<string> clToRet;
+
+	return clToRet;
+}
+
+bool 
+CDeviceLPC2103::FlashDevice(string strFirmwarePath)
+{
+	if( !m_bInitialized )
 	{
-		cout << "ERROR: InitializeDevice() called before SetConnDeviceName()" << endl;
+		cerr << GetConnDeviceName() << ": The device was not initialized... Call InitializeDevice() first!" << endl;
 		return false;
 	}
 
-	string strResponse;
-    unsigned int nRollCount = 0;
-	//unsigned char rgBuffer[256];
-	//int nReadBytes = 0;	
-	bool bSynchStart = false;
-#ifdef USE_ROLLING_STICK
-	unsigned int nRollingStick = 0;
-#endif
-	stringstream ssCrystalParser;
-	ssCrystalParser << GetCrystalSpeedHz();
-	string strCrystalHz;
-	ssCrystalParser >> strCrystalHz;
-	strCrystalHz += "\r\n";
+	if( !LoadFirmware(strFirmwarePath) )
+		return false;
+
+	BeginFlash();
 
-	// open the serial port
-	if( m_pclSerialPort->Open() != SUCCESS )
+	return RunSession();
+}
+
+bool
+CDeviceLPC2103::ReadDevice(string strOutputPath)
+{
+	if( !m_bInitialized )
 	{
-		cerr << "Error during opening " << m_strConnDevice << " device." << endl;
-        return false;
+		cerr << GetConnDeviceName() << ": The device was not initialized... Call InitializeDevice() first!" << endl;
+		return false;
 	}
 
-	// initialize the serial port
-	if( m_pclSerialPort->Init() != SUCCESS )
+	if( !m_clReadFile.Open(strOutputPath, 0) )
 	{
-		cerr << "Error while initializing " << m_strConnDevice << endl;
-        return false;
+		cerr << GetConnDeviceName() << ": Can't create " << strOutputPath << ": " << strerror(errno) << endl;
+		return false;
 	}
 
-SYNC_START:
+	m_u32ReadAddress = 0;
+	m_nReadResends = 0;
+	StartPhase();
+	IssueRead("");
 
-    if( nRollCount > 60 )
-    {
-        cout << GetConnDeviceName() << ": Timed out waiting for synchronization!" << endl;
-        return false;
-    }
+	RunSession();
+
+	if( !IsSessionOk() )
+		m_clReadFile.Discard();
+
+	return IsSessionOk();
+}
 
-	if( SendCommand(CMD_INIT, CMD_SYNCHRONIZED, 1) != SUCCESS )
+bool
+CDeviceLPC2103::StartSession(string strFirmwarePath)
+{
+	SetFirmwarePath( strFirmwarePath );
+	m_bFlashPending = true;
+
+	return BeginSync();
+}
+
+void
+CDeviceLPC2103::ProcessSession()
+{
+	if( IsSessionDone() || m_eState == LPC_STATE_IDLE || m_eState == LPC_STATE_SYNCED )
+		return;
+
+	if( ReadReply() )
 	{
-		goto DO_ROLL;
+		Advance( IsReplyOk() );
+		return;
 	}
 
-	if( SendCommand( string(CMD_SYNCHRONIZED), string(CMD_OK), 5) != SUCCESS )
+	if( IsSessionDone() )
+		return;
+
+	// the echo (or the drained output queue) makes room for more of the command
+	if( m_clMatcher.IsArmed() && m_nCmdSent < m_strCmd.length() )
 	{
-		
-		goto DO_ROLL;
+		SendPending();
+		if( IsSessionDone() )
+			return;
 	}
 
-	if( SendCommand( strCrystalHz, string(CMD_OK), 5) != SUCCESS )
+	// the timer states have no reply to wait for, their deadline is the success
+	if( GetMonotonicMs() >= m_nDeadlineMs )
 	{
-		
-		goto DO_ROLL;
+		// no answer at the raised baud rate, the line may not keep up with it. The UU blocks
+		// are sent (asked for) again first, see ResendBlock() and OnReadBlock().
+		if( m_clMatcher.IsArmed() && m_bBaudRaised && m_eState != LPC_STATE_BAUD_FALLBACK
+		    && m_eState != LPC_STATE_CHECKSUM && m_eState != LPC_STATE_READ_BLOCK )
+			FallBackBaudRate();
+		else
+			Advance( !m_clMatcher.IsArmed() );
 	}
+}
 
-	m_bInitialized = true;
+int
+CDeviceLPC2103::GetSessionFd() const
+{
+	return m_pclPort->GetFd();
+}
 
-    cout << GetConnDeviceName() << ": Synchronized OK." << endl;
+int
+CDeviceLPC2103::GetSessionTimeout() const
+{
+	if( IsSessionDone() || m_eState == LPC_STATE_IDLE || m_eState == LPC_STATE_SYNCED )
+		return -1;
 
-	return true;
+	uint64_t nNow = GetMonotonicMs();
 
-DO_ROLL:
-    nRollCount++;
+	if( nNow >= m_nDeadlineMs )
+		return 0;
 
-#ifdef USE_ROLLING_STICK
-	if( !bSynchStart )
-	{
-		bSynchStart = true;
-		cout << "Waiting to synchronize (press reset while P0.14 LOW)." << endl;
-		cout << " \\";
-		goto SYNC_START;
-	} else {
+	// without the echo nothing wakes us up when the output queue drains
+	if( m_nCmdSent < m_strCmd.length() && !(m_bEcho && !m_clMatcher.IsEchoDone()) )
+		return min( (int)(m_nDeadlineMs - nNow), (int)max(1u, LineTimeMs(PACING_WINDOW_BYTES / 2)) );
+
+	return (int)(m_nDeadlineMs - nNow);
+}
+
+bool
+CDeviceLPC2103::IsSessionDone() const
+{
+	return m_eState == LPC_STATE_DONE || m_eState == LPC_STATE_FAILED;
+}
 
-		cout << char(8);
+bool
+CDeviceLPC2103::IsSessionOk() const
+{
+	return m_eState == LPC_STATE_DONE;
+}
 
-		if( nRollingStick == MAXIMUM_ROOLS )
+/*
+* Drives the session from the current thread until it either gets synchronized
+* or finishes. This is the blocking mode used by InitializeDevice()/FlashDevice().
+*/
+bool
+CDeviceLPC2103::RunSession()
+{
+	while( !IsSessionDone() && m_eState != LPC_STATE_SYNCED )
+	{
+		if( m_pclPort->WaitReadable( GetSessionTimeout() ) == FAILURE )
 		{
-			cout << "Giving up..." << endl;	
-			return false;
+			AbortSession("Port lost: hung up or failed.");
+			break;
 		}
+		ProcessSession();
+	}
+
+	return m_eState == LPC_STATE_SYNCED || m_eState == LPC_STATE_DONE;
+}
+
+/*
+* Opens the port and sends the first synchronization probe
+*/
+bool
+CDeviceLPC2103::BeginSync()
+{
+	if( GetConnDeviceName() == "" )
+	{
+		cout << "ERROR: InitializeDevice() called before SetConnDeviceName()" << endl;
+		return false;
+	}
 
-		int tmp = nRollingStick%4;
+	// the board is synchronized at the slower rate, the configured one is asked for with "B" after
+	m_nBaudRate = m_nConfBaudRate;
+	m_bBaudRaised = false;
+	m_bBaudFellBack = false;
+	if( m_nSyncBaudRate != 0 && m_nSyncBaudRate < m_nConfBaudRate && m_pclPort->SetBaudRate(m_nSyncBaudRate) == SUCCESS )
+		m_nBaudRate = m_nSyncBaudRate;
 
-		if( tmp == 0 )
-			cout << "|";
-		if( tmp == 1 )
-			cout << "/";
-		if( tmp == 2 )
-			cout << "-";
-		if( tmp == 3 )
-			cout << "\\";
+	// open the serial port
+	if( m_pclPort->Open() != SUCCESS )
+	{
+		cerr << "Error during opening " << m_strConnDevice << " device." << endl;
+		m_eState = LPC_STATE_FAILED;
+        return false;
+	}
 
-		cout.flush();
-		nRollingStick++;
-		goto SYNC_START;
+	// initialize the serial port
+	if( m_pclPort->Init() != SUCCESS )
+	{
+		cerr << "Error while initializing " << m_strConnDevice << endl;
+		m_pclPort->Close();
+		m_eState = LPC_STATE_FAILED;
+        return false;
 	}
-#else
-	if( !bSynchStart )
+
+	// only real serial lines have a speed worth reporting
+	if( m_pclPort->GetBaudRate() != 0 )
 	{
-		bSynchStart = true;
-		cout << GetConnDeviceName() << ": Waiting to synchronize (press reset while P0.14 LOW)" << endl;
-        cout.flush();
-		goto SYNC_START;
-	} else {
-		//cout << ".";
-		//cout.flush();
-		goto SYNC_START;
+		if( m_pclPort->GetActualBaudRate() == m_pclPort->GetBaudRate() )
+			cout << GetConnDeviceName() << ": Port running at " << m_pclPort->GetActualBaudRate() << " baud." << endl;
+		else if( m_pclPort->GetActualBaudRate() == 0 )
+			cout << GetConnDeviceName() << ": Port set to " << m_pclPort->GetBaudRate() << " baud (actual rate unknown)." << endl;
+		else
+			cout << GetConnDeviceName() << ": Requested " << m_pclPort->GetBaudRate() << " baud, port running at "
+			     << m_pclPort->GetActualBaudRate() << " baud." << endl;
 	}
-#endif		
 
-	//m_pclSerialPort->Close();*/
+	if( m_pclPort->GetTuning() != "" )
+		cout << GetConnDeviceName() << ": Low latency: " << m_pclPort->GetTuning() << "." << endl;
+
+	// a board reset into ISP echoes again
+	m_bEcho = true;
+	memset(m_rgnPhaseMs, 0, sizeof(m_rgnPhaseMs));
+	m_nResendsAsked = m_nResendsTimedOut = 0;
+	m_nSessionStartMs = GetMonotonicMs();
+	StartPhase();
+	m_nRollCount = 0;
+	m_nSyncDeadlineMs = GetMonotonicMs() + SYNC_WAIT_MS;
+	IssueCommand(LPC_STATE_SYNC_PROBE, CMD_INIT, REP_SYNCHRONIZED, TIMEOUT_SYNC_PROBE_MS);
+
 	return true;
 }
 
-bool 
-CDeviceLPC2103::InitializeDevice(string strDevName)
+/*
+* Sends the command, arms the expected ISP return code and moves to the given state
+*/
+void
+CDeviceLPC2103::IssueCommand(LPC2103SessionState eState, const string & strCmd, unsigned int nTimeoutMs)
 {
-	SetConnDeviceName(strDevName);
-	return InitializeDevice();
+	IssueCommand(eState, strCmd, NULL, nTimeoutMs);
 }
 
-vector<string> 
-CDeviceLPC2103::GetDeviceInfo()
+/*
+* Sends the command, arms the expected reply line and moves to the given state.
+* If pszExpRep is NULL a numeric ISP return code is expected instead. The reply
+* has to come within nTimeoutMs after the command and the reply went over the line.
+*/
+void
+CDeviceLPC2103::IssueCommand(LPC2103SessionState eState, const string & strCmd, const char *pszExpRep, unsigned int nTimeoutMs)
 {
-	vector<string> clToRet;
+	m_eState = eState;
+	m_strCmd = strCmd;
+	m_nCmdSent = 0;
+	m_nCmdTimeoutMs = nTimeoutMs;
 
-	return clToRet;
+	// whatever is left from the previous command is of no interest
+	m_clRxBuffer.Clear();
+	m_clMatcher.Arm( m_strCmd.data(), m_bEcho ? m_strCmd.length() : 0, pszExpRep ? ISP_REPLY_TOKEN : ISP_REPLY_RETURN_CODE, pszExpRep );
+
+	//cout << "IssueCommand:: " << strCmd << " " << strCmd.length() << endl;
+
+	SendPending();
 }
 
-int 
-CDeviceLPC2103::SendCommand(string strCmd, string strExpRep, unsigned int nTimeoutSec)
+/*
+* Returns the number of bytes of the command sent but not taken by the board yet:
+* not echoed back or, without the echo, still in the output queue of the port.
+* 0 if we can't tell, then the command goes out at once.
+*/
+unsigned int
+CDeviceLPC2103::GetBytesInFlight() const
 {
-	size_t nWroteBytes = 0;
-	string strTmp;
-
-	unsigned int nReps = (nTimeoutSec * USEC_PER_SEC) / USEC_POLL;
+	if( m_bEcho && !m_clMatcher.IsEchoDone() )
+		return m_nCmdSent - m_clMatcher.GetEchoCount();
 
-	//cout << "SendCommand:: " << strCmd << " " << strCmd.length() << " : " << strExpRep << " " << strExpRep.length() << endl;
+	int nQueued = m_pclPort->GetOutputQueue();
 
-	//m_pclSerialPort->Flush();
-	nWroteBytes = m_pclSerialPort->Write( (unsigned char *)strCmd.c_str(), strCmd.length() );
-	//usleep(50000);
+	return nQueued < 0 ? 0 : nQueued;
+}
 
-	if( nWroteBytes != strCmd.length() )
+/*
+* Writes more of the current command, at most PACING_WINDOW_BYTES of it are on the way
+* to the board at once so it is not flooded while decoding the UU lines. The deadline
+* counts from the last byte written.
+*/
+void
+CDeviceLPC2103::SendPending()
+{
+	while( m_nCmdSent < m_strCmd.length() )
 	{
-		cerr << "ERROR: didnt get to write all the bytes during " << strCmd << " command!" << endl;
-		return FAILURE;
-	} else {
-		//cout << "Wrote " << nWroteBytes << "B" << endl;
-	}
-
-	
-	//int nReply;
-	char rgBuffer[256];
+		unsigned int nInFlight = GetBytesInFlight();
 
+		if( nInFlight >= PACING_WINDOW_BYTES )
+			break;
 
-	while( 1 )
-	{
-		//usleep(USEC_POLL);
-		if( strExpRep.length() == 0 )
-			return SUCCESS;
+		unsigned int nChunk = min( (unsigned int)(m_strCmd.length() - m_nCmdSent), PACING_WINDOW_BYTES - nInFlight );
+		size_t nWroteBytes = m_pclPort->Write( (const unsigned char *)m_strCmd.data() + m_nCmdSent, nChunk );
 
-		int nRead = m_pclSerialPort->Read_NonBlock((unsigned char *)rgBuffer, 128);
+		m_nCmdSent += nWroteBytes;
 
-		if( nRead > 0 )	
+		// the port is gone or its queue didn't drain within SERIAL_WRITE_TIMEOUT_MS, resending can't help
+		if( nWroteBytes != nChunk )
 		{
-			rgBuffer[nRead] = '\0';
-			strTmp += rgBuffer;
+			string strName = m_eState == LPC_STATE_CHECKSUM ? "UU block" : "\"" + m_strCmd.substr(0, m_strCmd.find_first_of(" \r")) + "\"";
 
-			//cout << "STR_TMP: " << strTmp << endl;
+			AbortSession("Port lost: wrote " + NumToStr(m_nCmdSent) + " of " + NumToStr(m_strCmd.length()) + " bytes of " + strName + ".");
+			return;
+		}
 
-			size_t found = strTmp.find( strCmd );
-			if( found != string::npos )
-			{
-				//cout << "Erasing" << endl;
-				strTmp.erase(found, strCmd.length());
-			}
+		m_nDeadlineMs = GetMonotonicMs() + m_nCmdTimeoutMs + LineTimeMs(m_strCmd.length() - m_nCmdSent + REPLY_LINE_BYTES);
+	}
+}
 
-			if( strTmp.find( strExpRep ) != string::npos )
-			{
-				//m_pclSerialPort->Flush();
-				return SUCCESS;
+/*
+* Time the bytes take on the line at the set baud rate, 0 for connections without one
+*/
+unsigned int
+CDeviceLPC2103::LineTimeMs(unsigned int nBytes) const
+{
+	if( m_nBaudRate == 0 )
+		return 0;
 
-			}
-		} 
-		else if( nRead < 0 )
-		{
-			if(errno == EAGAIN)
-			{
-				//printf("SERIAL EAGAIN ERROR \n");
-				usleep(100000);
-			}
-			else
-			{
-				printf("SERIAL read error %d %s\n",errno, strerror(errno));
-			}
+	return (unsigned int)(((uint64_t)nBytes * BITS_PER_BYTE * 1000 + m_nBaudRate - 1) / m_nBaudRate);
+}
 
-		}
+/*
+* Moves to the given state which has no reply, just waits nTimeoutMs
+*/
+void
+CDeviceLPC2103::StartTimer(LPC2103SessionState eState, unsigned int nTimeoutMs)
+{
+	m_eState = eState;
+	m_clRxBuffer.Clear();
+	m_clMatcher.Disarm();
+	m_nDeadlineMs = GetMonotonicMs() + nTimeoutMs;
+}
+
+/*
+* Reads everything available on the line straight into the receive buffer and feeds
+* it to the reply matcher. Returns true once the expected reply is complete. Whatever
+* comes while there is no reply expected (or after the reply) is thrown away.
+*/
+bool
+CDeviceLPC2103::ReadReply()
+{
+	while( 1 )
+	{
+		unsigned int nSpace;
+		unsigned char *pSpace = m_clRxBuffer.GetWriteSpace(nSpace);
+
+		int nRead = m_pclPort->Read_NonBlock(pSpace, nSpace);
 
-		nReps--;
+		if( nRead < 0 && (errno == EAGAIN || errno == EINTR) )
+			break;
 
-		if( nReps <= 0 )
+		// EIO from an unplugged adapter or a closed pty, the end of a socket. Waiting for
+		// the timeout would only resend into a dead port.
+		if( nRead <= 0 )
 		{
-			return FAILURE;
+			AbortSession(nRead < 0 ? "Port lost: " + string(strerror(errno)) + "." : string("Port lost: closed by the other end."));
+			return false;
 		}
+
+		m_clRxBuffer.Commit(nRead);
+
+		unsigned char u8Byte;
+		while( m_clRxBuffer.Pop(u8Byte) )
+			m_clMatcher.Feed(u8Byte);
 	}
 
+	return m_clMatcher.IsDone();
 }
 
-bool 
-CDeviceLPC2103::FlashDevice(string strFirmwarePath)
+/*
+* Checks the matched reply, a non-zero ISP return code is explained
+*/
+bool
+CDeviceLPC2103::IsReplyOk()
 {
-	CFirmwareHEX32 clHexToFlash;
-	string strFileExt = strFirmwarePath.substr(strFirmwarePath.length()-3, 3);
-	unsigned char rgFlashImage[32*1024];
-	unsigned char *pFlashImage = rgFlashImage;
-	unsigned int nDataCount=0;
-	unsigned char rgBuffer[256];
-	//int nReadBytes = 0;	
-	CUUcoder clUUcoder;
+	if( m_clMatcher.GetKind() != ISP_REPLY_RETURN_CODE )
+		return true;
 
-	if( !m_bInitialized )
-	{
-		cerr << GetConnDeviceName() << ": The device was not initialized... Call InitializeDevice() first!" << endl;
-		return false;
-	}
-		
-	if( strFileExt == string("hex") || strFileExt == string("HEX") )
-	{
-		if( !clHexToFlash.OpenFirmware(strFirmwarePath.c_str()) )
-		{
-			cout << GetConnDeviceName() << ": ERROR: couldn't open " << strFirmwarePath << endl;
-		}
+	int nCode = m_clMatcher.GetReturnCode();
 
-		if( clHexToFlash.CheckFirmware() )
-		{
-			cout << GetConnDeviceName() << ": File " << strFirmwarePath << " seems to be valid! CRC test passed." << endl;
-		}
-		 else
-		{
-			cout << GetConnDeviceName() << ": File " << strFirmwarePath << " is invalid! CRC test failed!" << endl;
-            return false;
-		}
+	if( nCode == CMD_SUCCESS )
+		return true;
 
+	// an answer the state asked for (ie. SECTOR_NOT_BLANK with its offset), not an error
+	if( m_clMatcher.HasValues() )
+		return false;
 
-		uint32_t nAdr,rgData[HEX32_DATA_MAXLEN],nDataLen = HEX32_DATA_MAXLEN;
-		for(int i=0; i<HEX32_DATA_MAXLEN; i++) rgData[i] = 0;
-		while( clHexToFlash.GetNextAdrData(nAdr, rgData, nDataLen, false) )
-		{
-			if( nDataLen == 0 )
-			{
-				//reset the nDataLen and continue
-				nDataLen = HEX32_DATA_MAXLEN;
-				continue;
-			}
+	map<int,string>::const_iterator itError = m_mapErrorCodes.find(nCode);
 
-			for( unsigned int i=0; i<nDataLen; i++ )
-			{
-				if( nDataCount >= 32*1024 ){
-					cerr << GetConnDeviceName() << ": ERROR: Flash image bigger than the actual flash of the device!" << endl;
-					return false;
-				}
+	cout << GetConnDeviceName() << ": ISP error " << nCode << ": "
+	     << (itError != m_mapErrorCodes.end() ? itError->second : "Unknown error code.") << endl;
 
-				*pFlashImage = (unsigned char)( rgData[i] & 0xFF );
-				pFlashImage++;
-				nDataCount++;
-			}
+	return false;
+}
 
-			//reset the nDataLen parameter since it may have
-			//been changed in the GetNextAdrData call
-			nDataLen = HEX32_DATA_MAXLEN;
-		}
+/*
+* Failed synchronization attempt, try again until SYNC_WAIT_MS runs out
+*/
+void
+CDeviceLPC2103::RollSync()
+{
+	m_nRollCount++;
 
-		//cout << "Read " << nDataCount << "B from " << strFirmwarePath << endl;
+	if( GetMonotonicMs() >= m_nSyncDeadlineMs )
+	{
+		AbortSession("Timed out waiting for synchronization!");
+		return;
+	}
 
-	} 
-	else
+	if( m_nRollCount == 1 )
 	{
-		cout << GetConnDeviceName() << ": File doesn't end with .hex, no other files yet supported." << endl;
-		return false;
+		cout << GetConnDeviceName() << ": Waiting to synchronize (press reset while P0.14 LOW)" << endl;
+        cout.flush();
 	}
 
-	// make valid code sector
-	unsigned char *p_vcs = rgFlashImage;
-	unsigned int sum=0;
-	int addr;
+	IssueCommand(LPC_STATE_SYNC_PROBE, CMD_INIT, REP_SYNCHRONIZED, TIMEOUT_SYNC_PROBE_MS);
+}
 
-	for (addr=0; addr<0x20; addr+=4) {
-		if (addr != 0x14) {
-			sum += (p_vcs[addr] | (p_vcs[addr+1] << 8) | (p_vcs[addr+2] << 16) | (p_vcs[addr+3] << 24));
-		}
+/*
+* Asks the board for the configured baud rate if the synchronization was done at a
+* slower one. The board answers at the old rate and switches right after its reply.
+*/
+void
+CDeviceLPC2103::RaiseBaudRate()
+{
+	if( m_nBaudRate >= m_nConfBaudRate || m_bBaudFellBack )
+	{
+		OnSynced();
+		return;
 	}
-	sum ^= 0xFFFFFFFF;
-	sum++;
 
-	p_vcs[0x14 + 0] = (sum >> 0)  & 255;
-	p_vcs[0x14 + 1] = (sum >> 8)  & 255;
-	p_vcs[0x14 + 2] = (sum >> 16) & 255;
-	p_vcs[0x14 + 3] = (sum >> 24) & 255;
+	IssueCommand(LPC_STATE_SET_BAUD, "B " + NumToStr(m_nConfBaudRate) + " 1\r\n", TIMEOUT_COMMAND_MS);
+}
+
+/*
+* A command got no answer at the raised baud rate. The board is asked to go back to the
+* sync rate at the raised one (a short command may still get through), then the port
+* follows and the line is probed before the session resumes from the failed state.
+*/
+void
+CDeviceLPC2103::FallBackBaudRate()
+{
+	cout << GetConnDeviceName() << ": No answer at " << m_nBaudRate << " baud, falling back to "
+	     << m_nSyncBaudRate << " baud." << endl;
 
+	// a failed probe right after "B" resumes what the "B" came before
+	if( m_eState != LPC_STATE_BAUD_PROBE )
+		m_eResumeState = m_eState;
 
-	//NOTE: If we get here, the whole image is buffered and ready to be sent to device
+	// the failed phase keeps its time so far, the fallback counts as sync (see ResumeSession())
+	EndPhase(PhaseOf(m_eState));
 
+	m_nBaudTries = 0;
+	IssueBaudFallback();
+}
+
+void
+CDeviceLPC2103::IssueBaudFallback()
+{
+	m_nBaudTries++;
+	IssueCommand(LPC_STATE_BAUD_FALLBACK, "B " + NumToStr(m_nSyncBaudRate) + " 1\r\n", TIMEOUT_COMMAND_MS);
+}
 
-	// first lets pad the image with zeros so the size is of multiple of a sector size (4K)
-	int nSectors = nDataCount / SECTOR_SIZE;
-	int nPadLast = (nSectors+1)*SECTOR_SIZE;
+/*
+* The baud rate is settled, continues with what came before it: the synchronization or
+* the operation whose command failed at the raised rate. The flashing starts over from
+* "U" (the journal leaves out the sectors done already), the read goes on with its block.
+* The time since the fallback began is sync time, the phases after it add up again.
+*/
+void
+CDeviceLPC2103::ResumeSession()
+{
+	EndPhase(LPC_PHASE_SYNC);
 
-	if( nDataCount % SECTOR_SIZE != 0 )
+	switch( m_eResumeState )
 	{
-		int i=nDataCount;
-		for(; i<nPadLast; i++)
-		{
-			*pFlashImage = 0xFF;
-			pFlashImage++;
-			nDataCount++;
-		}
+		case LPC_STATE_SYNCED:
+			OnSynced();
+			break;
+
+		case LPC_STATE_READ:
+		case LPC_STATE_READ_BLOCK:
+			m_nReadResends = 0;
+			IssueRead("");
+			break;
+
+		default:
+			BeginFlash();
+			break;
 	}
+}
+
+/*
+* Synchronization finished, continues with flashing if FlashDevice() was called already
+*/
+void
+CDeviceLPC2103::OnSynced()
+{
+	EndPhase(LPC_PHASE_SYNC);
+	m_bInitialized = true;
+	m_eState = LPC_STATE_SYNCED;
+	cout << GetConnDeviceName() << ": Synchronized OK." << endl;
 
-	if( SendCommand(CMD_UNLOCK, "0\r\n", 5) != SUCCESS )
+	if( m_bFlashPending )
 	{
-		cout << GetConnDeviceName() << ": Error while unlocking the device!" << endl;
-		m_pclSerialPort->Close();
-		return false;
+		if( LoadFirmware( GetFirmwarePath() ) )
+			BeginFlash();
+		else
+			AbortSession("Flashing aborted.");
 	}
+}
+
+void
+CDeviceLPC2103::BeginFlash()
+{
+	m_strCacheKey.clear();
+	// again for a flashing started over after a baud rate fallback
+	m_nTotalSectors = m_clImage.GetDirtyCount();
+
+	if( !m_strJournalDir.empty() )
+		OpenJournal();
 	else
-	{
-		cout << GetConnDeviceName() << ": Device unlocked! Flashing starting..." << endl;
-	}
+		m_rgJournaled.assign(m_clImage.GetSectorCount(), false);
+	IssueCommand(LPC_STATE_UNLOCK, CMD_UNLOCK, TIMEOUT_COMMAND_MS);
+}
 
-	int nTotalSectors 	 = nDataCount / SECTOR_SIZE;
-	//int nFullChunksPerSector = SECTOR_SIZE / FULL_CHUNK_SIZE;
-	pFlashImage = rgFlashImage;
+/*
+* Asks for the part ID, with it the board is looked up in the sector cache
+*/
+void
+CDeviceLPC2103::BeginDeltaCheck()
+{
+	StartPhase();
 
-	for(int nCurSector=0; nCurSector<nTotalSectors; nCurSector++)
-	{
-		unsigned int nRamAddress = 0x40000200;
+	IssueCommand(LPC_STATE_READ_PART_ID, CMD_READ_PART_ID, TIMEOUT_COMMAND_MS);
+	m_clMatcher.ExpectValues(CMD_SUCCESS, 1);
+}
 
-		m_pclSerialPort->FlushI();
-		m_pclSerialPort->FlushO();
+// Adds the sectors the cache says the board holds already
+void
+CDeviceLPC2103::OnPartId(unsigned int nPartId)
+{
+	m_strCacheKey = CSectorCache::MakeKey(nPartId, m_strBoardId.empty() ? m_strConnDevice : m_strBoardId);
+	m_clCachedHashes.clear();
+	m_pclSectorCache->Lookup(m_strCacheKey, m_clCachedHashes);
 
-		//prepare and erase sector
-		stringstream ssCurSect,ssRamAddress;
-		ssCurSect << nCurSector;
-		string strCurSect;
-		ssCurSect >> strCurSect;
-		ssRamAddress << nRamAddress;
-		string strRamAddress;
-		ssRamAddress >> strRamAddress;
+	for(unsigned int i=0; i<m_clCachedHashes.size() && i<m_clImage.GetSectorCount(); i++)
+		if( m_rgProgramMap[i] && m_clCachedHashes[i] == CSectorCache::HashSector(m_clImage.GetSector(i), SECTOR_SIZE)
+		    && find(m_clUnchanged.begin(), m_clUnchanged.end(), i) == m_clUnchanged.end() )
+			m_clUnchanged.push_back(i);
 
-		string strPrepCmd, strEraseCmd;
-	
-		//strPrepCmd  = "P " + strCurSect + " " + strCurSect + "\r\n";
-		strPrepCmd  = "P 0 " + strCurSect + "\r\n";
-		strEraseCmd = "E " + strCurSect + " " + strCurSect + "\r\n";
+	BeginConfirm();
+}
 
-		if( SendCommand( strPrepCmd, "0\r\n", 5 ) == SUCCESS )
-		{
-			//cout << "Sector " << strCurSect << " prepared." << endl;
-		}
-		else
-		{
-			cout << GetConnDeviceName() << ": Error while preparing sector " << strCurSect << endl;
-			m_pclSerialPort->Close();
-			return false;
-		}
+/*
+* Before the m_clUnchanged sectors are left out a few samples of each are written into
+* the RAM in one go and compared with the flash, so a board flashed by other means
+* since is noticed.
+*/
+void
+CDeviceLPC2103::BeginConfirm()
+{
+	if( m_clUnchanged.empty() )
+	{
+		EndDeltaCheck();
+		return;
+	}
 
-		if( SendCommand( strEraseCmd, "0\r\n", 5 ) == SUCCESS )
+	m_rgSamples.clear();
+	for(unsigned int i=0; i<m_clUnchanged.size(); i++)
+		for(unsigned int j=0; j<CONFIRM_SAMPLES; j++)
 		{
-			//cout << "Sector " << nCurSector << " erased." << endl;
-		}
-		else
-		{
-			cout << GetConnDeviceName() << ": Error while erasing sector " << strCurSect << endl;
+			const unsigned char *pSample = m_clImage.GetSector(m_clUnchanged[i]) + SampleOffset(m_clUnchanged[i], j);
+			m_rgSamples.insert(m_rgSamples.end(), pSample, pSample + CONFIRM_SAMPLE_BYTES);
 		}
 
-		
+	m_bConfirming = true;
+	BeginUpload(&m_rgSamples[0], m_rgSamples.size());
+}
+
+// Compares the current sample in the RAM with the flash
+void
+CDeviceLPC2103::IssueCompare()
+{
+	unsigned int nSector = m_clUnchanged[m_nCurSample / CONFIRM_SAMPLES];
+	unsigned int nFlash = nSector * SECTOR_SIZE + SampleOffset(nSector, m_nCurSample % CONFIRM_SAMPLES);
+
+	IssueCommand(LPC_STATE_COMPARE, "M " + NumToStr(nFlash) + " " + NumToStr(RAM_ADDRESS + m_nCurSample * CONFIRM_SAMPLE_BYTES)
+	             + " " + NumToStr(CONFIRM_SAMPLE_BYTES) + "\r\n", TIMEOUT_COMMAND_MS);
+	m_clMatcher.ExpectValues(COMPARE_ERROR, 1);
+}
+
+/*
+* Leaves the confirmed sectors out. The sectors to program are marked unknown in the cache
+* before they are touched, an interrupted session must not leave their old hashes there.
+*/
+void
+CDeviceLPC2103::EndDeltaCheck()
+{
+	m_bConfirming = false;
+
+	for(unsigned int i=0; i<m_clUnchanged.size(); i++)
+		m_rgProgramMap[ m_clUnchanged[i] ] = false;
+
+	if( !m_clUnchanged.empty() )
+		cout << GetConnDeviceName() << ": " << m_clUnchanged.size() << " of " << m_nTotalSectors
+		     << " sector(s) unchanged on the board, left out." << endl;
+
+	m_nTotalSectors -= m_clUnchanged.size();
+	EndPhase(LPC_PHASE_DELTA_CHECK);
+
+	if( !m_strCacheKey.empty() )
+		StoreHashes(false);
+
+	PlanErase();
+}
+
+/*
+* Writes the hashes of the board into the cache, the sectors to program get the hash of
+* their new contents if bProgrammed is set and SECTOR_HASH_UNKNOWN otherwise
+*/
+void
+CDeviceLPC2103::StoreHashes(bool bProgrammed)
+{
+	m_clCachedHashes.resize(m_clImage.GetSectorCount(), SECTOR_HASH_UNKNOWN);
+
+	for(unsigned int i=0; i<m_clImage.GetSectorCount(); i++)
+		if( m_rgProgramMap[i] )
+			m_clCachedHashes[i] = bProgrammed ? CSectorCache::HashSector(m_clImage.GetSector(i), SECTOR_SIZE) : SECTOR_HASH_UNKNOWN;
+
+	m_pclSectorCache->Store(m_strCacheKey, m_clCachedHashes);
+}
+
+/*
+* Returns the first sector to program from nSector on or the sector count if there is none
+*/
+unsigned int
+CDeviceLPC2103::NextProgramSector(unsigned int nSector) const
+{
+	while( nSector < m_rgProgramMap.size() && !m_rgProgramMap[nSector] )
+		nSector++;
+
+	return nSector;
+}
+
+/*
+* Blank checks the sectors to program first, only those not blank already get erased
+*/
+void
+CDeviceLPC2103::PlanErase()
+{
+	m_rgEraseMap = m_rgProgramMap;
+	m_nBlankSectors = 0;
+
+	StartPhase();
+	BeginBlankCheck(0);
+}
+
+/*
+* Opens the journal of the board for the image, the sectors it confirms are programmed
+* already. Without a journal the flashing goes on, just not resumable.
+*/
+void
+CDeviceLPC2103::OpenJournal()
+{
+	string strName = m_strBoardId.empty() ? m_strConnDevice : m_strBoardId;
+
+	for(unsigned int i=0; i<strName.length(); i++)
+		if( strName[i] == '/' || isspace((unsigned char)strName[i]) )
+			strName[i] = '_';
+
+	if( !m_clJournal.Open(m_strJournalDir + "/" + strName + ".journal",
+	                      CSectorCache::HashSector(m_clImage.GetData(0), m_clImage.GetFlashSize()),
+	                      m_clImage.GetSectorCount(), m_rgJournaled) )
+	{
+		cout << GetConnDeviceName() << ": No journal, the flashing can't be resumed." << endl;
+		m_clJournal.Close();
+		m_rgJournaled.assign(m_clImage.GetSectorCount(), false);
+	}
+}
+
+// The current sector is in the flash (and verified), records it in the journal
+void
+CDeviceLPC2103::ConfirmSector()
+{
+	if( m_clJournal.IsOpen() )
+		m_clJournal.Confirm(m_nCurSector);
+}
+
+/*
+* Finds the next run of adjacent sectors to erase from nFromSector on and sets
+* m_nEraseStart and m_nEraseEnd to it. Returns false if there is none.
+*/
+bool
+CDeviceLPC2103::FindEraseRun(unsigned int nFromSector)
+{
+	m_nEraseStart = nFromSector;
+
+	while( m_nEraseStart < m_rgEraseMap.size() && !m_rgEraseMap[m_nEraseStart] )
+		m_nEraseStart++;
+
+	if( m_nEraseStart >= m_rgEraseMap.size() )
+		return false;
+
+	m_nEraseEnd = m_nEraseStart;
+
+	while( m_nEraseEnd + 1 < m_rgEraseMap.size() && m_rgEraseMap[m_nEraseEnd + 1] )
+		m_nEraseEnd++;
 
-		//make ram ready to write full sector size
-		string strRamWriteCmd = "W " + strRamAddress + " " + SECTOR_SIZE_STR + "\r\n";
+	return true;
+}
+
+/*
+* Blank checks the next run of sectors to erase from nFromSector on with one "I a b".
+* A sector which is not blank is reported with the offset of its first word which is
+* not, the check goes on behind it.
+*/
+void
+CDeviceLPC2103::BeginBlankCheck(unsigned int nFromSector)
+{
+	if( !FindEraseRun(nFromSector) )
+	{
+		EndBlankCheck();
+		return;
+	}
+
+	IssueCommand(LPC_STATE_BLANK_CHECK, "I " + NumToStr(m_nEraseStart) + " " + NumToStr(m_nEraseEnd) + "\r\n", TIMEOUT_COMMAND_MS);
+	m_clMatcher.ExpectValues(SECTOR_NOT_BLANK, 2);
+}
+
+void
+CDeviceLPC2103::EndBlankCheck()
+{
+	EndPhase(LPC_PHASE_BLANK_CHECK);
+
+	if( m_nBlankSectors )
+		cout << GetConnDeviceName() << ": " << m_nBlankSectors << " of " << m_nTotalSectors << " sector(s) blank already." << endl;
 
-		if( SendCommand( strRamWriteCmd, "0\r\n", 5 ) == SUCCESS )
+	BeginErase(0);
+}
+
+/*
+* Prepares and erases the next run of adjacent sectors to erase from nFromSector on with
+* one "P a b" and one "E a b", the sectors in between keep what they hold
+*/
+void
+CDeviceLPC2103::BeginErase(unsigned int nFromSector)
+{
+	if( !FindEraseRun(nFromSector) )
+	{
+		EndPhase(LPC_PHASE_ERASE);
+		BeginProgram();
+		return;
+	}
+
+	IssueCommand(LPC_STATE_PREPARE, "P " + NumToStr(m_nEraseStart) + " " + NumToStr(m_nEraseEnd) + "\r\n", TIMEOUT_COMMAND_MS);
+}
+
+// Everything erased, now the data
+void
+CDeviceLPC2103::BeginProgram()
+{
+	m_nCurSector = NextProgramSector(0);
+	m_nDoneSectors = 0;
+
+	// all of them left out, still the board is started
+	if( (unsigned int)m_nCurSector == m_clImage.GetSectorCount() )
+	{
+		m_nCurSector = 0;
+		IssueCommand(LPC_STATE_PREPARE_GO, "P 0 0\r\n", TIMEOUT_COMMAND_MS);
+		return;
+	}
+
+	BeginSector();
+}
+
+void
+CDeviceLPC2103::StartPhase()
+{
+	m_nPhaseStartMs = GetMonotonicMs();
+}
+
+// Adds the time since StartPhase() to the phase, the next phase starts now
+void
+CDeviceLPC2103::EndPhase(LPC2103Phase ePhase)
+{
+	uint64_t nNow = GetMonotonicMs();
+
+	m_rgnPhaseMs[ePhase] += nNow - m_nPhaseStartMs;
+	m_nPhaseStartMs = nNow;
+}
+
+/*
+* Prints where the time of the session went. The erase time the blank check saved is
+* estimated from the sectors erased on this board, the typical time if there were none.
+*/
+void
+CDeviceLPC2103::PrintTiming() const
+{
+	unsigned int nErased = m_nTotalSectors - m_nBlankSectors;
+	uint64_t nSectorEraseMs = nErased ? m_rgnPhaseMs[LPC_PHASE_ERASE] / nErased : ERASE_SECTOR_TYP_MS;
+
+	cout << GetConnDeviceName() << ": Timing: sync " << m_rgnPhaseMs[LPC_PHASE_SYNC] << " ms, ";
+
+	if( m_pclSectorCache || m_clJournal.IsOpen() )
+		cout << "delta check " << m_rgnPhaseMs[LPC_PHASE_DELTA_CHECK] << " ms (" << m_clUnchanged.size() << " unchanged), ";
+
+	cout << "blank check "
+	     << m_rgnPhaseMs[LPC_PHASE_BLANK_CHECK] << " ms (" << m_nBlankSectors << "/" << m_nTotalSectors
+	     << " blank, ~" << m_nBlankSectors * nSectorEraseMs << " ms of erase saved), erase "
+	     << m_rgnPhaseMs[LPC_PHASE_ERASE] << " ms, program " << m_rgnPhaseMs[LPC_PHASE_PROGRAM]
+	     << " ms, total " << GetMonotonicMs() - m_nSessionStartMs << " ms." << endl;
+
+	if( m_nResendsAsked || m_nResendsTimedOut )
+		cout << GetConnDeviceName() << ": " << m_nResendsAsked + m_nResendsTimedOut << " block(s) resent, "
+		     << m_nResendsAsked << " on RESEND, " << m_nResendsTimedOut << " on timeout." << endl;
+}
+
+/*
+* Programs the current sector, only the parts of it which don't stay erased
+*/
+void
+CDeviceLPC2103::BeginSector()
+{
+	unsigned int nOffset = NextGranule(0);
+
+	m_pclPort->FlushI();
+	m_pclPort->FlushO();
+
+	if( nOffset == SECTOR_SIZE )
+	{
+		cout << GetConnDeviceName() << ": Sector " << ++m_nDoneSectors << "/" << m_nTotalSectors << " is blank, erased only." << endl;
+		ConfirmSector();
+		NextSector();
+		return;
+	}
+
+	BeginChunk(nOffset);
+}
+
+/*
+* Writes the part of the current sector from nOffset on into the RAM, GetChunkSize() bytes
+*/
+void
+CDeviceLPC2103::BeginChunk(unsigned int nOffset)
+{
+	m_nChunkStart = nOffset;
+	m_nChunkSize  = GetChunkSize(nOffset);
+	m_bChunkSuspect = false;
+
+	BeginUpload(m_clImage.GetSector(m_nCurSector) + m_nChunkStart, m_nChunkSize);
+}
+
+/*
+* The chunk is in the flash, programs the next one or moves to the next sector
+*/
+void
+CDeviceLPC2103::EndChunk()
+{
+	unsigned int nNext = NextGranule(m_nChunkStart + m_nChunkSize);
+
+	if( nNext < SECTOR_SIZE )
+	{
+		BeginChunk(nNext);
+		return;
+	}
+
+	cout << GetConnDeviceName() << ": Sector " << ++m_nDoneSectors << "/" << m_nTotalSectors << (m_bVerify ? " programmed and verified." : " programmed.") << endl;
+	ConfirmSector();
+	NextSector();
+}
+
+/*
+* Writes nSize bytes into the RAM from RAM_ADDRESS on with "W" and the UU blocks
+*/
+void
+CDeviceLPC2103::BeginUpload(const unsigned char *pData, unsigned int nSize)
+{
+	m_pUpload     = pData;
+	m_nUploadSize = nSize;
+
+	IssueCommand(LPC_STATE_RAM_WRITE, "W " + NumToStr(RAM_ADDRESS) + " " + NumToStr(nSize) + "\r\n", TIMEOUT_COMMAND_MS);
+}
+
+/*
+* Moves to the next dirty sector, or starts the program once they are all done
+*/
+void
+CDeviceLPC2103::NextSector()
+{
+	unsigned int nNext = NextProgramSector(m_nCurSector + 1);
+
+	if( nNext == m_clImage.GetSectorCount() )
+	{
+		//prepare sector again
+		IssueCommand(LPC_STATE_PREPARE_GO, "P " + NumToStr(m_nCurSector) + " " + NumToStr(m_nCurSector) + "\r\n", TIMEOUT_COMMAND_MS);
+		return;
+	}
+
+	m_nCurSector = nNext;
+	BeginSector();
+}
+
+// Returns true if the granule of the current sector at nOffset is all erased bytes
+bool
+CDeviceLPC2103::IsGranuleBlank(unsigned int nOffset) const
+{
+	const unsigned char *pGranule = m_clImage.GetSector(m_nCurSector) + nOffset;
+
+	for(unsigned int i=0; i<COPY_GRANULE; i++)
+		if( pGranule[i] != FLASH_ERASED_BYTE )
+			return false;
+
+	return true;
+}
+
+// Returns the offset of the first granule from nOffset on which has to be programmed, SECTOR_SIZE if none
+unsigned int
+CDeviceLPC2103::NextGranule(unsigned int nOffset) const
+{
+	while( nOffset < SECTOR_SIZE && IsGranuleBlank(nOffset) )
+		nOffset += COPY_GRANULE;
+
+	return nOffset;
+}
+
+/*
+* Returns the biggest byte count of "C" which doesn't reach past the run of granules with
+* data starting at nOffset. A longer run is split rather than padded with erased bytes,
+* a few more round trips cost less than the padding on the line.
+*/
+unsigned int
+CDeviceLPC2103::GetChunkSize(unsigned int nOffset) const
+{
+	static const unsigned int rgnSizes[] = { 4096, 1024, 512, COPY_GRANULE };
+	unsigned int nEnd = nOffset;
+
+	while( nEnd < SECTOR_SIZE && !IsGranuleBlank(nEnd) )
+		nEnd += COPY_GRANULE;
+
+	for(unsigned int i=0; i<sizeof(rgnSizes)/sizeof(rgnSizes[0]); i++)
+		if( rgnSizes[i] <= nEnd - nOffset )
+			return rgnSizes[i];
+
+	return COPY_GRANULE;
+}
+
+/*
+* Sends the next block of UU encoded lines of the upload together with its
+* checksum line in one write. The echo is handled once the whole block is sent.
+*/
+void
+CDeviceLPC2103::SendBlock()
+{
+	CUUcoder clUUcoder;
+	unsigned int nChecksum = 0;
+
+	m_strBlock.clear();
+
+	for(int nLine=0; nLine<UU_LINES_PER_BLOCK && m_nCurLineStart<m_nUploadSize; nLine++)
+	{
+		const unsigned char *pLine = m_pUpload + m_nCurLineStart;
+		unsigned int nLineLen = UU_MAX_LINE_BYTES;
+
+		if( m_nCurLineStart + UU_MAX_LINE_BYTES > m_nUploadSize )
+			nLineLen = m_nUploadSize - m_nCurLineStart;
+
+		m_strBlock += clUUcoder.UUEncode( pLine, nLineLen );
+		m_strBlock += "\r\n";
+
+		for(unsigned int j=0; j<nLineLen; j++)
+			nChecksum += (unsigned int)pLine[j];
+
+		m_nCurLineStart += nLineLen;
+	}
+
+	//cout << "checksum: " << nChecksum << endl;
+	m_strBlock += NumToStr(nChecksum) + "\r\n";
+
+	m_nBlockTries = 0;
+	IssueBlock();
+}
+
+// Sends m_strBlock, the board answers "OK" or "RESEND" if the checksum didn't match
+void
+CDeviceLPC2103::IssueBlock()
+{
+	IssueCommand(LPC_STATE_CHECKSUM, m_strBlock, REP_OK, TIMEOUT_COMMAND_MS);
+	m_clMatcher.ExpectAlternative(REP_RESEND);
+}
+
+/*
+* Sends the block once more, at most CMD_MAX_TRIES times. The board asks for it with
+* "RESEND" when a line got damaged, it has dropped the block then. Without an answer we
+* can't tell whether the block or the answer got lost, so the chunk is verified on
+* the board after the copy. Once the resends run out at a raised baud rate the
+* session falls back to the sync rate instead of giving up.
+*/
+void
+CDeviceLPC2103::ResendBlock(bool bAsked)
+{
+	if( m_nBlockTries++ == CMD_MAX_TRIES )
+	{
+		if( m_bBaudRaised )
 		{
-			//cout << "RAM ready to receive sector " << nCurSector << " data." << endl;
+			FallBackBaudRate();
+			return;
 		}
-		else
+
+		AbortSession("Block not accepted after " + NumToStr(CMD_MAX_TRIES) + " resends, flashing aborted.");
+		return;
+	}
+
+	if( bAsked )
+		m_nResendsAsked++;
+	else
+	{
+		m_nResendsTimedOut++;
+		m_bChunkSuspect = true;
+	}
+
+	IssueBlock();
+}
+
+/*
+* Asks for the next READ_REQUEST_BYTES of the flash. The "OK" of the last block of the
+* previous request goes in front of the command, the board takes no other reply to it.
+*/
+void
+CDeviceLPC2103::IssueRead(const string & strAck)
+{
+	m_u32ReadEnd = min(m_u32ReadAddress + READ_REQUEST_BYTES, (uint32_t)LPC2103_FLASH_SIZE);
+
+	IssueCommand(LPC_STATE_READ, strAck + "R " + NumToStr(m_u32ReadAddress) + " " + NumToStr(m_u32ReadEnd - m_u32ReadAddress) + "\r\n", ReadBlockTimeoutMs());
+
+	m_strReadLines.clear();
+	m_clMatcher.ExpectLines(CMD_SUCCESS, (GetReadBlockSize() + UU_MAX_LINE_BYTES - 1) / UU_MAX_LINE_BYTES + 1, m_strReadLines);
+}
+
+// Acks the block just received (CMD_OK) or asks for it once more (CMD_RESEND)
+void
+CDeviceLPC2103::IssueReadAck(const char *pszAck)
+{
+	IssueCommand(LPC_STATE_READ_BLOCK, pszAck, ReadBlockTimeoutMs());
+
+	// the block follows without a return code
+	m_strReadLines.clear();
+	m_clMatcher.Arm( m_strCmd.data(), m_bEcho ? m_strCmd.length() : 0, ISP_REPLY_LINES );
+	m_clMatcher.ExpectLines(CMD_SUCCESS, (GetReadBlockSize() + UU_MAX_LINE_BYTES - 1) / UU_MAX_LINE_BYTES + 1, m_strReadLines);
+}
+
+// Returns the number of bytes in the block being received
+unsigned int
+CDeviceLPC2103::GetReadBlockSize() const
+{
+	return min(m_u32ReadEnd - m_u32ReadAddress, (uint32_t)FULL_CHUNK_SIZE);
+}
+
+/*
+* The block comes as UU text, 4 characters for 3 bytes and the length and CR/LF of
+* every line, so its time on the line is added to the command timeout
+*/
+unsigned int
+CDeviceLPC2103::ReadBlockTimeoutMs() const
+{
+	unsigned int nLines = (GetReadBlockSize() + UU_MAX_LINE_BYTES - 1) / UU_MAX_LINE_BYTES;
+
+	return TIMEOUT_COMMAND_MS + LineTimeMs(GetReadBlockSize() * 4 / 3 + nLines * 3 + REPLY_LINE_BYTES);
+}
+
+/*
+* Decodes the UU lines of the received block into pBlock (nSize bytes). Returns false
+* if a line is damaged or the checksum line doesn't match the decoded bytes.
+*/
+bool
+CDeviceLPC2103::DecodeReadBlock(unsigned char *pBlock, unsigned int nSize) const
+{
+	CUUcoder clUUcoder;
+	unsigned char rgLine[UU_MAX_LINE_BYTES + 3];
+	unsigned int nChecksum = 0, nOffset = 0;
+	string::size_type nStart = 0, nEnd;
+
+	while( (nEnd = m_strReadLines.find('\n', nStart)) != string::npos )
+	{
+		string strLine = m_strReadLines.substr(nStart, nEnd - nStart);
+		nStart = nEnd + 1;
+
+		// the checksum line is the last one
+		if( nOffset == nSize )
+			return strLine == NumToStr(nChecksum);
+
+		unsigned int nLineLen = min(nSize - nOffset, (unsigned int)UU_MAX_LINE_BYTES);
+
+		if( strLine.length() != (nLineLen + 2) / 3 * 4 + 1 || (((unsigned char)strLine[0] - 0x20) & 0x3F) != nLineLen )
+			return false;
+
+		clUUcoder.UUDecode(rgLine, strLine, sizeof(rgLine));
+
+		for(unsigned int i=0; i<nLineLen; i++)
+			nChecksum += rgLine[i];
+
+		memcpy(pBlock + nOffset, rgLine, nLineLen);
+		nOffset += nLineLen;
+	}
+
+	return false;
+}
+
+/*
+* A block of "R" arrived (bReplyOk) or timed out. A damaged block is asked for again
+* with "RESEND", at most CMD_MAX_TRIES times in a row, then the session falls back to
+* the sync rate if it was raised.
+*/
+void
+CDeviceLPC2103::OnReadBlock(bool bReplyOk)
+{
+	unsigned char rgBlock[FULL_CHUNK_SIZE];
+	unsigned int nSize = GetReadBlockSize();
+
+	// "R" itself failed (ie. CODE_READ_PROTECTION_ENABLED) or was not answered at all
+	if( m_eState == LPC_STATE_READ && m_clMatcher.GetReturnCode() != CMD_SUCCESS )
+	{
+		AbortSession("Error while reading the flash at 0x" + NumToHex(m_u32ReadAddress) + ", read aborted.");
+		return;
+	}
+
+	if( !bReplyOk || !DecodeReadBlock(rgBlock, nSize) )
+	{
+		if( ++m_nReadResends > CMD_MAX_TRIES )
 		{
-			cout << GetConnDeviceName() << ": Error while getting RAM ready for write operation" << endl;
+			if( m_bBaudRaised )
+			{
+				FallBackBaudRate();
+				return;
+			}
+
+			AbortSession("Block at 0x" + NumToHex(m_u32ReadAddress) + " still damaged after " + NumToStr(CMD_MAX_TRIES) + " resends, read aborted.");
+			return;
 		}
-		
-		
 
-		m_pclSerialPort->Flush();
-	
-		
-		int nDataSent = 0;
+		IssueReadAck(CMD_RESEND);
+		return;
+	}
+
+	if( !m_clReadFile.Write(rgBlock, nSize) )
+	{
+		AbortSession("Can't write the read data: " + string(strerror(errno)));
+		return;
+	}
 
-		int nCurLine  = 0;
-		int nChecksum = 0;
-		string strCurLine;
-		string strToSend;
+	m_u32ReadAddress += nSize;
+	m_nReadResends = 0;
 
-		for(unsigned int nCurLineStart=0; nCurLineStart<SECTOR_SIZE; nCurLineStart+=UU_MAX_LINE_BYTES)
-		{
-			nCurLine++;
+	if( m_u32ReadAddress % SECTOR_SIZE < nSize )
+		cout << GetConnDeviceName() << ": Sector " << m_u32ReadAddress / SECTOR_SIZE << "/" << LPC2103_FLASH_SIZE / SECTOR_SIZE << " read." << endl;
+
+	if( m_u32ReadAddress == LPC2103_FLASH_SIZE )
+		EndRead();
+	else if( m_u32ReadAddress == m_u32ReadEnd )
+		IssueRead(CMD_OK);
+	else
+		IssueReadAck(CMD_OK);
+}
+
+// The whole flash is in the file, the board stays in the boot loader
+void
+CDeviceLPC2103::EndRead()
+{
+	uint64_t nReadMs;
+
+	// no Flush(), it would drop the "OK" still in the output queue of a serial port
+	m_pclPort->Write( (const unsigned char *)CMD_OK, strlen(CMD_OK) );
+
+	if( !m_clReadFile.Close() )
+	{
+		AbortSession("Can't write the read data: " + string(strerror(errno)));
+		return;
+	}
+
+	nReadMs = GetMonotonicMs() - m_nPhaseStartMs;
+	cout << GetConnDeviceName() << ": " << LPC2103_FLASH_SIZE << "B read in " << nReadMs << " ms ("
+	     << (uint64_t)LPC2103_FLASH_SIZE * 1000 / (nReadMs ? nReadMs : 1) << " B/s)." << endl;
+	cout << GetConnDeviceName() << ": The first " << BOOT_REMAP_SIZE << " bytes are the boot block's vectors"
+	     << " mapped over the flash in ISP mode, not the flash itself." << endl;
 
-			if( (nCurLineStart + UU_MAX_LINE_BYTES >= SECTOR_SIZE) )
+	m_pclPort->Close();
+	m_eState = LPC_STATE_DONE;
+}
+
+void
+CDeviceLPC2103::AbortSession(string strMessage)
+{
+	cout << GetConnDeviceName() << ": " << strMessage << endl;
+	m_pclPort->Close();
+	m_eState = LPC_STATE_FAILED;
+}
+
+/*
+* The heart of the session: called when the reply for the current state arrived
+* (bReplyOk true) or when it timed out (bReplyOk false). For the timer states it is
+* called with true once the timer expires.
+*/
+void
+CDeviceLPC2103::Advance(bool bReplyOk)
+{
+	string strCurSect = NumToStr(m_nCurSector);
+	string strPrepCmd = "P " + strCurSect + " " + strCurSect + "\r\n";
+	unsigned int nVerifyAddress, nVerifySkip;
+
+	switch( m_eState )
+	{
+		case LPC_STATE_SYNC_PROBE:
+			if( !bReplyOk )
+			{
+				RollSync();
+				break;
+			}
+			IssueCommand(LPC_STATE_SYNC_ACK, CMD_SYNCHRONIZED, REP_OK, TIMEOUT_SYNC_MS);
+			break;
+
+		case LPC_STATE_SYNC_ACK:
+			if( !bReplyOk )
 			{
-				//cout << "Special..." << endl;
-				int left = 0;
-				for(int j=nCurLineStart; j<SECTOR_SIZE; j++)
+				RollSync();
+				break;
+			}
+			IssueCommand(LPC_STATE_SYNC_CRYSTAL, NumToStr(GetCrystalSpeedHz()) + "\r\n", REP_OK, TIMEOUT_SYNC_MS);
+			break;
+
+		case LPC_STATE_SYNC_CRYSTAL:
+			if( !bReplyOk )
+			{
+				RollSync();
+				break;
+			}
+
+			// "A 0" itself is echoed still, everything after it is not
+			IssueCommand(LPC_STATE_ECHO_OFF, CMD_ECHO_OFF, TIMEOUT_COMMAND_MS);
+			break;
+
+		case LPC_STATE_ECHO_OFF:
+			if( bReplyOk )
+				m_bEcho = false;
+			else
+				cout << GetConnDeviceName() << ": Warning: couldn't turn the echo off, keeping it on." << endl;
+
+			RaiseBaudRate();
+			break;
+
+		case LPC_STATE_SET_BAUD:
+			m_eResumeState = LPC_STATE_SYNCED;
+
+			if( !bReplyOk && m_clMatcher.IsDone() )
+			{
+				// refused (ie. INVALID_BAUD_RATE for the crystal), the error is explained already
+				cout << GetConnDeviceName() << ": Can't raise the baud rate to " << m_nConfBaudRate
+				     << ", staying at " << m_nBaudRate << " baud." << endl;
+				m_bBaudFellBack = true;
+				OnSynced();
+				break;
+			}
+
+			if( !bReplyOk )
+			{
+				// the board may have switched without the answer reaching us, the probes tell
+				m_bBaudFellBack = true;
+				IssueCommand(LPC_STATE_BAUD_SYNC_PROBE, CMD_ECHO_OFF, TIMEOUT_COMMAND_MS);
+				break;
+			}
+
+			if( m_pclPort->SetBaudRate(m_nConfBaudRate) != SUCCESS )
+			{
+				AbortSession("Can't set the port to " + NumToStr(m_nConfBaudRate) + " baud, reset the board.");
+				break;
+			}
+
+			m_nBaudRate = m_nConfBaudRate;
+			m_bBaudRaised = true;
+			IssueCommand(LPC_STATE_BAUD_PROBE, CMD_ECHO_OFF, TIMEOUT_COMMAND_MS);
+			break;
+
+		case LPC_STATE_BAUD_SYNC_PROBE:
+		case LPC_STATE_BAUD_PROBE:
+			if( !bReplyOk && m_eState == LPC_STATE_BAUD_SYNC_PROBE )
+			{
+				// not at the sync rate, so the board took the "B" and only its answer was lost
+				if( m_pclPort->SetBaudRate(m_nConfBaudRate) != SUCCESS )
 				{
-					nChecksum += (unsigned int)pFlashImage[j - nCurLineStart];	
-					left++;
+					AbortSession("No answer at " + NumToStr(m_nBaudRate) + " baud, reset the board.");
+					break;
 				}
-			
-				strCurLine = clUUcoder.UUEncode( pFlashImage, left );
-				strCurLine += "\r\n";
-			
-				m_pclSerialPort->Write( (const unsigned char *)strCurLine.c_str(), strCurLine.length() );
 
-				//while( m_pclSerialPort->Read_NonBlock( rgBuffer, 128 ) > 0 );
-				//while( m_pclSerialPort->GetReady() > 0 );
+				m_nBaudRate = m_nConfBaudRate;
+				m_bBaudRaised = true;
+				m_bBaudFellBack = false;
+				IssueCommand(LPC_STATE_BAUD_PROBE, CMD_ECHO_OFF, TIMEOUT_COMMAND_MS);
+				break;
+			}
+
+			if( !bReplyOk )
+			{
+				if( m_bBaudRaised )
+					FallBackBaudRate();
+				else
+					AbortSession("No answer at " + NumToStr(m_nBaudRate) + " baud either, reset the board.");
+				break;
+			}
 
-				nDataSent   += left;
+			// "A 0" again, the echo is off now even if it wasn't before
+			m_bEcho = false;
 
-				//cout << nDataSent << "B Sent" << endl;
+			if( m_bBaudFellBack )
+				cout << GetConnDeviceName() << ": Running at " << m_nBaudRate << " baud." << endl;
+			else
+				cout << GetConnDeviceName() << ": Baud rate raised to " << m_nBaudRate << "." << endl;
 
-				pFlashImage += left;
+			ResumeSession();
+			break;
 
-				goto CHECKSUM_START;
+		case LPC_STATE_BAUD_FALLBACK:
+			// without any answer "B" is sent again, the board may have missed it
+			if( !m_clMatcher.IsDone() && m_nBaudTries < CMD_MAX_TRIES )
+			{
+				IssueBaudFallback();
+				break;
 			}
 
+			// the port follows the board, the probe tells whether it got the "B"
+			m_pclPort->SetBaudRate(m_nSyncBaudRate);
+			m_nBaudRate = m_nSyncBaudRate;
+			m_bBaudRaised = false;
+			m_bBaudFellBack = true;
+			IssueCommand(LPC_STATE_BAUD_PROBE, CMD_ECHO_OFF, TIMEOUT_COMMAND_MS);
+			break;
 
-			
+		case LPC_STATE_UNLOCK:
+			if( !bReplyOk )
+			{
+				AbortSession("Error while unlocking the device!");
+				break;
+			}
+			cout << GetConnDeviceName() << ": Device unlocked! Flashing starting..." << endl;
 
-			strCurLine = clUUcoder.UUEncode( pFlashImage, UU_MAX_LINE_BYTES );
-			strCurLine += "\r\n";
+			m_rgProgramMap.assign(m_clImage.GetSectorCount(), false);
+			m_clUnchanged.clear();
 
-			m_pclSerialPort->Write( (const unsigned char *)strCurLine.c_str(), strCurLine.length() );
-			usleep(50000);
-			while( m_pclSerialPort->Read_NonBlock( rgBuffer, 128 ) > 0 );		
-			//while( m_pclSerialPort->GetReady() > 0 );
+			for(unsigned int i=0; i<m_clImage.GetSectorCount(); i++)
+			{
+				m_rgProgramMap[i] = m_clImage.IsSectorDirty(i);
 
-			for(int j=0; j<UU_MAX_LINE_BYTES; j++)
-					nChecksum += (unsigned int)pFlashImage[j];
+				// programmed by an interrupted session, confirmed by the samples like the unchanged ones
+				if( m_rgProgramMap[i] && m_rgJournaled[i] )
+					m_clUnchanged.push_back(i);
+			}
 
-			nDataSent   += UU_MAX_LINE_BYTES;
+			if( !m_clUnchanged.empty() )
+				cout << GetConnDeviceName() << ": Resuming, " << m_clUnchanged.size() << " of " << m_nTotalSectors
+				     << " sector(s) programmed by an interrupted session." << endl;
 
-			pFlashImage += UU_MAX_LINE_BYTES;
+			if( m_pclSectorCache )
+				BeginDeltaCheck();
+			else if( !m_clUnchanged.empty() )
+			{
+				StartPhase();
+				BeginConfirm();
+			}
+			else
+				PlanErase();
+			break;
 
+		case LPC_STATE_READ_PART_ID:
+			if( !bReplyOk || !m_clMatcher.HasValues() )
+			{
+				cout << GetConnDeviceName() << ": Can't read the part ID, the sector cache is not used." << endl;
+				BeginConfirm();
+				break;
+			}
+			OnPartId( m_clMatcher.GetValue(0) );
+			break;
 
-			if( nCurLine % 20 == 0 )
+		case LPC_STATE_COMPARE:
+			if( !bReplyOk )
 			{
-CHECKSUM_START:
-				//cout << "checksum: " << nChecksum << " pFlashImage: " << (unsigned int)pFlashImage << endl;
-				stringstream ssChecksum;
+				cout << GetConnDeviceName() << ": The board doesn't hold what the "
+				     << (m_pclSectorCache ? "sector cache" : "journal") << " says, programming all the sectors." << endl;
+				m_clUnchanged.clear();
 
-				ssChecksum << nChecksum;
-				string strChecksumCmd;
-				ssChecksum >> strChecksumCmd;
-		
-				strChecksumCmd += "\r\n";
+				if( m_clJournal.IsOpen() )
+					m_clJournal.Reset();
 
-				strToSend += strChecksumCmd;
+				EndDeltaCheck();
+				break;
+			}
 
-				//m_pclSerialPort->Flush();
+			if( ++m_nCurSample < m_clUnchanged.size() * CONFIRM_SAMPLES )
+				IssueCompare();
+			else
+				EndDeltaCheck();
+			break;
 
-				if( SendCommand( strChecksumCmd, CMD_OK, 5 ) == SUCCESS )
-				{
-					//cout << "."; cout.flush();
-					nChecksum = 0;
-				}
-				else
-				{
-					cout << GetConnDeviceName() << ": Error while getting reply to checksum!" << endl;
-					m_pclSerialPort->Close();
-					return false;
-				}	
+		case LPC_STATE_BLANK_CHECK:
+			if( bReplyOk )
+			{
+				// the whole run is blank
+				for(unsigned int i=m_nEraseStart; i<=m_nEraseEnd; i++)
+					m_rgEraseMap[i] = false;
+
+				m_nBlankSectors += m_nEraseEnd - m_nEraseStart + 1;
+				BeginBlankCheck(m_nEraseEnd + 1);
 			}
-			
-		}
-        cout << GetConnDeviceName() << ": Sector " << nCurSector + 1 << "/" << nTotalSectors << " programmed." << endl;
-		//cout << "OK" << endl;
+			else if( m_clMatcher.HasValues() )
+			{
+				// the sectors before the first word which is not blank are
+				unsigned int nSector = m_nEraseStart + m_clMatcher.GetValue(0) / SECTOR_SIZE;
 
-		//prepare sector again
-		if( SendCommand( strPrepCmd, "0\r\n", 5 ) == SUCCESS )
-		{
-			//cout << "Sector " << strCurSect << " prepared." << endl;
-		}
-		else
-		{
-			cout << GetConnDeviceName() << ": Error while preparing sector " << strCurSect << endl;
-			m_pclSerialPort->Close();
-			return false;
-		}
+				if( nSector > m_nEraseEnd )
+					nSector = m_nEraseStart;
+
+				for(unsigned int i=m_nEraseStart; i<nSector; i++)
+					m_rgEraseMap[i] = false;
+
+				m_nBlankSectors += nSector - m_nEraseStart;
+				BeginBlankCheck(nSector + 1);
+			}
+			else
+			{
+				// can't tell, the sectors not checked yet get erased
+				cout << GetConnDeviceName() << ": Blank check of sectors " << m_nEraseStart << "-" << m_nEraseEnd << " failed." << endl;
+				EndBlankCheck();
+			}
+			break;
 
-		stringstream ssRomAdr;
-		ssRomAdr << (nCurSector*SECTOR_SIZE);
-		string strRomAdr;
-		ssRomAdr >> strRomAdr;
+		case LPC_STATE_PREPARE:
+			if( !bReplyOk )
+			{
+				AbortSession("Error while preparing sectors " + NumToStr(m_nEraseStart) + "-" + NumToStr(m_nEraseEnd));
+				break;
+			}
+			IssueCommand(LPC_STATE_ERASE, "E " + NumToStr(m_nEraseStart) + " " + NumToStr(m_nEraseEnd) + "\r\n",
+			             TIMEOUT_ERASE_MS * (m_nEraseEnd - m_nEraseStart + 1));
+			break;
 
-		// copy from ram to rom
-		string strCopyRam2RomCmd = "C " + strRomAdr + " " + strRamAddress + " " + SECTOR_SIZE_STR + "\r\n";
+		case LPC_STATE_ERASE:
+			// copying into flash which is not erased would be recorded as programmed
+			if( !bReplyOk )
+			{
+				AbortSession("Error while erasing sectors " + NumToStr(m_nEraseStart) + "-" + NumToStr(m_nEraseEnd));
+				break;
+			}
+
+			BeginErase(m_nEraseEnd + 1);
+			break;
+
+		case LPC_STATE_RAM_WRITE:
+			// the board doesn't take the UU lines after a refused "W"
+			if( !bReplyOk )
+			{
+				AbortSession("Error while getting RAM ready for write operation");
+				break;
+			}
 
-		if( SendCommand( strCopyRam2RomCmd, "0\r\n", 5 ) == SUCCESS )
+			m_pclPort->Flush();
+
+			m_nCurLineStart = 0;
+			SendBlock();
+			break;
+
+		case LPC_STATE_CHECKSUM:
+			if( !bReplyOk || m_clMatcher.GotAlternative() )
+			{
+				ResendBlock(bReplyOk);
+				break;
+			}
+
+			if( m_nCurLineStart < m_nUploadSize )
+			{
+				SendBlock();
+				break;
+			}
+
+			// the samples are in the RAM, compare them with the flash
+			if( m_bConfirming )
+			{
+				m_nCurSample = 0;
+				IssueCompare();
+				break;
+			}
+
+			//prepare sector again
+			IssueCommand(LPC_STATE_PREPARE_COPY, strPrepCmd, TIMEOUT_COMMAND_MS);
+			break;
+
+		case LPC_STATE_PREPARE_COPY:
+			if( !bReplyOk )
+			{
+				AbortSession("Error while preparing sector " + strCurSect);
+				break;
+			}
+
+			// copy from ram to rom
+			IssueCommand(LPC_STATE_COPY, "C " + NumToStr(m_nCurSector*SECTOR_SIZE + m_nChunkStart) + " " + NumToStr(RAM_ADDRESS) + " " + NumToStr(m_nChunkSize) + "\r\n", TIMEOUT_COPY_MS);
+			break;
+
+		case LPC_STATE_COPY:
+			if( !bReplyOk )
+			{
+				AbortSession("Error while copying to sector " + strCurSect);
+				break;
+			}
+			StartTimer(LPC_STATE_COPY_DELAY, COPY_DELAY_MS);
+			break;
+
+		case LPC_STATE_COPY_DELAY:
+			if( !m_bVerify && !m_bChunkSuspect )
+			{
+				EndChunk();
+				break;
+			}
+
+			// the chunk is still in the RAM, the flash is compared with it (the chunks are larger than the remap)
+			nVerifyAddress = m_nCurSector*SECTOR_SIZE + m_nChunkStart;
+			nVerifySkip = RemapSkip(nVerifyAddress);
+			IssueCommand(LPC_STATE_VERIFY, "M " + NumToStr(nVerifyAddress + nVerifySkip) + " " + NumToStr(RAM_ADDRESS + nVerifySkip)
+			             + " " + NumToStr(m_nChunkSize - nVerifySkip) + "\r\n", TIMEOUT_COMMAND_MS);
+			m_clMatcher.ExpectValues(COMPARE_ERROR, 1);
+			break;
+
+		case LPC_STATE_VERIFY:
+			if( m_clMatcher.HasValues() )
+			{
+				nVerifyAddress = m_nCurSector*SECTOR_SIZE + m_nChunkStart;
+				AbortSession("Verify failed at 0x" + NumToHex(nVerifyAddress + RemapSkip(nVerifyAddress) + m_clMatcher.GetValue(0))
+				             + " in sector " + strCurSect + ", flashing aborted.");
+				break;
+			}
+			if( !bReplyOk )
+			{
+				AbortSession("Error while verifying sector " + strCurSect);
+				break;
+			}
+			EndChunk();
+			break;
+
+		case LPC_STATE_PREPARE_GO:
+			if( !bReplyOk )
+			{
+				AbortSession("Error while preparing sector " + strCurSect);
+				break;
+			}
+			else
+			{
+				string strGoRun = "G 0 A\r\n";
+
+				m_pclPort->Flush();
+				m_pclPort->Write( (const unsigned char *)strGoRun.c_str(), strGoRun.length() );
+				EndPhase(LPC_PHASE_PROGRAM);
+				cout << GetConnDeviceName() << ": Running in ARM mode from 0x00000000." << endl;
+				PrintTiming();
+
+				if( !m_strCacheKey.empty() )
+					StoreHashes(true);
+
+				m_clJournal.Finish();
+
+				m_pclPort->Close();
+				m_eState = LPC_STATE_DONE;
+			}
+			break;
+
+		case LPC_STATE_READ:
+		case LPC_STATE_READ_BLOCK:
+			OnReadBlock(bReplyOk);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+* Reads the firmware file and builds the flash image which is sent to the device
+*/
+bool
+CDeviceLPC2103::LoadFirmware(string strFirmwarePath)
+{
+	CFirmwareHEX32 clHexToFlash;
+	string strFileExt = strFirmwarePath.substr(strFirmwarePath.length()-3, 3);
+
+	m_clImage.Clear();
+
+	if( strFileExt == string("hex") || strFileExt == string("HEX") )
+	{
+		if( !clHexToFlash.OpenFirmware(strFirmwarePath.c_str()) )
 		{
-			usleep(10000);
+			cout << GetConnDeviceName() << ": ERROR: couldn't open " << strFirmwarePath << endl;
 		}
-		else
+
+		if( clHexToFlash.CheckFirmware() )
 		{
-			cout << GetConnDeviceName() << ": Error while copying to sector " << strCurSect << endl;
-			m_pclSerialPort->Close();
-			return false;
+			cout << GetConnDeviceName() << ": File " << strFirmwarePath << " seems to be valid! CRC test passed." << endl;
 		}
-		
+		 else
+		{
+			cout << GetConnDeviceName() << ": File " << strFirmwarePath << " is invalid! CRC test failed!" << endl;
+            return false;
+		}
+
 
-		if( nCurSector == (nTotalSectors - 1) )
+		uint32_t nAdr,rgData[HEX32_DATA_MAXLEN],nDataLen = HEX32_DATA_MAXLEN;
+		unsigned char rgBytes[HEX32_DATA_MAXLEN];
+		for(int i=0; i<HEX32_DATA_MAXLEN; i++) rgData[i] = 0;
+		while( clHexToFlash.GetNextAdrData(nAdr, rgData, nDataLen, false) )
 		{
-			//prepare sector again
-			if( SendCommand( strPrepCmd, "0\r\n", 5 ) == SUCCESS )
+			if( nDataLen == 0 )
 			{
-				//cout << "Sector " << strCurSect << " prepared." << endl;
-				m_pclSerialPort->Flush();
+				//reset the nDataLen and continue
+				nDataLen = HEX32_DATA_MAXLEN;
+				continue;
 			}
-			else
+
+			for( unsigned int i=0; i<nDataLen; i++ )
+				rgBytes[i] = (unsigned char)( rgData[i] & 0xFF );
+
+			// the record goes where its address says, gaps stay erased
+			if( !m_clImage.AddData(nAdr, rgBytes, nDataLen) )
 			{
-				cout << GetConnDeviceName() << ": Error while preparing sector " << strCurSect << endl;
-				m_pclSerialPort->Close();
+				cerr << GetConnDeviceName() << ": ERROR: Data at 0x" << hex << nAdr << dec
+				     << " is outside of the actual flash of the device!" << endl;
 				return false;
 			}
 
-
-			string strGoRun = "G 0 A\r\n";
-		
-			m_pclSerialPort->Write( (const unsigned char *)strGoRun.c_str(), strGoRun.length() );
-			cout << GetConnDeviceName() << ": Running in ARM mode from 0x00000000." << endl;
-			m_pclSerialPort->Close();	
-			return true;
+			//reset the nDataLen parameter since it may have
+			//been changed in the GetNextAdrData call
+			nDataLen = HEX32_DATA_MAXLEN;
 		}
+	} 
+	else
+	{
+		cout << GetConnDeviceName() << ": File doesn't end with .hex, no other files yet supported." << endl;
+		return false;
+	}
 
+	if( m_clImage.IsEmpty() )
+	{
+		cout << GetConnDeviceName() << ": ERROR: " << strFirmwarePath << " has no data to flash!" << endl;
+		return false;
 	}
 
-	
-	m_pclSerialPort->Close();
+	// make valid code sector, only if the image brings the vector table
+	if( m_clImage.IsSectorDirty(0) )
+	{
+		const unsigned char *p_vcs = m_clImage.GetData(0);
+		unsigned char rgSum[4];
+		unsigned int sum=0;
+		int addr;
+
+		for (addr=0; addr<0x20; addr+=4) {
+			if (addr != 0x14) {
+				sum += (p_vcs[addr] | (p_vcs[addr+1] << 8) | (p_vcs[addr+2] << 16) | (p_vcs[addr+3] << 24));
+			}
+		}
+		sum ^= 0xFFFFFFFF;
+		sum++;
+
+		rgSum[0] = (sum >> 0)  & 255;
+		rgSum[1] = (sum >> 8)  & 255;
+		rgSum[2] = (sum >> 16) & 255;
+		rgSum[3] = (sum >> 24) & 255;
+		m_clImage.AddData(0x14, rgSum, sizeof(rgSum));
+	}
+
+	//NOTE: If we get here, the whole image is buffered and ready to be sent to device
+
+	m_nTotalSectors = m_clImage.GetDirtyCount();
+
+	cout << GetConnDeviceName() << ": " << m_clImage.GetDataSize() << "B in " << m_clImage.GetRanges().size()
+	     << " range(s), " << m_nTotalSectors << " sector(s) to program." << endl;
+
 	return true;
 }
 
@@ -15,6 +15,12 @@
 #define __CDEVICELPC2103_H
 
 #include <device/CDeviceBase.h>
+#include <device/CIspReplyMatcher.h>
+#include <firmware/CFlashImage.h>
+#include <firmware/CFirmwareWriter.h>
+#include <tools/CRingBuffer.h>
+#include <tools/CSectorJournal.h>
+#include <stdint.h>
 
 /**
 *\class CDeviceLPC2103
@@ -49,19 +55,237 @@
 #define INVALID_STOP_BIT 			18
 #define CODE_READ_PROTECTION_ENABLED 		19
 
+//! Size of the on-chip flash of the LPC2103.
+#define LPC2103_FLASH_SIZE	(32*1024)
+//! Size of one flash sector of the LPC2103.
+#define LPC2103_SECTOR_SIZE	4096
+
+/**
+* States of the resumable ISP session. Each state (except the timer states and the final
+* ones) means that the named command was sent and we are waiting for its reply.
+*/
+enum LPC2103SessionState {
+	LPC_STATE_IDLE,			//!< nothing started yet
+	LPC_STATE_SYNC_PROBE,		//!< "?" sent
+	LPC_STATE_SYNC_ACK,		//!< "Synchronized" sent
+	LPC_STATE_SYNC_CRYSTAL,		//!< crystal frequency sent
+	LPC_STATE_ECHO_OFF,		//!< "A 0" sent
+	LPC_STATE_SET_BAUD,		//!< "B" of the configured baud rate sent at the sync rate
+	LPC_STATE_BAUD_PROBE,		//!< "A 0" sent at the new baud rate, the line is checked
+	LPC_STATE_BAUD_SYNC_PROBE,	//!< "A 0" sent at the sync rate, the "B" got no answer
+	LPC_STATE_BAUD_FALLBACK,	//!< "B" of the sync rate sent at the raised rate, which failed
+	LPC_STATE_SYNCED,		//!< synchronized, waiting for FlashDevice()
+	LPC_STATE_UNLOCK,		//!< "U" sent
+	LPC_STATE_READ_PART_ID,		//!< "J" sent, delta flashing only
+	LPC_STATE_COMPARE,		//!< "M" of a sample of an unchanged sector sent
+	LPC_STATE_BLANK_CHECK,		//!< "I" of a run of sectors sent
+	LPC_STATE_PREPARE,		//!< "P" of a run of sectors sent before erase
+	LPC_STATE_ERASE,		//!< "E" of a run of sectors sent
+	LPC_STATE_RAM_WRITE,		//!< "W" sent
+	LPC_STATE_CHECKSUM,		//!< block of UU lines and its checksum sent
+	LPC_STATE_PREPARE_COPY,		//!< "P" sent before copy
+	LPC_STATE_COPY,			//!< "C" sent
+	LPC_STATE_COPY_DELAY,		//!< timer: sector copied, letting the flash settle
+	LPC_STATE_VERIFY,		//!< "M" of the copied chunk against the RAM sent
+	LPC_STATE_PREPARE_GO,		//!< "P" sent before "G"
+	LPC_STATE_READ,			//!< "R" sent (after the "OK" of the previous request)
+	LPC_STATE_READ_BLOCK,		//!< "OK" or "RESEND" of a block of "R" sent
+	LPC_STATE_DONE,			//!< flashed, device running
+	LPC_STATE_FAILED		//!< gave up, port closed
+};
+
+//! Phases of the session measured for the timing report.
+enum LPC2103Phase {
+	LPC_PHASE_SYNC,			//!< from the first "?" until the echo is off and the baud rate is set, fallbacks too
+	LPC_PHASE_DELTA_CHECK,		//!< "J" and the samples of the unchanged or journaled sectors compared
+	LPC_PHASE_BLANK_CHECK,		//!< "I" over the sectors to program
+	LPC_PHASE_ERASE,		//!< "P" and "E" of the sectors not blank
+	LPC_PHASE_PROGRAM,		//!< "W", the UU blocks, "P" and "C" of all the sectors
+	LPC_PHASE_COUNT
+};
 
 class CDeviceLPC2103 : public CDeviceBase {
 protected:
-	int SendCommand(string strCmd, string strExpRep, unsigned int nTimeoutSec);
+	//! Current state of the ISP session.
+	LPC2103SessionState m_eState;
+	//! Set when the session should continue with flashing right after synchronization.
+	bool m_bFlashPending;
+	//! Number of failed synchronization attempts.
+	unsigned int m_nRollCount;
+	//! The last command sent, used to strip its echo from the reply.
+	string m_strCmd;
+	//! Number of bytes of m_strCmd written so far.
+	unsigned int m_nCmdSent;
+	//! Reply timeout of the current command, counted from its last byte written.
+	unsigned int m_nCmdTimeoutMs;
+	//! The board echoes what we send (the ISP default), cleared once "A 0" is acked.
+	bool m_bEcho;
+	//! Receive buffer of the port.
+	CRingBuffer m_clRxBuffer;
+	//! Parser of the reply to the last command, disarmed in the timer states.
+	CIspReplyMatcher m_clMatcher;
+	//! Monotonic time (ms) when the current command times out or the timer expires.
+	uint64_t m_nDeadlineMs;
+	//! Monotonic time (ms) when we give up waiting for the board to synchronize.
+	uint64_t m_nSyncDeadlineMs;
+	//! Baud rate of the line, used to add the transfer time to the deadlines.
+	unsigned int m_nBaudRate;
+	//! Baud rate of the flashing sequence, negotiated with "B" if the sync was done slower.
+	unsigned int m_nConfBaudRate;
+	//! Set while the port really runs at m_nConfBaudRate after "B", cleared by the fallback.
+	bool m_bBaudRaised;
+	//! Set once the session fell back to the sync rate, the rate is not raised again.
+	bool m_bBaudFellBack;
+	//! Times "B" of the sync rate was sent during the fallback.
+	unsigned int m_nBaudTries;
+	//! State whose command failed at the raised rate, the session resumes from it after the fallback.
+	LPC2103SessionState m_eResumeState;
+
+	//! The firmware laid out at its flash addresses.
+	CFlashImage m_clImage;
+	//! Number of sectors to program, the dirty ones of m_clImage.
+	int m_nTotalSectors;
+	//! Number of sectors programmed so far.
+	int m_nDoneSectors;
+	//! Sector being programmed.
+	int m_nCurSector;
+	//! Sectors to program, the dirty ones the board doesn't hold already.
+	vector<bool> m_rgProgramMap;
+	//! Key of the board in the sector cache, empty if it is not used.
+	string m_strCacheKey;
+	//! Hashes of the sectors of the board, as the cache knows them.
+	vector<string> m_clCachedHashes;
+	//! Journal of the sectors programmed, open while flashing if there is a journal directory.
+	CSectorJournal m_clJournal;
+	//! Sectors the journal confirms programmed by an interrupted session.
+	vector<bool> m_rgJournaled;
+	//! Dirty sectors the cache or the journal says the board holds already.
+	vector<unsigned int> m_clUnchanged;
+	//! Samples of the m_clUnchanged sectors, compared with the flash by "M".
+	vector<unsigned char> m_rgSamples;
+	//! Index of the sample being compared.
+	unsigned int m_nCurSample;
+	//! Set while the samples are uploaded and compared.
+	bool m_bConfirming;
+	//! Sectors to erase, the ones to program not found blank.
+	vector<bool> m_rgEraseMap;
+	//! Number of dirty sectors the blank check found blank.
+	unsigned int m_nBlankSectors;
+	//! First sector of the run being blank checked or erased.
+	unsigned int m_nEraseStart;
+	//! Last sector of the run being blank checked or erased.
+	unsigned int m_nEraseEnd;
+	//! Monotonic time (ms) the current phase started at.
+	uint64_t m_nPhaseStartMs;
+	//! Time (ms) spent in each phase of the session.
+	uint64_t m_rgnPhaseMs[LPC_PHASE_COUNT];
+	//! Monotonic time (ms) the session started at.
+	uint64_t m_nSessionStartMs;
+	//! Offset of the part of the current sector being written and copied.
+	unsigned int m_nChunkStart;
+	//! Size of that part, one of the byte counts "C" accepts.
+	unsigned int m_nChunkSize;
+	//! Bytes being written into the RAM from RAM_ADDRESS on (a chunk or the samples).
+	const unsigned char *m_pUpload;
+	//! Number of them.
+	unsigned int m_nUploadSize;
+	//! Offset of the next UU line within m_pUpload.
+	unsigned int m_nCurLineStart;
+	//! The UU lines of the block being sent followed by its checksum line, kept for a resend.
+	string m_strBlock;
+	//! Times the block being sent was sent again.
+	unsigned int m_nBlockTries;
+	//! Blocks sent again because the board answered "RESEND", this session.
+	unsigned int m_nResendsAsked;
+	//! Blocks sent again because the board didn't answer, this session.
+	unsigned int m_nResendsTimedOut;
+	//! Set if a block of the current chunk was resent on a timeout, the chunk is verified then.
+	bool m_bChunkSuspect;
+
+	//! The file the flash is read into by ReadDevice().
+	CFirmwareWriter m_clReadFile;
+	//! Flash address of the next block of "R" to receive.
+	uint32_t m_u32ReadAddress;
+	//! End of the flash requested by the running "R".
+	uint32_t m_u32ReadEnd;
+	//! The UU lines and the checksum line of the block being received.
+	string m_strReadLines;
+	//! Times the block being received was asked for again.
+	unsigned int m_nReadResends;
+
+	bool LoadFirmware(string strFirmwarePath);
+	void IssueCommand(LPC2103SessionState eState, const string & strCmd, unsigned int nTimeoutMs);
+	void IssueCommand(LPC2103SessionState eState, const string & strCmd, const char *pszExpRep, unsigned int nTimeoutMs);
+	unsigned int LineTimeMs(unsigned int nBytes) const;
+	unsigned int GetBytesInFlight() const;
+	void SendPending();
+	void StartTimer(LPC2103SessionState eState, unsigned int nTimeoutMs);
+	bool ReadReply();
+	bool IsReplyOk();
+	void Advance(bool bReplyOk);
+	bool BeginSync();
+	void RollSync();
+	void RaiseBaudRate();
+	void FallBackBaudRate();
+	void IssueBaudFallback();
+	void ResumeSession();
+	void OnSynced();
+	void BeginFlash();
+	void BeginDeltaCheck();
+	void OnPartId(unsigned int nPartId);
+	void OpenJournal();
+	void BeginConfirm();
+	void ConfirmSector();
+	void IssueCompare();
+	void EndDeltaCheck();
+	void StoreHashes(bool bProgrammed);
+	unsigned int NextProgramSector(unsigned int nSector) const;
+	void EndChunk();
+	void BeginUpload(const unsigned char *pData, unsigned int nSize);
+	void PlanErase();
+	bool FindEraseRun(unsigned int nFromSector);
+	void BeginBlankCheck(unsigned int nFromSector);
+	void EndBlankCheck();
+	void BeginErase(unsigned int nFromSector);
+	void BeginProgram();
+	void StartPhase();
+	void EndPhase(LPC2103Phase ePhase);
+	void PrintTiming() const;
+	void BeginSector();
+	void BeginChunk(unsigned int nOffset);
+	void NextSector();
+	bool IsGranuleBlank(unsigned int nOffset) const;
+	unsigned int NextGranule(unsigned int nOffset) const;
+	unsigned int GetChunkSize(unsigned int nOffset) const;
+	void SendBlock();
+	void IssueBlock();
+	void ResendBlock(bool bAsked);
+	void IssueRead(const string & strAck);
+	void IssueReadAck(const char *pszAck);
+	unsigned int GetReadBlockSize() const;
+	unsigned int ReadBlockTimeoutMs() const;
+	bool DecodeReadBlock(unsigned char *pBlock, unsigned int nSize) const;
+	void OnReadBlock(bool bReplyOk);
+	void EndRead();
+	bool RunSession();
 public:
 	CDeviceLPC2103();
-	CDeviceLPC2103(string strDevName, unsigned int unCrystalHz, speed_t stBaudRate );
+	CDeviceLPC2103(string strDevName, unsigned int unCrystalHz, unsigned int nBaudRate );
 	~CDeviceLPC2103();
 	bool InitializeDevice();
 	bool InitializeDevice(string strDevName);
 	vector<string> GetDeviceInfo();
 	bool FlashDevice(string strFirmwarePath);
+	bool ReadDevice(string strOutputPath);
     string GetConnDeviceName() const;
+
+	bool StartSession(string strFirmwarePath);
+	void ProcessSession();
+	int  GetSessionFd() const;
+	int  GetSessionTimeout() const;
+	bool IsSessionDone() const;
+	bool IsSessionOk() const;
+	void AbortSession(string strMessage);
 };
 
 #endif
@@ -0,0 +1,175 @@
+/*!\file  CIspReplyMatcher.cxx  Streaming parser of ISP replies
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <device/CIspReplyMatcher.h>
+#include <string.h>
+
+CIspReplyMatcher::CIspReplyMatcher()
+{
+	Disarm();
+}
+
+void
+CIspReplyMatcher::Arm(const char *pEcho, unsigned int nEchoLen, IspReplyKind eKind, const char *pszExpToken)
+{
+	m_eKind       = eKind;
+	m_pszExpToken = pszExpToken;
+	m_pszAltToken = 0;
+	m_bAlternative = false;
+	m_pEcho       = pEcho;
+	m_nEchoLen    = nEchoLen;
+	m_nEchoPos    = 0;
+	m_bEchoDone   = (nEchoLen == 0);
+	m_nTokenLen   = 0;
+	m_nReturnCode = -1;
+	m_nValuesCode = -1;
+	m_nValuesWanted = 0;
+	m_nValues     = 0;
+	m_nLinesCode  = -1;
+	m_nLinesWanted = 0;
+	m_nLines      = 0;
+	m_pstrLines   = 0;
+	m_bDone       = false;
+}
+
+void
+CIspReplyMatcher::ExpectValues(int nCode, unsigned int nCount)
+{
+	m_nValuesCode   = nCode;
+	m_nValuesWanted = nCount < ISP_MAX_VALUES ? nCount : ISP_MAX_VALUES;
+}
+
+void
+CIspReplyMatcher::ExpectLines(int nCode, unsigned int nCount, string & rstrLines)
+{
+	m_nLinesCode   = nCode;
+	m_nLinesWanted = nCount;
+	m_pstrLines    = &rstrLines;
+}
+
+void
+CIspReplyMatcher::Disarm()
+{
+	Arm(0, 0, ISP_REPLY_NONE);
+}
+
+bool
+CIspReplyMatcher::Feed(unsigned char u8Byte)
+{
+	if( m_eKind == ISP_REPLY_NONE || m_bDone )
+		return m_bDone;
+
+	if( !m_bEchoDone )
+	{
+		if( (unsigned char)m_pEcho[m_nEchoPos] == u8Byte )
+		{
+			if( ++m_nEchoPos == m_nEchoLen )
+				m_bEchoDone = true;
+			return false;
+		}
+
+		// the device doesn't echo (or the echo got broken), the byte belongs to the reply
+		m_bEchoDone = true;
+	}
+
+	if( m_nLinesWanted > 0 && (m_eKind == ISP_REPLY_LINES || (m_nReturnCode >= 0 && m_nReturnCode == m_nLinesCode)) )
+		return OnLineByte(u8Byte);
+
+	if( u8Byte == '\r' || u8Byte == '\n' )
+	{
+		if( m_nTokenLen > 0 )
+			m_bDone = OnToken();
+
+		m_nTokenLen = 0;
+		return m_bDone;
+	}
+
+	if( m_nTokenLen < ISP_TOKEN_MAXLEN )
+		m_rgToken[m_nTokenLen++] = (char)u8Byte;
+
+	return false;
+}
+
+// Called for every complete line, returns true if it is the expected reply
+bool
+CIspReplyMatcher::OnToken()
+{
+	m_rgToken[m_nTokenLen] = '\0';
+
+	if( m_eKind == ISP_REPLY_TOKEN )
+	{
+		if( m_pszAltToken && strcmp(m_rgToken, m_pszAltToken) == 0 )
+			m_bAlternative = true;
+
+		return m_bAlternative || strcmp(m_rgToken, m_pszExpToken) == 0;
+	}
+
+	// ISP_REPLY_RETURN_CODE, anything but a plain number is ignored
+	unsigned int nNumber;
+
+	if( !ParseNumber(m_rgToken, nNumber) )
+		return false;
+
+	// the lines after the return code
+	if( m_nReturnCode >= 0 )
+	{
+		m_rgnValues[m_nValues++] = nNumber;
+		return m_nValues == m_nValuesWanted;
+	}
+
+	m_nReturnCode = (int)nNumber;
+
+	if( m_nReturnCode == m_nLinesCode && m_nLinesWanted > 0 )
+		return false;
+
+	return m_nReturnCode != m_nValuesCode || m_nValuesWanted == 0;
+}
+
+// Called for every byte of the data lines, returns true once the last line is complete
+bool
+CIspReplyMatcher::OnLineByte(unsigned char u8Byte)
+{
+	if( u8Byte == '\r' || u8Byte == '\n' )
+	{
+		if( m_nTokenLen > 0 )
+		{
+			*m_pstrLines += '\n';
+			m_bDone = (++m_nLines == m_nLinesWanted);
+		}
+
+		m_nTokenLen = 0;
+		return m_bDone;
+	}
+
+	*m_pstrLines += (char)u8Byte;
+	m_nTokenLen++;
+
+	return false;
+}
+
+// Parses the line as a decimal number, false if it is something else
+bool
+CIspReplyMatcher::ParseNumber(const char *pszToken, unsigned int & nNumber)
+{
+	nNumber = 0;
+
+	for( ; *pszToken; pszToken++ )
+	{
+		if( *pszToken < '0' || *pszToken > '9' )
+			return false;
+
+		nNumber = nNumber*10 + (*pszToken - '0');
+	}
+
+	return true;
+}
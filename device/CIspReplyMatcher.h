@@ -0,0 +1,175 @@
+/*!\file  CIspReplyMatcher.h  Streaming parser of ISP replies
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef CISP_REPLY_MATCHER_H
+#define CISP_REPLY_MATCHER_H
+
+#include <string>
+
+using namespace std;
+
+//! Longest reply line we care about, longer lines are truncated.
+#define ISP_TOKEN_MAXLEN 32
+//! Most numeric lines following a return code, see CIspReplyMatcher::ExpectValues().
+#define ISP_MAX_VALUES 4
+
+//! What kind of reply is expected for the command.
+enum IspReplyKind {
+	ISP_REPLY_NONE,		//!< nothing expected, all the data are ignored
+	ISP_REPLY_TOKEN,	//!< a given line, ie. "OK" or "Synchronized"
+	ISP_REPLY_RETURN_CODE,	//!< a line with the numeric ISP return code
+	ISP_REPLY_LINES		//!< data lines only, see CIspReplyMatcher::ExpectLines()
+};
+
+/**
+*\class CIspReplyMatcher
+*\brief Parses the replies of the NXP ISP bootloader byte by byte.
+*
+* The bytes received after a command are fed one by one. First the echo of the
+* command is stripped by comparing it with the command sent, then the rest is split
+* into CR/LF delimited lines which are checked against the expected reply. Every
+* byte is looked at only once and no memory is allocated, except for the data lines
+* collected into the string of the caller.
+*/
+class CIspReplyMatcher
+{
+private:
+	//! Kind of the expected reply.
+	IspReplyKind m_eKind;
+	//! The expected line for ISP_REPLY_TOKEN.
+	const char *m_pszExpToken;
+	//! Another line completing the reply for ISP_REPLY_TOKEN, NULL if there is none.
+	const char *m_pszAltToken;
+	//! Set when the reply was m_pszAltToken.
+	bool m_bAlternative;
+	//! The command sent (owned by the caller), its echo is stripped.
+	const char *m_pEcho;
+	//! Length of the command.
+	unsigned int m_nEchoLen;
+	//! Number of echo bytes matched so far.
+	unsigned int m_nEchoPos;
+	//! Set once the echo is over (or turned out not to be there).
+	bool m_bEchoDone;
+	//! The line being received.
+	char m_rgToken[ISP_TOKEN_MAXLEN + 1];
+	//! Length of the line being received.
+	unsigned int m_nTokenLen;
+	//! The return code parsed for ISP_REPLY_RETURN_CODE.
+	int m_nReturnCode;
+	//! Return code which is followed by more lines of the reply, -1 if none is.
+	int m_nValuesCode;
+	//! Number of the numeric lines following m_nValuesCode.
+	unsigned int m_nValuesWanted;
+	//! The numbers of these lines received so far.
+	unsigned int m_rgnValues[ISP_MAX_VALUES];
+	//! Number of them received so far.
+	unsigned int m_nValues;
+	//! Return code which is followed by data lines, -1 if none is.
+	int m_nLinesCode;
+	//! Number of the data lines expected.
+	unsigned int m_nLinesWanted;
+	//! Number of them received so far.
+	unsigned int m_nLines;
+	//! Where the data lines go, each followed by '\n'.
+	string *m_pstrLines;
+	//! Set when the expected reply was received.
+	bool m_bDone;
+
+	bool OnToken();
+	bool OnLineByte(unsigned char u8Byte);
+	static bool ParseNumber(const char *pszToken, unsigned int & nNumber);
+
+public:
+	CIspReplyMatcher();
+
+	/**
+	*\brief Prepares the matcher for the reply of a new command.
+	*@param pEcho The command as sent, it has to stay valid until the reply is matched.
+	*@param nEchoLen Length of the command.
+	*@param eKind Kind of the expected reply.
+	*@param pszExpToken The expected line (without CR/LF) for ISP_REPLY_TOKEN.
+	*/
+	void Arm(const char *pEcho, unsigned int nEchoLen, IspReplyKind eKind, const char *pszExpToken = 0);
+
+	/**
+	*\brief Makes nCount numeric lines after the return code nCode part of the reply.
+	*
+	* Some commands add data after their return code, ie. "I" reports the offset and the
+	* contents of the first word which is not blank after SECTOR_NOT_BLANK. The reply is
+	* complete only once these lines are in, so they don't mix with the next reply.
+	* Call it after Arm(), it is reset there.
+	*/
+	void ExpectValues(int nCode, unsigned int nCount);
+
+	/**
+	*\brief Makes another line a complete reply too, ie. "RESEND" instead of "OK".
+	*
+	* For ISP_REPLY_TOKEN only, GotAlternative() tells which of them came. Call it
+	* after Arm(), it is reset there.
+	*/
+	void ExpectAlternative(const char *pszToken) { m_pszAltToken = pszToken; }
+
+	/**
+	*\brief Makes nCount data lines after the return code nCode part of the reply.
+	*
+	* The lines can be of any length (ie. the UU lines and the checksum of "R") and are
+	* appended to rstrLines each followed by '\n'. For ISP_REPLY_LINES there is no
+	* return code, the reply are the lines only and nCode is ignored. Call it after
+	* Arm(), it is reset there.
+	*/
+	void ExpectLines(int nCode, unsigned int nCount, string & rstrLines);
+
+	//! Forgets the expectation, all the data are then ignored.
+	void Disarm();
+
+	/**
+	*\brief Processes one received byte.
+	*@return true once the expected reply is complete.
+	*/
+	bool Feed(unsigned char u8Byte);
+
+	//! Returns true if some reply is expected.
+	bool IsArmed() const { return m_eKind != ISP_REPLY_NONE; }
+
+	//! Returns true once the expected reply was received.
+	bool IsDone() const { return m_bDone; }
+
+	//! Returns the kind of the expected reply.
+	IspReplyKind GetKind() const { return m_eKind; }
+
+	//! Returns the number of bytes of the command echoed back so far.
+	unsigned int GetEchoCount() const { return m_nEchoPos; }
+
+	//! Returns true once the echo is over, complete or broken off.
+	bool IsEchoDone() const { return m_bEchoDone; }
+
+	//! Returns true if the reply was the line given to ExpectAlternative().
+	bool GotAlternative() const { return m_bAlternative; }
+
+	//! Returns the received ISP return code (valid for ISP_REPLY_RETURN_CODE once done).
+	int GetReturnCode() const { return m_nReturnCode; }
+
+	//! Returns true if the reply is the return code given to ExpectValues() with all its lines.
+	bool HasValues() const { return m_nValuesWanted > 0 && m_nValues == m_nValuesWanted; }
+
+	//! Returns true if all the data lines given to ExpectLines() were received.
+	bool HasLines() const { return m_nLinesWanted > 0 && m_nLines == m_nLinesWanted; }
+
+	//! Returns the number of the lines following the return code, see ExpectValues().
+	unsigned int GetValueCount() const { return m_nValues; }
+
+	//! Returns the nIndex-th number following the return code.
+	unsigned int GetValue(unsigned int nIndex) const { return m_rgnValues[nIndex]; }
+};
+
+#endif
@@ -0,0 +1,146 @@
+/*!\file  CFirmwareWriter.cxx  Writes memory contents into a binary or Intel HEX32 file
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <firmware/CFirmwareWriter.h>
+#include <firmware/CFirmwareHEX32.h>
+#include <unistd.h>
+
+CFirmwareWriter::CFirmwareWriter()
+{
+	m_pFile = NULL;
+	m_bHex = false;
+	m_u32Address = 0;
+	m_u32Ulba = 0;
+	m_nRecordLen = 0;
+}
+
+CFirmwareWriter::~CFirmwareWriter()
+{
+	if( m_pFile )
+		fclose(m_pFile);
+}
+
+bool
+CFirmwareWriter::Open(const string & strPath, uint32_t u32BaseAddress)
+{
+	m_strPath = strPath;
+	m_bHex = strPath.length() >= 4 && strPath.compare(strPath.length() - 4, 4, ".hex") == 0;
+	m_u32Address = u32BaseAddress;
+	m_nRecordLen = 0;
+
+	if( (m_pFile = fopen(strPath.c_str(), "wb")) == NULL )
+		return false;
+
+	// the first data record always gets the upper half of its address
+	m_u32Ulba = (u32BaseAddress >> 16) + 1;
+
+	return true;
+}
+
+bool
+CFirmwareWriter::Write(const unsigned char *pData, unsigned int nLength)
+{
+	if( !m_bHex )
+	{
+		m_u32Address += nLength;
+		return fwrite(pData, 1, nLength, m_pFile) == nLength;
+	}
+
+	for(unsigned int i=0; i<nLength; i++)
+	{
+		m_rgRecord[m_nRecordLen++] = pData[i];
+
+		// a record never crosses a 64 KB boundary, the ULBA record comes in between
+		if( m_nRecordLen == HEX32_RECORD_BYTES || ((m_u32Address + m_nRecordLen) & 0xFFFF) == 0 )
+			if( !FlushRecord() )
+				return false;
+	}
+
+	return true;
+}
+
+// Writes the collected bytes as one data record, preceded by the ULBA record if needed
+bool
+CFirmwareWriter::FlushRecord()
+{
+	if( m_nRecordLen == 0 )
+		return true;
+
+	if( (m_u32Address >> 16) != m_u32Ulba )
+	{
+		unsigned char rgUlba[2];
+
+		m_u32Ulba = m_u32Address >> 16;
+		rgUlba[0] = (unsigned char)(m_u32Ulba >> 8);
+		rgUlba[1] = (unsigned char)m_u32Ulba;
+
+		if( !WriteRecord(RECTYP_EXTENDED_LIN_AR, 0, rgUlba, 2) )
+			return false;
+	}
+
+	if( !WriteRecord(RECTYP_DATAREC, (uint16_t)m_u32Address, m_rgRecord, m_nRecordLen) )
+		return false;
+
+	m_u32Address += m_nRecordLen;
+	m_nRecordLen = 0;
+
+	return true;
+}
+
+// Writes one ":LLAAAATT<data>CC" line
+bool
+CFirmwareWriter::WriteRecord(unsigned char u8Type, uint16_t u16Offset, const unsigned char *pData, unsigned int nLength)
+{
+	unsigned char u8Sum = nLength + (u16Offset >> 8) + (u16Offset & 0xFF) + u8Type;
+
+	if( fprintf(m_pFile, ":%02X%04X%02X", nLength, u16Offset, u8Type) < 0 )
+		return false;
+
+	for(unsigned int i=0; i<nLength; i++)
+	{
+		u8Sum += pData[i];
+		if( fprintf(m_pFile, "%02X", pData[i]) < 0 )
+			return false;
+	}
+
+	return fprintf(m_pFile, "%02X\n", (unsigned char)(0x100 - u8Sum)) >= 0;
+}
+
+bool
+CFirmwareWriter::Close()
+{
+	bool bOk = true;
+
+	if( m_pFile == NULL )
+		return false;
+
+	if( m_bHex )
+		bOk = FlushRecord() && WriteRecord(RECTYP_ENDREC, 0, NULL, 0);
+
+	bOk = (fclose(m_pFile) == 0) && bOk;
+	m_pFile = NULL;
+
+	return bOk;
+}
+
+void
+CFirmwareWriter::Discard()
+{
+	if( m_pFile )
+	{
+		fclose(m_pFile);
+		m_pFile = NULL;
+	}
+
+	unlink(m_strPath.c_str());
+}
@@ -0,0 +1,84 @@
+/*!\file  CFirmwareWriter.h  Writes memory contents into a binary or Intel HEX32 file
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __CFIRMWARE_WRITER_H
+#define __CFIRMWARE_WRITER_H
+
+#include <string>
+#include <stdio.h>
+#include <stdint.h>
+
+using namespace std;
+
+//! Data bytes of one Intel HEX data record written.
+#define HEX32_RECORD_BYTES	16
+
+/**
+*\class CFirmwareWriter
+*\brief Streams continuous memory contents into a file as they come.
+*
+* The format is chosen by the extension of the file: ".hex" gives Intel HEX32 (data
+* records of HEX32_RECORD_BYTES and an extended linear address record whenever the
+* upper half of the address changes), anything else (".bin") the raw bytes. The
+* bytes are written in the order of their addresses, starting at the base address.
+*/
+class CFirmwareWriter
+{
+private:
+	//! The output file, NULL while closed.
+	FILE *m_pFile;
+	//! The path of the output file.
+	string m_strPath;
+	//! Set for the Intel HEX32 format.
+	bool m_bHex;
+	//! Address of the next byte.
+	uint32_t m_u32Address;
+	//! Upper half of the address of the last extended linear address record written.
+	uint32_t m_u32Ulba;
+	//! Bytes of the next HEX record which is not complete yet.
+	unsigned char m_rgRecord[HEX32_RECORD_BYTES];
+	//! Number of them.
+	unsigned int m_nRecordLen;
+
+	bool WriteRecord(unsigned char u8Type, uint16_t u16Offset, const unsigned char *pData, unsigned int nLength);
+	bool FlushRecord();
+
+public:
+	CFirmwareWriter();
+	~CFirmwareWriter();
+
+	/**
+	*\brief Creates the file, the format is chosen by its extension.
+	*@param strPath Path to the output file.
+	*@param u32BaseAddress Address of the first byte written.
+	*@return false if the file can't be created.
+	*/
+	bool Open(const string & strPath, uint32_t u32BaseAddress);
+
+	/**
+	*\brief Appends the bytes behind the ones written so far.
+	*@return false on a write error.
+	*/
+	bool Write(const unsigned char *pData, unsigned int nLength);
+
+	/**
+	*\brief Writes what is left (the last HEX record and the end of file record) and closes the file.
+	*@return false on a write error.
+	*/
+	bool Close();
+
+	//! Closes and removes the file, ie. when the data could not be read completely.
+	void Discard();
+};
+
+#endif
@@ -0,0 +1,99 @@
+/*!\file  CFlashImage.cxx  Sparse image of the flash built from the firmware records
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <firmware/CFlashImage.h>
+#include <algorithm>
+#include <cstring>
+
+CFlashImage::CFlashImage(uint32_t u32FlashSize, uint32_t u32SectorSize)
+{
+	m_u32SectorSize = u32SectorSize;
+	m_rgData.resize(u32FlashSize);
+	m_rgDirty.resize(u32FlashSize / u32SectorSize);
+	Clear();
+}
+
+void
+CFlashImage::Clear()
+{
+	fill(m_rgData.begin(), m_rgData.end(), FLASH_ERASED_BYTE);
+	fill(m_rgDirty.begin(), m_rgDirty.end(), false);
+	m_clRanges.clear();
+}
+
+bool
+CFlashImage::AddData(uint32_t u32Address, const unsigned char *pData, uint32_t u32Length)
+{
+	if( u32Length == 0 )
+		return true;
+
+	if( u32Address >= m_rgData.size() || u32Length > m_rgData.size() - u32Address )
+		return false;
+
+	memcpy(&m_rgData[u32Address], pData, u32Length);
+	AddRange(u32Address, u32Length);
+
+	for(uint32_t u32Sector = u32Address / m_u32SectorSize; u32Sector <= (u32Address + u32Length - 1) / m_u32SectorSize; u32Sector++)
+		m_rgDirty[u32Sector] = true;
+
+	return true;
+}
+
+// Inserts the range keeping the list sorted, merges it with the ranges it overlaps or touches
+void
+CFlashImage::AddRange(uint32_t u32Start, uint32_t u32Length)
+{
+	uint32_t u32End = u32Start + u32Length;
+	vector<SImageRange>::iterator it = m_clRanges.begin();
+	SImageRange stRange;
+
+	while( it != m_clRanges.end() && it->u32Start + it->u32Length < u32Start )
+		++it;
+
+	while( it != m_clRanges.end() && it->u32Start <= u32End )
+	{
+		u32Start = min(u32Start, it->u32Start);
+		u32End   = max(u32End, it->u32Start + it->u32Length);
+		it = m_clRanges.erase(it);
+	}
+
+	stRange.u32Start  = u32Start;
+	stRange.u32Length = u32End - u32Start;
+	m_clRanges.insert(it, stRange);
+}
+
+uint32_t
+CFlashImage::GetDataSize() const
+{
+	uint32_t u32Size = 0;
+
+	for(unsigned int i=0; i<m_clRanges.size(); i++)
+		u32Size += m_clRanges[i].u32Length;
+
+	return u32Size;
+}
+
+unsigned int
+CFlashImage::GetDirtyCount() const
+{
+	return count(m_rgDirty.begin(), m_rgDirty.end(), true);
+}
+
+unsigned int
+CFlashImage::NextDirtySector(unsigned int nSector) const
+{
+	while( nSector < m_rgDirty.size() && !m_rgDirty[nSector] )
+		nSector++;
+
+	return nSector;
+}
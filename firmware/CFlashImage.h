@@ -0,0 +1,112 @@
+/*!\file  CFlashImage.h  Sparse image of the flash built from the firmware records
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __CFLASH_IMAGE_H
+#define __CFLASH_IMAGE_H
+
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+//! Value of an erased flash byte, the gaps of the image are filled with it.
+#define FLASH_ERASED_BYTE	0xFF
+
+//! Continuous piece of the image, [u32Start, u32Start + u32Length).
+typedef struct SImageRange_
+{
+	//! Flash address of the first byte.
+	uint32_t u32Start;
+	//! Number of bytes.
+	uint32_t u32Length;
+} SImageRange;
+
+/**
+*\class CFlashImage
+*\brief The firmware laid out at its flash addresses.
+*
+* The data records are placed where their address says, not one after the other, so
+* a gap in the firmware file stays a gap (erased bytes) on the device. The image keeps
+* the sorted list of the address ranges holding data and marks every sector one of
+* them touches as dirty, those are the only sectors that have to be programmed. The
+* sectors are all of the same size, addresses are offsets from the start of the flash.
+*/
+class CFlashImage
+{
+private:
+	//! The whole flash, bytes not covered by a range are FLASH_ERASED_BYTE.
+	vector<unsigned char> m_rgData;
+	//! Ranges with data, sorted and merged when they touch.
+	vector<SImageRange> m_clRanges;
+	//! Sectors holding a byte of some range.
+	vector<bool> m_rgDirty;
+	//! Size of one sector.
+	uint32_t m_u32SectorSize;
+
+	void AddRange(uint32_t u32Start, uint32_t u32Length);
+
+public:
+	/**
+	*\brief Creates an empty image of the flash.
+	*@param u32FlashSize Size of the flash, must be a multiple of u32SectorSize.
+	*@param u32SectorSize Size of one sector.
+	*/
+	CFlashImage(uint32_t u32FlashSize, uint32_t u32SectorSize);
+
+	//! Drops all the data, the whole image is erased again.
+	void Clear();
+
+	/**
+	*\brief Places the bytes at the address, overwriting what was there.
+	*@return false if the bytes don't fit into the flash, nothing is placed then.
+	*/
+	bool AddData(uint32_t u32Address, const unsigned char *pData, uint32_t u32Length);
+
+	//! Returns true if there is no data in the image.
+	bool IsEmpty() const { return m_clRanges.empty(); }
+
+	//! Returns the sorted ranges with data.
+	const vector<SImageRange> & GetRanges() const { return m_clRanges; }
+
+	//! Returns the number of bytes with data (gaps not counted).
+	uint32_t GetDataSize() const;
+
+	//! Returns the size of the flash.
+	uint32_t GetFlashSize() const { return m_rgData.size(); }
+
+	//! Returns the size of one sector.
+	uint32_t GetSectorSize() const { return m_u32SectorSize; }
+
+	//! Returns the number of sectors of the flash.
+	unsigned int GetSectorCount() const { return m_rgDirty.size(); }
+
+	//! Returns the number of sectors which have to be programmed.
+	unsigned int GetDirtyCount() const;
+
+	//! Returns true if some data falls into the sector.
+	bool IsSectorDirty(unsigned int nSector) const { return nSector < m_rgDirty.size() && m_rgDirty[nSector]; }
+
+	/**
+	*\brief Returns the first dirty sector from nSector on.
+	*@return The sector or GetSectorCount() if there is none.
+	*/
+	unsigned int NextDirtySector(unsigned int nSector) const;
+
+	//! Returns the bytes of the sector, gaps included.
+	const unsigned char * GetSector(unsigned int nSector) const { return &m_rgData[nSector * m_u32SectorSize]; }
+
+	//! Returns the bytes from the address on, gaps included.
+	const unsigned char * GetData(uint32_t u32Address) const { return &m_rgData[u32Address]; }
+};
+
+#endif
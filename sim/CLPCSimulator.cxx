@@ -0,0 +1,978 @@
+/*!\file  CLPCSimulator.cxx  Pseudo terminal LPC2103 ISP simulator
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <sim/CLPCSimulator.h>
+#include <device/CDeviceLPC2103.h>
+#include <tools/UUcoder.h>
+#include <core/timer.h>
+#include <core/defs.h>
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+
+#define REP_SYNCHRONIZED	"Synchronized\r\n"
+#define REP_OK			"OK\r\n"
+#define REP_RESEND		"RESEND\r\n"
+#define CMD_SYNCHRONIZED	"Synchronized"
+
+//! Bytes of a full UU line.
+#define SIM_UU_LINE_BYTES	45
+//! Longest UU line decoded, 45 bytes rounded up to the 3 byte groups.
+#define SIM_UU_MAX_BYTES	48
+
+// Splits the line into words, the first one being the command
+static vector<string> SplitWords(const string & strLine)
+{
+    vector<string> rgWords;
+    istringstream stream(strLine);
+    string strWord;
+
+    while( stream >> strWord )
+        rgWords.push_back(strWord);
+
+    return rgWords;
+}
+
+// Parses a decimal number, false if the word is not one
+static bool ParseNumber(const string & strWord, unsigned int & nNumber)
+{
+    char *pszEnd;
+
+    if( strWord.empty() || strWord[0] < '0' || strWord[0] > '9' )
+        return false;
+
+    nNumber = (unsigned int)strtoul(strWord.c_str(), &pszEnd, 10);
+    return *pszEnd == '\0';
+}
+
+// Parses the numeric arguments following the command word
+static bool ParseNumbers(const vector<string> & rgWords, unsigned int nCount, unsigned int *rgnNumbers)
+{
+    if( rgWords.size() != nCount + 1 )
+        return false;
+
+    for(unsigned int i=0; i<nCount; i++)
+        if( !ParseNumber(rgWords[i+1], rgnNumbers[i]) )
+            return false;
+
+    return true;
+}
+
+CLPCSimulator::CLPCSimulator(unsigned int nEraseMs, unsigned int nCopyMs)
+{
+    m_fdMaster = FAILURE;
+    m_bHungUp  = false;
+    m_nEraseMs = nEraseMs;
+    m_nCopyMs  = nCopyMs;
+    m_nFaultEvery = 0;
+    m_nBlocks  = 0;
+    m_nMaxBaud = 0;
+    m_nCutAfter = 0;
+    m_nCopies  = 0;
+    m_nBoards  = 0;
+
+    // a blank chip
+    memset(m_rgFlash, 0xFF, sizeof(m_rgFlash));
+    memset(m_rgRam, 0, sizeof(m_rgRam));
+
+    Reset();
+}
+
+CLPCSimulator::~CLPCSimulator()
+{
+    Close();
+}
+
+bool
+CLPCSimulator::Open(string strLinkName)
+{
+    struct termios stTio;
+    int fdSlave;
+    char *pszSlave;
+
+    m_fdMaster = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if( m_fdMaster < 0 || grantpt(m_fdMaster) != SUCCESS || unlockpt(m_fdMaster) != SUCCESS
+            || !(pszSlave = ptsname(m_fdMaster)) )
+    {
+        cerr << ERRSTR << "unable to create a pseudo terminal: " << strerror(errno) << endl;
+        Close();
+        return false;
+    }
+
+    m_strSlaveName = pszSlave;
+    fcntl(m_fdMaster, F_SETFL, fcntl(m_fdMaster, F_GETFL) | O_NONBLOCK);
+
+    // make the slave raw until armflash sets it up itself, the line discipline
+    // must not echo or translate anything on behalf of the boot loader
+    if( (fdSlave = open(pszSlave, O_RDWR | O_NOCTTY)) >= 0 )
+    {
+        if( tcgetattr(fdSlave, &stTio) == SUCCESS )
+        {
+            stTio.c_iflag = IGNBRK | IGNPAR;
+            stTio.c_oflag = 0;
+            stTio.c_lflag = 0;
+            stTio.c_cflag |= CS8 | CREAD | CLOCAL;
+            stTio.c_cc[VMIN]  = 1;
+            stTio.c_cc[VTIME] = 0;
+            tcsetattr(fdSlave, TCSANOW, &stTio);
+        }
+        close(fdSlave);
+    }
+
+    if( !strLinkName.empty() )
+    {
+        unlink(strLinkName.c_str());
+
+        if( symlink(pszSlave, strLinkName.c_str()) != SUCCESS )
+        {
+            cerr << ERRSTR << "unable to create the link " << strLinkName << ": " << strerror(errno) << endl;
+            Close();
+            return false;
+        }
+        m_strLinkName = strLinkName;
+    }
+
+    return true;
+}
+
+void
+CLPCSimulator::Attach(int fdPeer, string strName)
+{
+    m_fdMaster     = fdPeer;
+    m_strSlaveName = strName;
+    fcntl(m_fdMaster, F_SETFL, fcntl(m_fdMaster, F_GETFL) | O_NONBLOCK);
+}
+
+void
+CLPCSimulator::Close()
+{
+    if( !m_strLinkName.empty() )
+        unlink(m_strLinkName.c_str());
+    m_strLinkName.clear();
+
+    if( m_fdMaster >= 0 )
+        close(m_fdMaster);
+    m_fdMaster = FAILURE;
+}
+
+// Power cycle: back to the boot loader's autobaud, the flash keeps its contents
+void
+CLPCSimulator::Reset()
+{
+    m_eState     = SIM_STATE_AUTOBAUD;
+    m_bEcho      = true;
+    m_bUnlocked  = false;
+    m_nBaud      = 0;
+    m_nLossyLines = 0;
+    m_nPrepStart = 1;
+    m_nPrepEnd   = 0;
+    m_bBusy      = false;
+    m_nBusyUntilMs = 0;
+
+    m_nWriteOffset = m_nWriteLeft = 0;
+    m_pRead = NULL;
+    m_nReadLeft = m_nReadBlock = 0;
+    m_nBlockOffset = m_nBlockLines = m_nBlockSum = 0;
+
+    m_strPending.clear();
+    m_strInput.clear();
+    m_strOutput.clear();
+    m_strLine.clear();
+}
+
+int
+CLPCSimulator::GetPollFd() const
+{
+    return m_bHungUp ? FAILURE : m_fdMaster;
+}
+
+short
+CLPCSimulator::GetPollEvents() const
+{
+    return m_strOutput.empty() ? POLLIN : (POLLIN | POLLOUT);
+}
+
+int
+CLPCSimulator::GetTimeout() const
+{
+    uint64_t nNow;
+
+    if( !m_bBusy )
+        return -1;
+
+    nNow = GetMonotonicMs();
+    return nNow >= m_nBusyUntilMs ? 0 : (int)(m_nBusyUntilMs - nNow);
+}
+
+void
+CLPCSimulator::Process(short nRevents)
+{
+    struct pollfd stPollFd;
+
+    if( m_fdMaster < 0 )
+        return;
+
+    if( m_bHungUp )
+    {
+        // has somebody opened the slave again?
+        stPollFd.fd      = m_fdMaster;
+        stPollFd.events  = POLLIN;
+        stPollFd.revents = 0;
+
+        if( poll(&stPollFd, 1, 0) < 0 || (stPollFd.revents & POLLHUP) )
+            return;
+
+        m_bHungUp = false;
+        nRevents  = stPollFd.revents;
+    }
+
+    // end of file means the other side of a socket is gone
+    if( (nRevents & (POLLIN | POLLHUP)) && !ReadInput() )
+        nRevents |= POLLHUP;
+
+    if( m_bBusy && GetMonotonicMs() >= m_nBusyUntilMs )
+    {
+        m_bBusy = false;
+        m_strOutput += m_strPending;
+        m_strPending.clear();
+    }
+
+    // the input waits while the boot loader is busy
+    string::size_type i;
+    for(i=0; i<m_strInput.length() && !m_bBusy; i++)
+        Feed((unsigned char)m_strInput[i]);
+    m_strInput.erase(0, i);
+
+    if( nRevents & POLLHUP )
+    {
+        // the host closed the port, whatever was left goes nowhere
+        m_bHungUp = true;
+        Reset();
+        return;
+    }
+
+    WriteOutput();
+}
+
+// Returns false on end of file
+bool
+CLPCSimulator::ReadInput()
+{
+    char rgBuffer[256];
+    ssize_t nRead;
+
+    while( (nRead = read(m_fdMaster, rgBuffer, sizeof(rgBuffer))) > 0 )
+        m_strInput.append(rgBuffer, nRead);
+
+    return nRead != 0;
+}
+
+void
+CLPCSimulator::WriteOutput()
+{
+    ssize_t nWritten;
+
+    while( !m_strOutput.empty() )
+    {
+        nWritten = write(m_fdMaster, m_strOutput.data(), m_strOutput.length());
+
+        if( nWritten <= 0 )
+            return;	// the rest goes out when the master is writable again
+
+        m_strOutput.erase(0, nWritten);
+    }
+}
+
+void
+CLPCSimulator::Feed(unsigned char u8Byte)
+{
+    if( m_eState == SIM_STATE_AUTOBAUD )
+    {
+        // the real chip measures the bit time of '?' here, nothing is echoed
+        if( u8Byte == '?' )
+        {
+            m_strOutput += REP_SYNCHRONIZED;
+            m_eState = SIM_STATE_SYNC_ACK;
+        }
+        return;
+    }
+
+    if( m_bEcho )
+        m_strOutput += u8Byte;
+
+    if( u8Byte == '\r' )
+        return;
+
+    if( u8Byte != '\n' )
+    {
+        if( m_strLine.length() < SIM_MAX_LINE )
+            m_strLine += u8Byte;
+        return;
+    }
+
+    string strLine = m_strLine;
+    m_strLine.clear();
+    OnLine(strLine);
+}
+
+void
+CLPCSimulator::OnLine(const string & strLine)
+{
+    unsigned int nCrystal;
+
+    switch( m_eState )
+    {
+        case SIM_STATE_SYNC_ACK:
+            if( strLine == CMD_SYNCHRONIZED )
+            {
+                m_strOutput += REP_OK;
+                m_eState = SIM_STATE_CRYSTAL;
+            }
+            else
+                m_eState = SIM_STATE_AUTOBAUD;
+            break;
+
+        case SIM_STATE_CRYSTAL:
+            if( ParseNumber(strLine, nCrystal) )
+            {
+                m_strOutput += REP_OK;
+                m_eState = SIM_STATE_COMMAND;
+            }
+            else
+                m_eState = SIM_STATE_AUTOBAUD;
+            break;
+
+        case SIM_STATE_COMMAND:
+            if( !IsLineLost() )
+                OnCommand(strLine);
+            break;
+
+        case SIM_STATE_DATA:
+            OnDataLine(strLine);
+            break;
+
+        case SIM_STATE_CHECKSUM:
+            OnChecksum(strLine);
+            break;
+
+        case SIM_STATE_READ_ACK:
+            OnReadAck(strLine);
+            break;
+
+        default:
+            break;
+    }
+}
+
+void
+CLPCSimulator::OnCommand(const string & strLine)
+{
+    vector<string> rgWords = SplitWords(strLine);
+    unsigned int nDelayMs = 0, nAddress = 0;
+    int nCode;
+
+    if( rgWords.empty() )
+        return;
+
+    if( rgWords[0] == "A" )
+        Reply(DoEcho(rgWords));
+    else if( rgWords[0] == "B" )
+    {
+        unsigned int nBaud;
+
+        // the reply still goes out at the old rate
+        nCode = DoBaud(rgWords, nBaud);
+        Reply(nCode);
+        if( nCode == CMD_SUCCESS )
+            m_nBaud = nBaud;
+    }
+    else if( rgWords[0] == "J" )
+    {
+        ostringstream stream;
+
+        stream << SIM_PART_ID << "\r\n";
+        Reply(CMD_SUCCESS);
+        m_strOutput += stream.str();
+    }
+    else if( rgWords[0] == "U" )
+        Reply(DoUnlock(rgWords));
+    else if( rgWords[0] == "P" )
+        Reply(DoPrepare(rgWords));
+    else if( rgWords[0] == "E" )
+    {
+        nCode = DoErase(rgWords, nDelayMs);
+        ReplyLater(nCode, nDelayMs);
+    }
+    else if( rgWords[0] == "I" )
+    {
+        string strData;
+
+        Reply(DoBlankCheck(rgWords, strData));
+        m_strOutput += strData;
+    }
+    else if( rgWords[0] == "M" )
+    {
+        string strData;
+
+        Reply(DoCompare(rgWords, strData));
+        m_strOutput += strData;
+    }
+    else if( rgWords[0] == "W" )
+        Reply(DoWrite(rgWords));
+    else if( rgWords[0] == "R" )
+    {
+        nCode = DoRead(rgWords);
+        Reply(nCode);
+        if( nCode == CMD_SUCCESS )
+            SendReadBlock();
+    }
+    else if( rgWords[0] == "C" )
+    {
+        nCode = DoCopy(rgWords, nDelayMs);
+        ReplyLater(nCode, nDelayMs);
+
+        // power cut midway through the flashing, the reply is lost with it
+        if( nCode == CMD_SUCCESS && m_nCutAfter && ++m_nCopies == m_nCutAfter )
+        {
+            cout << GetPortName() << ": power cut after " << m_nCopies << " copies" << endl;
+            Reset();
+        }
+    }
+    else if( rgWords[0] == "G" )
+    {
+        nCode = DoGo(rgWords, nAddress);
+        Reply(nCode);
+        if( nCode == CMD_SUCCESS )
+            Run(nAddress);
+    }
+    else
+        Reply(INVALID_COMMAND);
+}
+
+void
+CLPCSimulator::Reply(int nCode)
+{
+    ostringstream stream;
+
+    stream << nCode << "\r\n";
+    m_strOutput += stream.str();
+}
+
+void
+CLPCSimulator::ReplyLater(int nCode, unsigned int nDelayMs)
+{
+    ostringstream stream;
+
+    if( nDelayMs == 0 )
+    {
+        Reply(nCode);
+        return;
+    }
+
+    stream << nCode << "\r\n";
+    m_strPending   = stream.str();
+    m_nBusyUntilMs = GetMonotonicMs() + nDelayMs;
+    m_bBusy        = true;
+}
+
+// Counts the UU block, true if it is the one the fault rate damages
+bool
+CLPCSimulator::IsBlockDamaged()
+{
+    return m_nFaultEvery && ++m_nBlocks % m_nFaultEvery == 0;
+}
+
+// Counts the command line, true if it is lost because the line runs faster than it can
+bool
+CLPCSimulator::IsLineLost()
+{
+    return m_nMaxBaud && m_nBaud > m_nMaxBaud && ++m_nLossyLines % SIM_LOSSY_EVERY == 0;
+}
+
+bool
+CLPCSimulator::IsPrepared(unsigned int nStart, unsigned int nEnd) const
+{
+    return m_nPrepStart <= m_nPrepEnd && nStart >= m_nPrepStart && nEnd <= m_nPrepEnd;
+}
+
+// The echo of the A command itself is already out, the new setting applies from its reply on
+int
+CLPCSimulator::DoEcho(const vector<string> & rgArgs)
+{
+    unsigned int nEcho;
+
+    if( !ParseNumbers(rgArgs, 1, &nEcho) || nEcho > 1 )
+        return PARAM_ERROR;
+
+    m_bEcho = nEcho == 1;
+    return CMD_SUCCESS;
+}
+
+// The rates of the ISP baud rate table, the stop bits are 1 or 2
+int
+CLPCSimulator::DoBaud(const vector<string> & rgArgs, unsigned int & nBaud)
+{
+    static const unsigned int rgnRates[] = { 9600, 19200, 38400, 57600, 115200, 230400 };
+    unsigned int rgnArgs[2];
+
+    if( !ParseNumbers(rgArgs, 2, rgnArgs) )
+        return PARAM_ERROR;
+
+    if( find(rgnRates, rgnRates + sizeof(rgnRates) / sizeof(rgnRates[0]), rgnArgs[0]) == rgnRates + sizeof(rgnRates) / sizeof(rgnRates[0]) )
+        return INVALID_BAUD_RATE;
+
+    if( rgnArgs[1] != 1 && rgnArgs[1] != 2 )
+        return INVALID_STOP_BIT;
+
+    nBaud = rgnArgs[0];
+    return CMD_SUCCESS;
+}
+
+int
+CLPCSimulator::DoUnlock(const vector<string> & rgArgs)
+{
+    unsigned int nCode;
+
+    if( !ParseNumbers(rgArgs, 1, &nCode) )
+        return PARAM_ERROR;
+
+    if( nCode != SIM_UNLOCK_CODE )
+        return INVALID_CODE;
+
+    m_bUnlocked = true;
+    return CMD_SUCCESS;
+}
+
+int
+CLPCSimulator::DoPrepare(const vector<string> & rgArgs)
+{
+    unsigned int rgnSectors[2];
+
+    if( !ParseNumbers(rgArgs, 2, rgnSectors) )
+        return PARAM_ERROR;
+
+    if( rgnSectors[0] > rgnSectors[1] || rgnSectors[1] >= SIM_SECTOR_COUNT )
+        return INVALID_SECTOR;
+
+    m_nPrepStart = rgnSectors[0];
+    m_nPrepEnd   = rgnSectors[1];
+    return CMD_SUCCESS;
+}
+
+int
+CLPCSimulator::DoErase(const vector<string> & rgArgs, unsigned int & nDelayMs)
+{
+    unsigned int rgnSectors[2];
+
+    if( !ParseNumbers(rgArgs, 2, rgnSectors) )
+        return PARAM_ERROR;
+
+    if( !m_bUnlocked )
+        return CMD_LOCKED;
+
+    if( rgnSectors[0] > rgnSectors[1] || rgnSectors[1] >= SIM_SECTOR_COUNT )
+        return INVALID_SECTOR;
+
+    if( !IsPrepared(rgnSectors[0], rgnSectors[1]) )
+        return SECTOR_NOT_PREPARED_FOR_WRITE_OPERATION;
+
+    memset(m_rgFlash + rgnSectors[0]*SIM_SECTOR_SIZE, 0xFF,
+           (rgnSectors[1] - rgnSectors[0] + 1)*SIM_SECTOR_SIZE);
+
+    // a prepare is good for one erase or copy only
+    m_nPrepStart = 1;
+    m_nPrepEnd   = 0;
+
+    nDelayMs = (rgnSectors[1] - rgnSectors[0] + 1) * m_nEraseMs;
+    return CMD_SUCCESS;
+}
+
+/*
+* A sector which is not blank is reported with the offset of its first word which is
+* not 0xFFFFFFFF, counted from the start of the first sector checked, and the word
+*/
+int
+CLPCSimulator::DoBlankCheck(const vector<string> & rgArgs, string & strData)
+{
+    unsigned int rgnSectors[2];
+    ostringstream stream;
+
+    if( !ParseNumbers(rgArgs, 2, rgnSectors) )
+        return PARAM_ERROR;
+
+    if( rgnSectors[0] > rgnSectors[1] || rgnSectors[1] >= SIM_SECTOR_COUNT )
+        return INVALID_SECTOR;
+
+    for(unsigned int nOffset = 0; nOffset < (rgnSectors[1] - rgnSectors[0] + 1)*SIM_SECTOR_SIZE; nOffset += 4)
+    {
+        const unsigned char *pWord = m_rgFlash + rgnSectors[0]*SIM_SECTOR_SIZE + nOffset;
+        uint32_t u32Word = pWord[0] | (pWord[1] << 8) | (pWord[2] << 16) | ((uint32_t)pWord[3] << 24);
+
+        if( u32Word != 0xFFFFFFFF )
+        {
+            stream << nOffset << "\r\n" << u32Word << "\r\n";
+            strData = stream.str();
+            return SECTOR_NOT_BLANK;
+        }
+    }
+
+    return CMD_SUCCESS;
+}
+
+// Returns the simulated memory at the address if nCount bytes from it are mapped, NULL otherwise
+const unsigned char *
+CLPCSimulator::MapAddress(unsigned int nAddress, unsigned int nCount) const
+{
+    if( nAddress < SIM_FLASH_SIZE && nCount <= SIM_FLASH_SIZE - nAddress )
+        return m_rgFlash + nAddress;
+
+    if( nAddress >= SIM_RAM_BASE && nAddress - SIM_RAM_BASE < SIM_RAM_SIZE && nCount <= SIM_RAM_SIZE - (nAddress - SIM_RAM_BASE) )
+        return m_rgRam + (nAddress - SIM_RAM_BASE);
+
+    return NULL;
+}
+
+// The vectors of the boot block, "LDR PC, [PC, #0x18]" and the boot ROM addresses
+static const unsigned char s_rgBootVectors[SIM_BOOT_REMAP_SIZE] = {
+    0x18, 0xF0, 0x9F, 0xE5, 0x18, 0xF0, 0x9F, 0xE5, 0x18, 0xF0, 0x9F, 0xE5, 0x18, 0xF0, 0x9F, 0xE5,
+    0x18, 0xF0, 0x9F, 0xE5, 0xEC, 0xFF, 0xFF, 0xB8, 0x18, 0xF0, 0x9F, 0xE5, 0x18, 0xF0, 0x9F, 0xE5,
+    0x00, 0xE0, 0xFF, 0x7F, 0x40, 0xE0, 0xFF, 0x7F, 0x80, 0xE0, 0xFF, 0x7F, 0xC0, 0xE0, 0xFF, 0x7F,
+    0x00, 0xE1, 0xFF, 0x7F, 0x00, 0x00, 0x00, 0x00, 0x40, 0xE1, 0xFF, 0x7F, 0x80, 0xE1, 0xFF, 0x7F
+};
+
+// Returns what "M" and "R" see at the byte, the boot block's vectors over the start of the flash
+const unsigned char *
+CLPCSimulator::MapBootVectors(const unsigned char *pByte) const
+{
+    if( pByte >= m_rgFlash && pByte < m_rgFlash + SIM_BOOT_REMAP_SIZE )
+        return s_rgBootVectors + (pByte - m_rgFlash);
+
+    return pByte;
+}
+
+// A difference is reported with the offset of the first word which differs
+int
+CLPCSimulator::DoCompare(const vector<string> & rgArgs, string & strData)
+{
+    unsigned int rgnArgs[3];
+    const unsigned char *pDst, *pSrc;
+    ostringstream stream;
+
+    if( !ParseNumbers(rgArgs, 3, rgnArgs) )
+        return PARAM_ERROR;
+
+    if( rgnArgs[0] % 4 )
+        return DST_ADDR_ERROR;
+
+    if( rgnArgs[1] % 4 )
+        return SRC_ADDR_ERROR;
+
+    if( rgnArgs[2] % 4 )
+        return COUNT_ERROR;
+
+    if( !(pDst = MapAddress(rgnArgs[0], rgnArgs[2])) )
+        return DST_ADDR_NOT_MAPPED;
+
+    if( !(pSrc = MapAddress(rgnArgs[1], rgnArgs[2])) )
+        return SRC_ADDR_NOT_MAPPED;
+
+    for(unsigned int nOffset = 0; nOffset < rgnArgs[2]; nOffset += 4)
+    {
+        if( memcmp(MapBootVectors(pDst + nOffset), MapBootVectors(pSrc + nOffset), 4) != 0 )
+        {
+            stream << nOffset << "\r\n";
+            strData = stream.str();
+            return COMPARE_ERROR;
+        }
+    }
+
+    return CMD_SUCCESS;
+}
+
+int
+CLPCSimulator::DoWrite(const vector<string> & rgArgs)
+{
+    unsigned int rgnArgs[2];
+
+    if( !ParseNumbers(rgArgs, 2, rgnArgs) )
+        return PARAM_ERROR;
+
+    if( rgnArgs[0] % 4 )
+        return ADDR_ERROR;
+
+    if( rgnArgs[1] % 4 )
+        return COUNT_ERROR;
+
+    if( rgnArgs[0] < SIM_RAM_BASE || rgnArgs[0] - SIM_RAM_BASE + rgnArgs[1] > SIM_RAM_SIZE )
+        return ADDR_NOT_MAPPED;
+
+    m_nWriteOffset = m_nBlockOffset = rgnArgs[0] - SIM_RAM_BASE;
+    m_nWriteLeft   = rgnArgs[1];
+    m_nBlockLines  = 0;
+    m_nBlockSum    = 0;
+
+    if( m_nWriteLeft )
+        m_eState = SIM_STATE_DATA;
+
+    return CMD_SUCCESS;
+}
+
+void
+CLPCSimulator::OnDataLine(const string & strLine)
+{
+    CUUcoder clCoder;
+    unsigned char rgData[SIM_UU_MAX_BYTES];
+    unsigned int nLength, nDecoded;
+
+    nLength = strLine.empty() ? 0 : ((unsigned char)strLine[0] - 0x20) & 0x3F;
+    nDecoded = strLine.length() > 1 ? clCoder.UUDecode(rgData, strLine, sizeof(rgData)) : 0;
+
+    // a damaged line only spoils the checksum, the host resends the block
+    if( nLength > nDecoded )
+        nLength = nDecoded;
+    if( nLength > m_nWriteLeft )
+        nLength = m_nWriteLeft;
+
+    for(unsigned int i=0; i<nLength; i++)
+    {
+        m_rgRam[m_nWriteOffset++] = rgData[i];
+        m_nBlockSum += rgData[i];
+    }
+    m_nWriteLeft -= nLength;
+    m_nBlockLines++;
+
+    if( m_nBlockLines == SIM_LINES_PER_BLOCK || m_nWriteLeft == 0 )
+        m_eState = SIM_STATE_CHECKSUM;
+}
+
+void
+CLPCSimulator::OnChecksum(const string & strLine)
+{
+    unsigned int nChecksum;
+
+    if( ParseNumber(strLine, nChecksum) && nChecksum == m_nBlockSum && !IsBlockDamaged() )
+    {
+        m_strOutput += REP_OK;
+        m_nBlockOffset = m_nWriteOffset;
+    }
+    else
+    {
+        // forget the block, the host sends it once more
+        m_strOutput += REP_RESEND;
+        m_nWriteLeft  += m_nWriteOffset - m_nBlockOffset;
+        m_nWriteOffset = m_nBlockOffset;
+    }
+
+    m_nBlockLines = 0;
+    m_nBlockSum   = 0;
+    m_eState = m_nWriteLeft ? SIM_STATE_DATA : SIM_STATE_COMMAND;
+}
+
+int
+CLPCSimulator::DoRead(const vector<string> & rgArgs)
+{
+    unsigned int rgnArgs[2];
+
+    if( !ParseNumbers(rgArgs, 2, rgnArgs) )
+        return PARAM_ERROR;
+
+    if( rgnArgs[0] % 4 )
+        return ADDR_ERROR;
+
+    if( rgnArgs[1] % 4 || rgnArgs[1] == 0 )
+        return COUNT_ERROR;
+
+    if( !(m_pRead = MapAddress(rgnArgs[0], rgnArgs[1])) )
+        return ADDR_NOT_MAPPED;
+
+    m_nReadLeft = rgnArgs[1];
+    return CMD_SUCCESS;
+}
+
+// Sends the next SIM_LINES_PER_BLOCK UU lines of "R" and their checksum
+void
+CLPCSimulator::SendReadBlock()
+{
+    CUUcoder clCoder;
+    unsigned int nSum = 0;
+    ostringstream stream;
+
+    m_nReadBlock = 0;
+
+    for(unsigned int nLine=0; nLine<SIM_LINES_PER_BLOCK && m_nReadBlock<m_nReadLeft; nLine++)
+    {
+        unsigned char rgLine[SIM_UU_LINE_BYTES];
+        unsigned int nLength = m_nReadLeft - m_nReadBlock;
+
+        if( nLength > SIM_UU_LINE_BYTES )
+            nLength = SIM_UU_LINE_BYTES;
+
+        for(unsigned int i=0; i<nLength; i++)
+        {
+            rgLine[i] = *MapBootVectors(m_pRead + m_nReadBlock + i);
+            nSum += rgLine[i];
+        }
+
+        m_strOutput += clCoder.UUEncode(rgLine, nLength) + "\r\n";
+
+        m_nReadBlock += nLength;
+    }
+
+    stream << (IsBlockDamaged() ? nSum + 1 : nSum) << "\r\n";
+    m_strOutput += stream.str();
+    m_eState = SIM_STATE_READ_ACK;
+}
+
+void
+CLPCSimulator::OnReadAck(const string & strLine)
+{
+    if( strLine == "RESEND" )
+    {
+        SendReadBlock();
+        return;
+    }
+
+    m_pRead     += m_nReadBlock;
+    m_nReadLeft -= m_nReadBlock;
+
+    if( strLine == "OK" && m_nReadLeft )
+    {
+        SendReadBlock();
+        return;
+    }
+
+    // the read is over, anything but "OK" is taken for the next command
+    m_nReadLeft = 0;
+    m_eState = SIM_STATE_COMMAND;
+
+    if( strLine != "OK" )
+        OnCommand(strLine);
+}
+
+int
+CLPCSimulator::DoCopy(const vector<string> & rgArgs, unsigned int & nDelayMs)
+{
+    unsigned int rgnArgs[3];
+    unsigned int nDst, nSrc, nCount;
+
+    if( !ParseNumbers(rgArgs, 3, rgnArgs) )
+        return PARAM_ERROR;
+
+    nDst   = rgnArgs[0];
+    nSrc   = rgnArgs[1];
+    nCount = rgnArgs[2];
+
+    if( !m_bUnlocked )
+        return CMD_LOCKED;
+
+    if( nDst % 256 )
+        return DST_ADDR_ERROR;
+
+    if( nSrc % 4 )
+        return SRC_ADDR_ERROR;
+
+    if( nCount != 256 && nCount != 512 && nCount != 1024 && nCount != 4096 )
+        return COUNT_ERROR;
+
+    if( nDst + nCount > SIM_FLASH_SIZE )
+        return DST_ADDR_NOT_MAPPED;
+
+    if( nSrc < SIM_RAM_BASE || nSrc - SIM_RAM_BASE + nCount > SIM_RAM_SIZE )
+        return SRC_ADDR_NOT_MAPPED;
+
+    if( !IsPrepared(nDst / SIM_SECTOR_SIZE, (nDst + nCount - 1) / SIM_SECTOR_SIZE) )
+        return SECTOR_NOT_PREPARED_FOR_WRITE_OPERATION;
+
+    // programming can only clear bits, only an erase sets them back
+    for(unsigned int i=0; i<nCount; i++)
+        m_rgFlash[nDst + i] &= m_rgRam[nSrc - SIM_RAM_BASE + i];
+
+    m_nPrepStart = 1;
+    m_nPrepEnd   = 0;
+
+    nDelayMs = (nCount / 256) * m_nCopyMs;
+    return CMD_SUCCESS;
+}
+
+int
+CLPCSimulator::DoGo(const vector<string> & rgArgs, unsigned int & nAddress)
+{
+    if( rgArgs.size() != 3 || !ParseNumber(rgArgs[1], nAddress) )
+        return PARAM_ERROR;
+
+    if( rgArgs[2] != "A" && rgArgs[2] != "T" )
+        return PARAM_ERROR;
+
+    if( !m_bUnlocked )
+        return CMD_LOCKED;
+
+    if( nAddress >= SIM_FLASH_SIZE )
+        return ADDR_NOT_MAPPED;
+
+    return CMD_SUCCESS;
+}
+
+bool
+CLPCSimulator::LoadFlash(const string & strFile)
+{
+    FILE *pFile = fopen(strFile.c_str(), "rb");
+    size_t nRead;
+
+    if( !pFile )
+    {
+        cerr << ERRSTR << "unable to read " << strFile << endl;
+        return false;
+    }
+
+    // a shorter file leaves the rest of the flash erased
+    memset(m_rgFlash, 0xFF, sizeof(m_rgFlash));
+    nRead = fread(m_rgFlash, 1, sizeof(m_rgFlash), pFile);
+    fclose(pFile);
+
+    return nRead > 0;
+}
+
+// The board leaves the boot loader, it is counted and the flash saved
+void
+CLPCSimulator::Run(unsigned int nAddress)
+{
+    FILE *pFile;
+
+    m_nBoards++;
+    cout << GetPortName() << ": board " << m_nBoards << " started at address " << nAddress << endl;
+
+    if( !m_strDumpFile.empty() )
+    {
+        if( (pFile = fopen(m_strDumpFile.c_str(), "wb")) )
+        {
+            fwrite(m_rgFlash, 1, sizeof(m_rgFlash), pFile);
+            fclose(pFile);
+        }
+        else
+            cerr << ERRSTR << "unable to write " << m_strDumpFile << endl;
+    }
+
+    // the user code does not speak ISP, the next board begins with autobaud
+    string strOutput = m_strOutput;
+    Reset();
+    m_strOutput = strOutput;
+}
@@ -0,0 +1,251 @@
+/*!\file  CLPCSimulator.h  Pseudo terminal LPC2103 ISP simulator
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef CLPC_SIMULATOR_H
+#define CLPC_SIMULATOR_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+//! Size of the simulated flash.
+#define SIM_FLASH_SIZE		(32*1024)
+//! Size of one flash sector.
+#define SIM_SECTOR_SIZE		4096
+//! Number of flash sectors.
+#define SIM_SECTOR_COUNT	(SIM_FLASH_SIZE / SIM_SECTOR_SIZE)
+//! Start of the on-chip RAM.
+#define SIM_RAM_BASE		0x40000000
+//! Size of the on-chip RAM.
+#define SIM_RAM_SIZE		(8*1024)
+//! Number of UU lines after which the host sends a checksum.
+#define SIM_LINES_PER_BLOCK	20
+//! Part ID of the LPC2103 reported by "J".
+#define SIM_PART_ID		0x0004FF11
+//! Code which unlocks the flash commands.
+#define SIM_UNLOCK_CODE		23130
+//! Bytes at the start of the flash the boot block's vectors are mapped over in ISP mode.
+#define SIM_BOOT_REMAP_SIZE	0x40
+//! Longest command line accepted, longer lines are thrown away.
+#define SIM_MAX_LINE		128
+//! Above the clean baud rate (SetMaxBaud()) every this many-th command line is lost.
+#define SIM_LOSSY_EVERY		4
+
+/**
+* What the simulated boot loader expects to receive next.
+*/
+enum SimState {
+	SIM_STATE_AUTOBAUD,	//!< waiting for "?"
+	SIM_STATE_SYNC_ACK,	//!< waiting for "Synchronized"
+	SIM_STATE_CRYSTAL,	//!< waiting for the crystal frequency
+	SIM_STATE_COMMAND,	//!< waiting for a command
+	SIM_STATE_DATA,		//!< receiving UU lines of "W"
+	SIM_STATE_CHECKSUM,	//!< waiting for the checksum of a block
+	SIM_STATE_READ_ACK	//!< block of "R" sent, waiting for "OK" or "RESEND"
+};
+
+/**
+*\class CLPCSimulator
+*\brief Simulates the ISP boot loader of an LPC2103 behind a pseudo terminal.
+*
+* The simulator owns the master side of a pty pair, armflash opens the slave side
+* (or a symlink to it) exactly like a real /dev/ttyUSBx. It understands the part of
+* the ISP command set armflash uses: the synchronization, A (echo), B, J, U, P, E, I, M, W and R
+* with UU encoded data and block checksums, C and G, and keeps a model of the 32 KB flash and the RAM.
+* Like on the real chip "M" and "R" see the boot block's vectors in the first SIM_BOOT_REMAP_SIZE bytes
+* of the flash instead of the flash itself.
+* Erase and copy take the configured time, during which the boot loader is busy
+* and does not read any input, like the real chip.
+*
+* Closing the slave side is treated as a power cycle of the board, so every new
+* connection starts in the autobaud state.
+*/
+class CLPCSimulator
+{
+private:
+    int m_fdMaster;
+    string m_strSlaveName;
+    string m_strLinkName;
+    string m_strDumpFile;
+    bool m_bHungUp;
+
+    unsigned int m_nEraseMs;
+    unsigned int m_nCopyMs;
+    //! Every m_nFaultEvery-th UU block is damaged on the line, 0 for none.
+    unsigned int m_nFaultEvery;
+    unsigned int m_nBlocks;
+    //! Highest baud rate the line is clean at, 0 for any.
+    unsigned int m_nMaxBaud;
+    //! Baud rate set by "B", 0 for the one found by the autobaud.
+    unsigned int m_nBaud;
+    //! Command lines received above m_nMaxBaud.
+    unsigned int m_nLossyLines;
+    //! The board loses power after this many "C", 0 never.
+    unsigned int m_nCutAfter;
+    //! Successful "C" so far.
+    unsigned int m_nCopies;
+
+    SimState m_eState;
+    bool m_bEcho;
+    bool m_bUnlocked;
+    //! Sectors prepared for erase/copy, m_nPrepStart > m_nPrepEnd if none.
+    unsigned int m_nPrepStart;
+    unsigned int m_nPrepEnd;
+    unsigned int m_nBoards;
+
+    unsigned char m_rgFlash[SIM_FLASH_SIZE];
+    unsigned char m_rgRam[SIM_RAM_SIZE];
+
+    // state of the running "W" command
+    unsigned int m_nWriteOffset;
+    unsigned int m_nWriteLeft;
+    unsigned int m_nBlockOffset;
+    unsigned int m_nBlockLines;
+    unsigned int m_nBlockSum;
+
+    // state of the running "R" command
+    const unsigned char *m_pRead;
+    unsigned int m_nReadLeft;
+    unsigned int m_nReadBlock;
+
+    //! Reply held back until the busy time of erase/copy elapses.
+    string m_strPending;
+    uint64_t m_nBusyUntilMs;
+    bool m_bBusy;
+
+    string m_strInput;
+    string m_strOutput;
+    string m_strLine;
+
+    void Reset();
+    void Feed(unsigned char u8Byte);
+    void OnLine(const string & strLine);
+    void OnCommand(const string & strLine);
+    void OnDataLine(const string & strLine);
+    void OnChecksum(const string & strLine);
+    void Reply(int nCode);
+    void ReplyLater(int nCode, unsigned int nDelayMs);
+    void Run(unsigned int nAddress);
+
+    int DoEcho(const vector<string> & rgArgs);
+    int DoBaud(const vector<string> & rgArgs, unsigned int & nBaud);
+    int DoUnlock(const vector<string> & rgArgs);
+    int DoPrepare(const vector<string> & rgArgs);
+    int DoErase(const vector<string> & rgArgs, unsigned int & nDelayMs);
+    int DoBlankCheck(const vector<string> & rgArgs, string & strData);
+    int DoCompare(const vector<string> & rgArgs, string & strData);
+    const unsigned char * MapAddress(unsigned int nAddress, unsigned int nCount) const;
+    const unsigned char * MapBootVectors(const unsigned char *pByte) const;
+    int DoWrite(const vector<string> & rgArgs);
+    int DoRead(const vector<string> & rgArgs);
+    void SendReadBlock();
+    void OnReadAck(const string & strLine);
+    int DoCopy(const vector<string> & rgArgs, unsigned int & nDelayMs);
+    int DoGo(const vector<string> & rgArgs, unsigned int & nAddress);
+
+    bool IsPrepared(unsigned int nStart, unsigned int nEnd) const;
+    bool IsBlockDamaged();
+    bool IsLineLost();
+    bool ReadInput();
+    void WriteOutput();
+
+public:
+    /**
+    *\brief Constructor.
+    *@param nEraseMs Time the erase of one sector takes.
+    *@param nCopyMs Time the copy of 256 bytes from RAM to flash takes.
+    */
+    CLPCSimulator(unsigned int nEraseMs, unsigned int nCopyMs);
+    ~CLPCSimulator();
+
+    /**
+    *\brief Opens the pty pair.
+    *@param strLinkName If not empty, a symlink with this name is made to the slave.
+    *@return true on success.
+    */
+    bool Open(string strLinkName);
+
+    /**
+    *\brief Uses an already connected descriptor instead of a pty.
+    *
+    * The simulator takes the ownership of the descriptor. Once the other side closes
+    * it IsHungUp() stays true for good, nobody can connect again.
+    *
+    *@param fdPeer One end of a socket pair or pipe like connection.
+    *@param strName Name used in the messages.
+    */
+    void Attach(int fdPeer, string strName);
+
+    //! Closes the pty and removes the symlink.
+    void Close();
+
+    //! Returns true while nobody is connected to the simulator.
+    bool IsHungUp() const { return m_bHungUp; }
+
+    /**
+    *\brief Fills the flash with the contents of the file (ie. saved by SetDumpFile()).
+    *@return false if the file can't be read, the flash is left as it was then.
+    */
+    bool LoadFlash(const string & strFile);
+
+    //! Damages every nEvery-th UU block of "W" and "R" on the line (its checksum fails), 0 for none.
+    void SetFaultRate(unsigned int nEvery) { m_nFaultEvery = nEvery; }
+
+    /**
+    *\brief Cuts the power once, right after the nCopies-th "C" copied its data.
+    *
+    * The "C" is not answered and the board is back in the autobaud state, the flash keeps
+    * what was copied so far. The next session finds an interrupted flashing. 0 never cuts.
+    */
+    void SetPowerCut(unsigned int nCopies) { m_nCutAfter = nCopies; }
+
+    //! Loses every SIM_LOSSY_EVERY-th command line once "B" set a rate above nBaud, 0 keeps every rate clean.
+    void SetMaxBaud(unsigned int nBaud) { m_nMaxBaud = nBaud; }
+
+    //! If set, the flash is written to this file every time the board is started with "G".
+    void SetDumpFile(string strDumpFile) { m_strDumpFile = strDumpFile; }
+
+    //! Returns the name of the slave side, the port armflash should open.
+    string GetSlaveName() const { return m_strSlaveName; }
+
+    //! Returns the symlink if one was made, the slave name otherwise.
+    string GetPortName() const { return m_strLinkName.empty() ? m_strSlaveName : m_strLinkName; }
+
+    //! Returns the number of boards started with "G" so far.
+    unsigned int GetBoardCount() const { return m_nBoards; }
+
+    /**
+    *\brief Returns the descriptor to poll.
+    *
+    * While nobody has the slave open the master reports a hangup all the time, so
+    * FAILURE is returned then and the caller should call Process() again
+    * after a short while to find out about a new connection.
+    */
+    int GetPollFd() const;
+
+    //! Returns the poll events the simulator is interested in.
+    short GetPollEvents() const;
+
+    //! Returns the milliseconds until the busy time ends, -1 if not busy.
+    int GetTimeout() const;
+
+    /**
+    *\brief Does all the work which is possible without blocking.
+    *@param nRevents The events poll returned for the descriptor, 0 on a timeout.
+    */
+    void Process(short nRevents);
+};
+
+#endif
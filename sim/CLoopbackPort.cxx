@@ -0,0 +1,105 @@
+/*!\file  CLoopbackPort.cxx  Connection to a simulated board inside armflash
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <sim/CLoopbackPort.h>
+#include <iostream>
+#include <cstdlib>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Runs the simulated board until the host closes its end
+static void *LoopbackThread(void *pData)
+{
+    CLPCSimulator *pclSim = (CLPCSimulator *)pData;
+    struct pollfd stPollFd;
+
+    while( !pclSim->IsHungUp() )
+    {
+        stPollFd.fd      = pclSim->GetPollFd();
+        stPollFd.events  = pclSim->GetPollEvents();
+        stPollFd.revents = 0;
+
+        if( poll(&stPollFd, 1, pclSim->GetTimeout()) < 0 && errno != EINTR )
+            break;
+
+        pclSim->Process(stPollFd.revents);
+    }
+
+    return NULL;
+}
+
+CLoopbackPort::CLoopbackPort(const string & strTimings)
+{
+    const char *pszTimings = strTimings.c_str();
+    char *pszEnd;
+
+    m_fdHost   = BAD_DEVICE;
+    m_pclSim   = NULL;
+    m_nEraseMs = (unsigned int)strtoul(pszTimings, &pszEnd, 10);
+    m_nCopyMs  = *pszEnd == ':' ? (unsigned int)strtoul(pszEnd + 1, NULL, 10) : 0;
+}
+
+CLoopbackPort::~CLoopbackPort()
+{
+    Close();
+}
+
+int
+CLoopbackPort::Open(void)
+{
+    int rgfdPair[2];
+
+    if( socketpair(AF_UNIX, SOCK_STREAM, 0, rgfdPair) != SUCCESS )
+    {
+        cout << ERRSTR << "Can't create the loopback connection" << endl;
+        return FAILURE;
+    }
+
+    m_fdHost = rgfdPair[0];
+    fcntl(m_fdHost, F_SETFL, fcntl(m_fdHost, F_GETFL) | O_NONBLOCK);
+
+    m_pclSim = new CLPCSimulator(m_nEraseMs, m_nCopyMs);
+    m_pclSim->Attach(rgfdPair[1], "loopback");
+
+    if( pthread_create(&m_stThread, NULL, &LoopbackThread, m_pclSim) != SUCCESS )
+    {
+        cout << ERRSTR << "Can't start the simulated board" << endl;
+        delete m_pclSim;
+        m_pclSim = NULL;
+        close(m_fdHost);
+        m_fdHost = BAD_DEVICE;
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+void
+CLoopbackPort::Close(void)
+{
+    if( m_fdHost > BAD_DEVICE )
+        close(m_fdHost);
+    m_fdHost = BAD_DEVICE;
+
+    // closing our end is what makes the board thread finish
+    if( m_pclSim )
+    {
+        pthread_join(m_stThread, NULL);
+        delete m_pclSim;
+        m_pclSim = NULL;
+    }
+}
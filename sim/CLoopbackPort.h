@@ -0,0 +1,73 @@
+/*!\file  CLoopbackPort.h  Connection to a simulated board inside armflash
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef CLOOPBACK_PORT_H
+#define CLOOPBACK_PORT_H
+
+#include <core/transport.h>
+#include <sim/CLPCSimulator.h>
+#include <pthread.h>
+#include <string>
+
+using namespace std;
+
+/**
+*\class CLoopbackPort
+*\brief Talks to a CLPCSimulator running in a thread of armflash itself.
+*
+* The two ends of a local socket pair replace the UART, so there is no line speed
+* and no driver latency, only the cost of the ISP protocol and of armflash itself.
+* Every Open() connects to a fresh blank board.
+*/
+class CLoopbackPort : public CTransport
+{
+private:
+    int m_fdHost;
+    unsigned int m_nEraseMs;
+    unsigned int m_nCopyMs;
+    CLPCSimulator *m_pclSim;
+    pthread_t m_stThread;
+
+public:
+    /**
+    *\brief Constructor.
+    *@param strTimings "erase_ms[:copy_ms]" of the simulated board, empty for no delays.
+    */
+    CLoopbackPort(const string & strTimings);
+
+    //! Closes the connection and stops the board.
+    ~CLoopbackPort();
+
+    /**
+    *\brief Starts the simulated board and connects to it.
+    *@return FAILURE on error SUCCESS if everything goes ok.
+    */
+    int Open(void);
+
+    //! Nothing to set up.
+    int Init(void) { return SUCCESS; }
+
+    //! Disconnects and waits for the board thread to finish.
+    void Close(void);
+
+    //! Returns the host end of the socket pair.
+    int GetFd(void) const { return m_fdHost; }
+
+    //! Returns DEVICE_CONN_TYPE_LOOPBACK.
+    DeviceConnectionType GetType(void) const { return DEVICE_CONN_TYPE_LOOPBACK; }
+
+    //! Nothing to switch on a socket pair, accepted so the ISP side can still negotiate it.
+    int SetBaudRate(unsigned int nBaudRate) { return SUCCESS; }
+};
+
+#endif
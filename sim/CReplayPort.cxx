@@ -0,0 +1,299 @@
+/*!\file  CReplayPort.cxx  Board side of a captured session played back
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <sim/CReplayPort.h>
+#include <core/timer.h>
+#include <iostream>
+#include <cstdlib>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+//! Only this many divergences are printed, the rest is just counted.
+#define REPLAY_MAX_REPORTS	10
+
+CReplayPort::CReplayPort(const string & strSpec)
+{
+    string::size_type nComma = strSpec.find(',');
+
+    m_strFile = strSpec.substr(0, nComma);
+    m_nPort   = 0;
+    m_dScale  = 1.0;
+
+    if( nComma != string::npos )
+    {
+        const char *pszRest = strSpec.c_str() + nComma + 1;
+        char *pszEnd;
+
+        m_nPort = (unsigned int)strtoul(pszRest, &pszEnd, 10);
+        if( *pszEnd == ',' )
+            m_dScale = strtod(pszEnd + 1, NULL);
+    }
+
+    if( m_dScale < 0 )
+        m_dScale = 0;
+
+    m_fdHost  = BAD_DEVICE;
+    m_fdPeer  = BAD_DEVICE;
+    m_bThread = false;
+    m_nPlayed = 0;
+    m_nDivergences = 0;
+}
+
+CReplayPort::~CReplayPort()
+{
+    Close();
+}
+
+// Loads the TX and RX records of our port, they are in time order in the file
+bool
+CReplayPort::LoadRecords()
+{
+    CCaptureReader clReader;
+    SCaptureRecord stHeader;
+    SReplayRecord stRecord;
+
+    if( clReader.Open(m_strFile) != SUCCESS )
+        return false;
+
+    m_clRecords.clear();
+
+    while( clReader.Next(stHeader, stRecord.strData) )
+    {
+        if( stHeader.nPort != m_nPort || stHeader.nType == CAPTURE_REC_PORT )
+            continue;
+
+        stRecord.nTimeNs = stHeader.nTimeNs;
+        stRecord.bTx     = stHeader.nType == CAPTURE_REC_TX;
+        m_clRecords.push_back(stRecord);
+    }
+
+    if( m_clRecords.empty() )
+    {
+        cout << ERRSTR << m_strFile << " has no traffic of port " << m_nPort << endl;
+        return false;
+    }
+
+    return true;
+}
+
+int
+CReplayPort::SetBaudRate(unsigned int nBaudRate)
+{
+    string strTx;
+
+    if( m_clRecords.empty() && !LoadRecords() )
+        return FAILURE;
+
+    for(unsigned int i=0; i<m_clRecords.size(); i++)
+        if( m_clRecords[i].bTx )
+            strTx += m_clRecords[i].strData;
+
+    return strTx.compare(0, 2, "B ") == 0 || strTx.find("\nB ") != string::npos ? SUCCESS : FAILURE;
+}
+
+int
+CReplayPort::Open(void)
+{
+    int rgfdPair[2];
+
+    if( m_clRecords.empty() && !LoadRecords() )
+        return FAILURE;
+
+    if( socketpair(AF_UNIX, SOCK_STREAM, 0, rgfdPair) != SUCCESS )
+    {
+        cout << ERRSTR << "Can't create the replay connection" << endl;
+        return FAILURE;
+    }
+
+    m_fdHost = rgfdPair[0];
+    m_fdPeer = rgfdPair[1];
+    fcntl(m_fdHost, F_SETFL, fcntl(m_fdHost, F_GETFL) | O_NONBLOCK);
+
+    m_nPlayed = 0;
+    m_nDivergences = 0;
+
+    if( pthread_create(&m_stThread, NULL, &PlayThread, this) != SUCCESS )
+    {
+        cout << ERRSTR << "Can't start the replay" << endl;
+        Close();
+        return FAILURE;
+    }
+
+    m_bThread = true;
+    return SUCCESS;
+}
+
+void
+CReplayPort::Close(void)
+{
+    if( m_fdHost > BAD_DEVICE )
+        close(m_fdHost);
+    m_fdHost = BAD_DEVICE;
+
+    // the player notices the closed socket and finishes
+    if( m_bThread )
+    {
+        pthread_join(m_stThread, NULL);
+        m_bThread = false;
+
+        cout << "replay " << m_strFile << ": played " << m_nPlayed << " of " << m_clRecords.size()
+             << " records, " << m_nDivergences << " divergence(s)." << endl;
+    }
+
+    if( m_fdPeer > BAD_DEVICE )
+        close(m_fdPeer);
+    m_fdPeer = BAD_DEVICE;
+}
+
+void *
+CReplayPort::PlayThread(void *pData)
+{
+    reinterpret_cast<CReplayPort *>(pData)->Play();
+    return NULL;
+}
+
+/*
+* Appends what the host sent to strHost, waits up to nTimeoutMs for it.
+* Returns false once the host closed the connection.
+*/
+bool
+CReplayPort::ReceiveHost(string & strHost, int nTimeoutMs)
+{
+    struct pollfd stPollFd;
+    char rgBuffer[1024];
+    ssize_t nRead;
+
+    stPollFd.fd      = m_fdPeer;
+    stPollFd.events  = POLLIN;
+    stPollFd.revents = 0;
+
+    if( poll(&stPollFd, 1, nTimeoutMs) <= 0 )
+        return true;	// timeout or a signal, still open
+
+    if( (nRead = read(m_fdPeer, rgBuffer, sizeof(rgBuffer))) > 0 )
+        strHost.append(rgBuffer, nRead);
+
+    return nRead != 0;
+}
+
+bool
+CReplayPort::SendHost(const string & strData)
+{
+    string::size_type nWritten = 0;
+    ssize_t nRet;
+
+    while( nWritten < strData.length() )
+    {
+        nRet = write(m_fdPeer, strData.data() + nWritten, strData.length() - nWritten);
+
+        if( nRet < 0 && errno == EINTR )
+            continue;
+
+        if( nRet <= 0 )
+            return false;
+
+        nWritten += nRet;
+    }
+
+    return true;
+}
+
+void
+CReplayPort::Diverge(unsigned int nRecord, const string & strExpected, const string & strGot)
+{
+    if( ++m_nDivergences > REPLAY_MAX_REPORTS )
+        return;
+
+    cout << "replay " << m_strFile << ": record " << nRecord << " diverges, expected \""
+         << PrintableCaptureData(strExpected) << "\", host sent \"" << PrintableCaptureData(strGot) << "\"" << endl;
+}
+
+void
+CReplayPort::Play()
+{
+    string strHost;
+    uint64_t nPrevReplayNs = GetMonotonicNs();
+    uint64_t nPrevCaptureNs = m_clRecords[0].nTimeNs;
+    bool bOpen = true, bShort = false;
+
+    for(unsigned int i=0; i<m_clRecords.size() && bOpen; i++)
+    {
+        const SReplayRecord & stRecord = m_clRecords[i];
+
+        if( stRecord.bTx )
+        {
+            string::size_type nLength = stRecord.strData.length();
+            string::size_type nHostLength;
+
+            // wait for as many bytes as the host sent in the capture
+            while( bOpen && strHost.length() < nLength )
+            {
+                string::size_type nBefore = strHost.length();
+
+                bOpen = ReceiveHost(strHost, REPLAY_STALL_MS);
+                if( strHost.length() == nBefore )
+                    break;	// stalled, the host waits for something else
+            }
+
+            nHostLength = min(nLength, strHost.length());
+
+            if( nHostLength < nLength || strHost.compare(0, nLength, stRecord.strData) != 0 )
+                Diverge(i, stRecord.strData, strHost.substr(0, nHostLength));
+
+            strHost.erase(0, nHostLength);
+            nPrevReplayNs  = GetMonotonicNs();
+            nPrevCaptureNs = stRecord.nTimeNs;
+
+            if( (bShort = nHostLength < nLength) )
+                break;
+        }
+        else
+        {
+            uint64_t nTargetNs = nPrevReplayNs + (uint64_t)((stRecord.nTimeNs - nPrevCaptureNs) * m_dScale);
+            uint64_t nNowNs;
+
+            // keep listening while waiting, so a closed port is noticed
+            while( bOpen && (nNowNs = GetMonotonicNs()) < nTargetNs )
+                bOpen = ReceiveHost(strHost, (int)((nTargetNs - nNowNs + 999999) / 1000000));
+
+            if( !bOpen || !SendHost(stRecord.strData) )
+                break;
+
+            nPrevReplayNs  = nTargetNs;
+            nPrevCaptureNs = stRecord.nTimeNs;
+        }
+
+        m_nPlayed++;
+    }
+
+    // the host gave up early, anything it still had to send is missing
+    for(unsigned int j=m_nPlayed; j<m_clRecords.size() && !bShort; j++)
+    {
+        if( m_clRecords[j].bTx )
+        {
+            Diverge(j, m_clRecords[j].strData, "");
+            break;
+        }
+    }
+
+    // whatever comes after the end of the capture is a divergence too
+    while( bOpen )
+        bOpen = ReceiveHost(strHost, -1);
+
+    if( !strHost.empty() && m_nPlayed == m_clRecords.size() )
+        Diverge(m_clRecords.size(), "", strHost);
+}
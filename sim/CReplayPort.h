@@ -0,0 +1,109 @@
+/*!\file  CReplayPort.h  Board side of a captured session played back
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef CREPLAY_PORT_H
+#define CREPLAY_PORT_H
+
+#include <core/transport.h>
+#include <core/capture.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//! How long the host may keep quiet while the capture expects it to send something.
+#define REPLAY_STALL_MS		2000
+
+/**
+*\class CReplayPort
+*\brief Plays the board side of a capture file (see CCaptureLog) back to the host.
+*
+* The records of one port are played in order from a thread behind a socket pair:
+* the RX records are sent to the host after the same delay (optionally scaled) they
+* had after the previous record in the capture, the TX records are compared with
+* what the host really sends. Every difference is reported as a divergence, so a
+* captured production session becomes a repeatable benchmark and regression test
+* of the host side.
+*
+* The port name is "file[,port[,scale]]": the port number as printed by -D
+* (0 by default) and the factor applied to the delays (1 by default, 0 plays
+* the replies as fast as possible).
+*/
+class CReplayPort : public CTransport
+{
+private:
+    //! One TX or RX record of the replayed port.
+    typedef struct SReplayRecord_
+    {
+        uint64_t nTimeNs;
+        bool bTx;
+        string strData;
+    } SReplayRecord;
+
+    string m_strFile;
+    unsigned int m_nPort;
+    double m_dScale;
+
+    int m_fdHost;
+    int m_fdPeer;
+    bool m_bThread;
+    pthread_t m_stThread;
+
+    vector<SReplayRecord> m_clRecords;
+    unsigned int m_nPlayed;
+    unsigned int m_nDivergences;
+
+    static void *PlayThread(void *pData);
+    void Play();
+    bool ReceiveHost(string & strHost, int nTimeoutMs);
+    bool SendHost(const string & strData);
+    void Diverge(unsigned int nRecord, const string & strExpected, const string & strGot);
+    bool LoadRecords();
+
+public:
+    //! Takes the part of the port name after "replay:".
+    CReplayPort(const string & strSpec);
+
+    //! Closes the connection.
+    ~CReplayPort();
+
+    /**
+    *\brief Loads the records of the port and starts playing them.
+    *@return FAILURE on error SUCCESS if everything goes ok.
+    */
+    int Open(void);
+
+    //! Nothing to set up.
+    int Init(void) { return SUCCESS; }
+
+    //! Stops the playback and prints how it went.
+    void Close(void);
+
+    //! Returns the host end of the socket pair.
+    int GetFd(void) const { return m_fdHost; }
+
+    //! Returns DEVICE_CONN_TYPE_REPLAY.
+    DeviceConnectionType GetType(void) const { return DEVICE_CONN_TYPE_REPLAY; }
+
+    /**
+    *\brief Nothing to switch, the host negotiates the rate only if the capture did.
+    *@return SUCCESS if the host sent "B" in the capture, FAILURE otherwise.
+    */
+    int SetBaudRate(unsigned int nBaudRate);
+
+    //! Returns the number of divergences found so far (valid after Close()).
+    unsigned int GetDivergenceCount(void) const { return m_nDivergences; }
+};
+
+#endif
@@ -0,0 +1,174 @@
+/*!\file  lpcsim.cxx  The LPC2103 ISP simulator
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <sim/CLPCSimulator.h>
+#include <core/defs.h>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <cstdlib>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+using namespace std;
+
+//! Default time of one sector erase (the LPC2103 needs about 100 ms).
+#define DEFAULT_ERASE_MS	100
+//! Default time of programming 256 bytes (the LPC2103 needs about 1 ms).
+#define DEFAULT_COPY_MS		1
+//! How often the simulators without a connected host look for one.
+#define HANGUP_POLL_MS		50
+
+static volatile sig_atomic_t g_bQuit = 0;
+
+static void OnSignal(int nSignal)
+{
+    g_bQuit = 1;
+}
+
+static void PrintHelp(const char *pszPrgName)
+{
+    cout << "Usage: " << pszPrgName << " [-n COUNT] [-l LINK] [-e ERASE_MS] [-c COPY_MS] [-i FILE] [-o FILE] [-f N] [-b BAUD] [-x N]" << endl << endl;
+    cout << "Simulates LPC2103 boards in ISP mode behind pseudo terminals." << endl << endl;
+    cout << "\t-n COUNT    number of simulated boards (default 1)" << endl;
+    cout << "\t-l LINK     symlink to the port, with more boards the index is appended" << endl;
+    cout << "\t-e ERASE_MS time of one sector erase (default " << DEFAULT_ERASE_MS << ")" << endl;
+    cout << "\t-c COPY_MS  time of copying 256 bytes to the flash (default " << DEFAULT_COPY_MS << ")" << endl;
+    cout << "\t-i FILE     start with the flash loaded from FILE (ie. saved by -o), blank otherwise" << endl;
+    cout << "\t-o FILE     save the flash after every \"G\", with more boards the index is appended" << endl;
+    cout << "\t-f N        damage every Nth UU block of \"W\" and \"R\" on the line (default 0, none)" << endl;
+    cout << "\t-b BAUD     every " << SIM_LOSSY_EVERY << "th command is lost once \"B\" set a rate above BAUD (default 0, none)" << endl;
+    cout << "\t-x N        cut the power once after the Nth \"C\", the flashing is left interrupted (default 0, never)" << endl;
+    cout << "\t-h          this help" << endl;
+}
+
+// Parses a non negative number option, exits on garbage
+static unsigned int OptNumber(const char *pszArg, char cOpt)
+{
+    char *pszEnd;
+    long lValue = strtol(pszArg, &pszEnd, 10);
+
+    if( *pszArg == '\0' || *pszEnd != '\0' || lValue < 0 )
+    {
+        cerr << ERRSTR << "invalid value of -" << cOpt << ": " << pszArg << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return (unsigned int)lValue;
+}
+
+// Appends the board index to the name if there is more than one board
+static string IndexedName(const string & strName, unsigned int nIndex, unsigned int nCount)
+{
+    ostringstream stream;
+
+    if( strName.empty() || nCount == 1 )
+        return strName;
+
+    stream << strName << nIndex;
+    return stream.str();
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int nCount = 1, nEraseMs = DEFAULT_ERASE_MS, nCopyMs = DEFAULT_COPY_MS, nFaultEvery = 0, nMaxBaud = 0, nCutAfter = 0;
+    string strLink, strDump, strInitial;
+    int nOpt;
+
+    while( (nOpt = getopt(argc, argv, "hn:l:e:c:i:o:f:b:x:")) != -1 )
+    {
+        switch( nOpt )
+        {
+            case 'n': nCount   = OptNumber(optarg, 'n'); break;
+            case 'l': strLink  = optarg; break;
+            case 'e': nEraseMs = OptNumber(optarg, 'e'); break;
+            case 'c': nCopyMs  = OptNumber(optarg, 'c'); break;
+            case 'i': strInitial = optarg; break;
+            case 'o': strDump  = optarg; break;
+            case 'f': nFaultEvery = OptNumber(optarg, 'f'); break;
+            case 'b': nMaxBaud = OptNumber(optarg, 'b'); break;
+            case 'x': nCutAfter = OptNumber(optarg, 'x'); break;
+            case 'h': PrintHelp(argv[0]); return EXIT_SUCCESS;
+            default:  PrintHelp(argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    if( nCount == 0 )
+    {
+        cerr << ERRSTR << "at least one board has to be simulated" << endl;
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    vector<CLPCSimulator*> clSims;
+    vector<struct pollfd> rgstPollFds(nCount);
+    bool bOk = true;
+
+    for(unsigned int i=0; i<nCount && bOk; i++)
+    {
+        CLPCSimulator *pclSim = new CLPCSimulator(nEraseMs, nCopyMs);
+        clSims.push_back(pclSim);
+
+        if( !strInitial.empty() && !(bOk = pclSim->LoadFlash(strInitial)) )
+            break;
+
+        if( (bOk = pclSim->Open(IndexedName(strLink, i, nCount))) )
+        {
+            pclSim->SetDumpFile(IndexedName(strDump, i, nCount));
+            pclSim->SetFaultRate(nFaultEvery);
+            pclSim->SetMaxBaud(nMaxBaud);
+            pclSim->SetPowerCut(nCutAfter);
+            cout << pclSim->GetPortName() << " -> " << pclSim->GetSlaveName() << endl;
+        }
+    }
+
+    while( bOk && !g_bQuit )
+    {
+        int nTimeout = -1, nSimTimeout;
+
+        for(unsigned int i=0; i<nCount; i++)
+        {
+            rgstPollFds[i].fd      = clSims[i]->GetPollFd();
+            rgstPollFds[i].events  = clSims[i]->GetPollEvents();
+            rgstPollFds[i].revents = 0;
+
+            nSimTimeout = rgstPollFds[i].fd < 0 ? HANGUP_POLL_MS : clSims[i]->GetTimeout();
+            if( nSimTimeout >= 0 && (nTimeout < 0 || nSimTimeout < nTimeout) )
+                nTimeout = nSimTimeout;
+        }
+
+        if( poll(&rgstPollFds[0], nCount, nTimeout) < 0 && errno != EINTR )
+        {
+            cerr << ERRSTR << "poll failed" << endl;
+            break;
+        }
+
+        for(unsigned int i=0; i<nCount; i++)
+            clSims[i]->Process(rgstPollFds[i].revents);
+    }
+
+    unsigned int nBoards = 0;
+    for(unsigned int i=0; i<clSims.size(); i++)
+    {
+        nBoards += clSims[i]->GetBoardCount();
+        delete clSims[i];
+    }
+
+    cout << nBoards << " board(s) started." << endl;
+    return bOk ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -15,6 +15,7 @@
 
 #include <iostream>
 #include <sstream>
+#include <core/defs.h>
 
 CFlashData::CFlashData(int argc, char ** argv)
 {
@@ -34,19 +35,20 @@ CFlashData::CFlashData(int argc, char ** argv)
         new_data.strCrystalSpeed = argv[i+3];
         new_data.strDevice = argv[i+4];
 
-        string strBaudRate = argv[i+2];
-        new_data.stBaudRate = B9600;
-
         stringstream ss;
 
         ss << new_data.strCrystalSpeed;
         ss >> new_data.nCrystalSpeed;
 
-        if( strBaudRate == "9600" )
-            new_data.stBaudRate = B9600;
-        else if( strBaudRate == "38400" )
-            new_data.stBaudRate = B38400;
+        // any integer baud rate is fine, CSerial decides how to set it
+        stringstream ssBaud(new_data.strBaudRate);
+        char chRest;
 
+        if( !(ssBaud >> new_data.nBaudRate) || (ssBaud >> chRest) || new_data.nBaudRate == 0 )
+        {
+            cerr << ERRSTR << new_data.strPortName << ": invalid baud rate " << new_data.strBaudRate << endl;
+            continue;
+        }
 
         clDataSet.push_back( new_data );
 
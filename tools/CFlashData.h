@@ -24,7 +24,7 @@ typedef struct SFlashData_
 {
     string strPortName;
     string strFirmwarePath;
-    speed_t stBaudRate;
+    unsigned int nBaudRate;
     string strBaudRate;
     string strDevice;
     string strCrystalSpeed;
@@ -35,7 +35,7 @@ typedef struct SFlashData_
         return ( 
             (x.strPortName == y.strPortName) && 
             (x.strFirmwarePath == y.strFirmwarePath) && 
-            (x.stBaudRate == y.stBaudRate) && 
+            (x.nBaudRate == y.nBaudRate) && 
             (x.strDevice == y.strDevice) &&
             (x.strCrystalSpeed == y.strCrystalSpeed)
         );
@@ -0,0 +1,196 @@
+/*!\file  CFlashEngine.cxx  Single threaded flashing of many devices
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <tools/CFlashEngine.h>
+#include <core/defs.h>
+#include <iostream>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+CFlashEngine::CFlashEngine()
+{
+    m_nSucceeded = 0;
+    m_nFailed    = 0;
+    m_fdEpoll    = BAD_DEVICE;
+
+#ifdef __linux__
+    m_fdEpoll = epoll_create(ENGINE_MAX_EVENTS);
+
+    if( m_fdEpoll < 0 )
+        cerr << ERRSTR << "epoll_create failed, falling back to poll()" << endl;
+#endif
+}
+
+CFlashEngine::~CFlashEngine()
+{
+    if( m_fdEpoll > BAD_DEVICE )
+        close(m_fdEpoll);
+}
+
+bool
+CFlashEngine::AddDevice(CDeviceBase *pclDevice, string strFirmwarePath)
+{
+    if( !pclDevice->StartSession(strFirmwarePath) || !Watch(pclDevice) )
+    {
+        m_nFailed++;
+        return false;
+    }
+
+    m_clActive.push_back(pclDevice);
+    return true;
+}
+
+// Registers the session descriptor in the epoll set
+bool
+CFlashEngine::Watch(CDeviceBase *pclDevice)
+{
+#ifdef __linux__
+    if( m_fdEpoll > BAD_DEVICE )
+    {
+        struct epoll_event stEvent;
+
+        stEvent.events   = EPOLLIN;
+        stEvent.data.ptr = pclDevice;
+
+        if( epoll_ctl(m_fdEpoll, EPOLL_CTL_ADD, pclDevice->GetSessionFd(), &stEvent) != SUCCESS )
+        {
+            cerr << ERRSTR << "Couldn't add the device to the epoll set!" << endl;
+            return false;
+        }
+    }
+#endif
+
+    return true;
+}
+
+// Waits until some session descriptor is readable or nTimeoutMs expires
+void
+CFlashEngine::WaitEvents(int nTimeoutMs, vector<CDeviceBase *> & clReady)
+{
+#ifdef __linux__
+    if( m_fdEpoll > BAD_DEVICE )
+    {
+        struct epoll_event rgstEvents[ENGINE_MAX_EVENTS];
+
+        int nEvents = epoll_wait(m_fdEpoll, rgstEvents, ENGINE_MAX_EVENTS, nTimeoutMs);
+
+        for( int i=0; i<nEvents; i++ )
+        {
+            CDeviceBase *pclDevice = (CDeviceBase *)rgstEvents[i].data.ptr;
+
+            // level-triggered, a hung up port would wake every round and starve the others
+            if( rgstEvents[i].events & (EPOLLHUP | EPOLLERR) )
+                FailHungUp(pclDevice);
+            else
+                clReady.push_back(pclDevice);
+        }
+
+        return;
+    }
+#endif
+
+    vector<struct pollfd> clPollFds( m_clActive.size() );
+
+    for( unsigned int i=0; i<m_clActive.size(); i++ )
+    {
+        clPollFds[i].fd      = m_clActive[i]->GetSessionFd();
+        clPollFds[i].events  = POLLIN;
+        clPollFds[i].revents = 0;
+    }
+
+    if( poll(&clPollFds[0], clPollFds.size(), nTimeoutMs) <= 0 )
+        return;
+
+    for( unsigned int i=0; i<m_clActive.size(); i++ )
+    {
+        if( clPollFds[i].revents & (POLLHUP | POLLERR | POLLNVAL) )
+            FailHungUp( m_clActive[i] );
+        else if( clPollFds[i].revents )
+            clReady.push_back( m_clActive[i] );
+    }
+}
+
+// Fails the session whose port hung up, closing the port takes it out of the epoll set
+void
+CFlashEngine::FailHungUp(CDeviceBase *pclDevice)
+{
+    if( !pclDevice->IsSessionDone() )
+        pclDevice->AbortSession("Port lost: hung up or failed.");
+}
+
+// Removes the finished sessions, their ports are closed which also removes them from epoll
+void
+CFlashEngine::Reap()
+{
+    vector<CDeviceBase *>::iterator it = m_clActive.begin();
+
+    while( it != m_clActive.end() )
+    {
+        if( !(*it)->IsSessionDone() )
+        {
+            ++it;
+            continue;
+        }
+
+        if( (*it)->IsSessionOk() )
+            m_nSucceeded++;
+        else
+            m_nFailed++;
+
+        it = m_clActive.erase(it);
+    }
+}
+
+unsigned int
+CFlashEngine::Run()
+{
+    vector<CDeviceBase *> clReady;
+
+    Reap();
+
+    while( !m_clActive.empty() )
+    {
+        // sleep until the nearest deadline of all the sessions
+        int nTimeoutMs = -1;
+
+        for( unsigned int i=0; i<m_clActive.size(); i++ )
+        {
+            int nSessionTimeout = m_clActive[i]->GetSessionTimeout();
+
+            if( nSessionTimeout >= 0 && (nTimeoutMs < 0 || nSessionTimeout < nTimeoutMs) )
+                nTimeoutMs = nSessionTimeout;
+        }
+
+        clReady.clear();
+        WaitEvents(nTimeoutMs, clReady);
+
+        for( unsigned int i=0; i<clReady.size(); i++ )
+            clReady[i]->ProcessSession();
+
+        // handle the expired deadlines
+        for( unsigned int i=0; i<m_clActive.size(); i++ )
+        {
+            if( m_clActive[i]->GetSessionTimeout() == 0 )
+                m_clActive[i]->ProcessSession();
+        }
+
+        Reap();
+    }
+
+    return m_nSucceeded;
+}
@@ -0,0 +1,75 @@
+/*!\file  CFlashEngine.h  Single threaded flashing of many devices
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef CFLASH_ENGINE_H
+#define CFLASH_ENGINE_H
+
+#include <vector>
+#include <string>
+#include <device/CDeviceBase.h>
+
+using namespace std;
+
+//! Maximal number of events handled in one epoll_wait() round.
+#define ENGINE_MAX_EVENTS 64
+
+/**
+*\class CFlashEngine
+*\brief Drives the flashing sessions of many devices from one thread.
+*
+* Every added device runs its resumable session (see CDeviceBase::StartSession()).
+* The engine waits on all the session descriptors at once with epoll (poll on
+* systems without epoll) and calls CDeviceBase::ProcessSession() for the devices
+* which got some data or whose deadline expired. The devices are not owned by
+* the engine.
+*/
+class CFlashEngine
+{
+private:
+    //! Devices whose session is still running.
+    vector<CDeviceBase *> m_clActive;
+    //! Number of sessions which finished successfully.
+    unsigned int m_nSucceeded;
+    //! Number of sessions which failed.
+    unsigned int m_nFailed;
+    //! The epoll instance, BAD_DEVICE where epoll is not available.
+    int m_fdEpoll;
+
+    bool Watch(CDeviceBase *pclDevice);
+    void WaitEvents(int nTimeoutMs, vector<CDeviceBase *> & clReady);
+    void FailHungUp(CDeviceBase *pclDevice);
+    void Reap();
+
+public:
+    CFlashEngine();
+    ~CFlashEngine();
+
+    /**
+    *\brief Starts the session of the device and adds it to the engine.
+    *@param pclDevice The device to flash.
+    *@param strFirmwarePath The path to the firmware file.
+    *@return false if the session couldn't be started.
+    */
+    bool AddDevice(CDeviceBase *pclDevice, string strFirmwarePath);
+
+    /**
+    *\brief Runs until all the added sessions are finished.
+    *@return The number of successfully flashed devices.
+    */
+    unsigned int Run();
+
+    //! Returns the number of sessions which failed (including those which couldn't start).
+    unsigned int GetFailedCount() const { return m_nFailed; }
+};
+
+#endif
@@ -0,0 +1,212 @@
+/*!\file  CPortWatcher.cxx  Watching for ports being plugged in and out
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <tools/CPortWatcher.h>
+#include <core/defs.h>
+#include <core/transport.h>
+#include <iostream>
+#include <errno.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+//! Without inotify the patterns are globbed again this often (ms).
+#define WATCHER_RESCAN_MS 500
+
+CPortWatcher::CPortWatcher()
+{
+    m_fdNotify = BAD_DEVICE;
+}
+
+CPortWatcher::~CPortWatcher()
+{
+    if( m_fdNotify > BAD_DEVICE )
+        close(m_fdNotify);
+}
+
+int
+CPortWatcher::Open()
+{
+#ifdef __linux__
+    m_fdNotify = inotify_init();
+
+    if( m_fdNotify < 0 )
+    {
+        cerr << ERRSTR << "can't watch for new ports, inotify failed" << endl;
+        return FAILURE;
+    }
+#endif
+
+    return SUCCESS;
+}
+
+unsigned int
+CPortWatcher::AddPattern(const string & strPattern)
+{
+    string::size_type nSlash = strPattern.rfind('/');
+
+    m_clPatterns.push_back(strPattern);
+    m_setDirs.insert(nSlash == 0 || nSlash == string::npos ? "/" : strPattern.substr(0, nSlash));
+    WatchDirs();
+
+    return m_clPatterns.size() - 1;
+}
+
+// Watches the directories of the patterns, the nearest existing parent for those not created yet
+void
+CPortWatcher::WatchDirs()
+{
+#ifdef __linux__
+    const uint32_t nMask = IN_CREATE | IN_ATTRIB | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM;
+
+    for(set<string>::iterator it = m_setDirs.begin(); it != m_setDirs.end(); ++it)
+    {
+        string strDir = *it;
+        int nWatch;
+
+        while( (nWatch = inotify_add_watch(m_fdNotify, strDir.c_str(), nMask)) < 0 && strDir != "/" )
+        {
+            string::size_type nSlash = strDir.rfind('/');
+            strDir = nSlash == 0 ? "/" : strDir.substr(0, nSlash);
+        }
+
+        if( nWatch >= 0 )
+            m_mapWatches[nWatch] = strDir;
+    }
+#endif
+}
+
+int
+CPortWatcher::Match(const string & strPort) const
+{
+    for(unsigned int i=0; i<m_clPatterns.size(); i++)
+        if( fnmatch(m_clPatterns[i].c_str(), strPort.c_str(), FNM_PATHNAME) == 0 )
+            return i;
+
+    return FAILURE;
+}
+
+// Reports the port if it became usable or went away
+void
+CPortWatcher::Check(const string & strPort, vector<SPortEvent> & clEvents)
+{
+    int nPattern = Match(strPort);
+    bool bUsable = access(strPort.c_str(), R_OK | W_OK) == SUCCESS;
+    bool bPresent = m_setPresent.count(strPort) != 0;
+    SPortEvent stEvent;
+
+    if( nPattern < 0 || bUsable == bPresent )
+        return;
+
+    if( bUsable )
+        m_setPresent.insert(strPort);
+    else
+        m_setPresent.erase(strPort);
+
+    stEvent.strPort  = strPort;
+    stEvent.nPattern = nPattern;
+    stEvent.bAdded   = bUsable;
+    clEvents.push_back(stEvent);
+}
+
+void
+CPortWatcher::Scan(vector<SPortEvent> & clEvents)
+{
+    set<string> setSeen;
+    glob_t stGlob;
+
+    for(unsigned int i=0; i<m_clPatterns.size(); i++)
+    {
+        if( glob(m_clPatterns[i].c_str(), 0, NULL, &stGlob) != SUCCESS )
+            continue;
+
+        for(size_t j=0; j<stGlob.gl_pathc; j++)
+            setSeen.insert(stGlob.gl_pathv[j]);
+
+        globfree(&stGlob);
+    }
+
+    // the ones gone fail the check
+    setSeen.insert(m_setPresent.begin(), m_setPresent.end());
+
+    for(set<string>::iterator it = setSeen.begin(); it != setSeen.end(); ++it)
+        Check(*it, clEvents);
+}
+
+bool
+CPortWatcher::Wait(vector<SPortEvent> & clEvents, int nTimeoutMs)
+{
+#ifdef __linux__
+    struct pollfd stPollFd;
+    char rgBuffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t nRead;
+    int nReady;
+
+    stPollFd.fd      = m_fdNotify;
+    stPollFd.events  = POLLIN;
+    stPollFd.revents = 0;
+
+    if( (nReady = poll(&stPollFd, 1, nTimeoutMs)) <= 0 )
+        return nReady == 0 || errno == EINTR;
+
+    if( (nRead = read(m_fdNotify, rgBuffer, sizeof(rgBuffer))) <= 0 )
+        return errno == EINTR;
+
+    for(char *pEvent = rgBuffer; pEvent < rgBuffer + nRead; )
+    {
+        struct inotify_event *pstEvent = (struct inotify_event *)pEvent;
+        string strDir = m_mapWatches[pstEvent->wd];
+
+        pEvent += sizeof(struct inotify_event) + pstEvent->len;
+
+        // the directory itself is gone, fall back to its parent
+        if( pstEvent->mask & IN_IGNORED )
+        {
+            m_mapWatches.erase(pstEvent->wd);
+            WatchDirs();
+            continue;
+        }
+
+        if( !pstEvent->len )
+            continue;
+
+        string strPath = (strDir == "/" ? "" : strDir) + "/" + pstEvent->name;
+
+        // a directory we have been waiting for, the ports may be in it already
+        if( (pstEvent->mask & IN_ISDIR) && (pstEvent->mask & (IN_CREATE | IN_MOVED_TO)) )
+        {
+            WatchDirs();
+            Scan(clEvents);
+            continue;
+        }
+
+        Check(strPath, clEvents);
+    }
+
+    return true;
+#else
+    // no inotify, look again after a while
+    if( nTimeoutMs < 0 || nTimeoutMs > WATCHER_RESCAN_MS )
+        nTimeoutMs = WATCHER_RESCAN_MS;
+
+    poll(NULL, 0, nTimeoutMs);
+    Scan(clEvents);
+
+    return true;
+#endif
+}
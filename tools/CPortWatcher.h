@@ -0,0 +1,95 @@
+/*!\file  CPortWatcher.h  Watching for ports being plugged in and out
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef CPORT_WATCHER_H
+#define CPORT_WATCHER_H
+
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+
+using namespace std;
+
+//! A port appearing or disappearing.
+typedef struct SPortEvent_
+{
+    //! Path of the port as matched by the pattern.
+    string strPort;
+    //! Index of the first pattern matching the port.
+    unsigned int nPattern;
+    //! true if the port appeared, false if it is gone.
+    bool bAdded;
+} SPortEvent;
+
+/**
+*\class CPortWatcher
+*\brief Reports the ports matching glob patterns as they come and go.
+*
+* The directories of the patterns (ie. /dev for "/dev/ttyUSB*" or /dev/serial/by-id
+* for "/dev/serial/by-id/usb-FTDI*") are watched with inotify. A port is reported
+* once it exists and we may open it, which for a freshly plugged adapter is after
+* udev set its permissions (IN_ATTRIB) and not already at the kernel event, and it
+* is reported again only after it was removed. A directory which does not exist yet
+* (no USB adapter plugged, so no /dev/serial) is picked up when it is created.
+*/
+class CPortWatcher
+{
+private:
+    //! The inotify descriptor.
+    int m_fdNotify;
+    //! Glob patterns of the ports.
+    vector<string> m_clPatterns;
+    //! Directories the patterns need.
+    set<string> m_setDirs;
+    //! Watched directories by the watch descriptor.
+    map<int, string> m_mapWatches;
+    //! Ports already reported as added.
+    set<string> m_setPresent;
+
+    void WatchDirs();
+    int Match(const string & strPort) const;
+    void Check(const string & strPort, vector<SPortEvent> & clEvents);
+
+public:
+    CPortWatcher();
+    ~CPortWatcher();
+
+    /**
+    *\brief Creates the inotify instance.
+    *@return FAILURE on error SUCCESS if everything goes ok.
+    */
+    int Open();
+
+    /**
+    *\brief Starts watching the ports matching the glob pattern (an absolute path).
+    *@return The index of the pattern, used in SPortEvent.
+    */
+    unsigned int AddPattern(const string & strPattern);
+
+    /**
+    *\brief Reports the matching ports present right now as added.
+    *@param clEvents The events are appended here.
+    */
+    void Scan(vector<SPortEvent> & clEvents);
+
+    /**
+    *\brief Waits for ports to come or go.
+    *@param clEvents The events are appended here.
+    *@param nTimeoutMs Maximal time to wait in milliseconds, -1 waits forever.
+    *@return false on error, true otherwise (also on timeout or a signal).
+    */
+    bool Wait(vector<SPortEvent> & clEvents, int nTimeoutMs);
+};
+
+#endif
@@ -0,0 +1,95 @@
+/*!\file  CRingBuffer.cxx  Fixed size byte ring buffer
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <tools/CRingBuffer.h>
+
+#define RING_MASK (RING_BUFFER_SIZE - 1)
+
+CRingBuffer::CRingBuffer()
+{
+    Clear();
+}
+
+void
+CRingBuffer::Clear()
+{
+    m_nHead  = 0;
+    m_nCount = 0;
+}
+
+unsigned char *
+CRingBuffer::GetWriteSpace(unsigned int & nContiguous)
+{
+    unsigned int nTail = (m_nHead + m_nCount) & RING_MASK;
+
+    if( m_nCount == RING_BUFFER_SIZE )
+        nContiguous = 0;
+    else if( nTail >= m_nHead )
+        nContiguous = RING_BUFFER_SIZE - nTail;
+    else
+        nContiguous = m_nHead - nTail;
+
+    return m_rgBuffer + nTail;
+}
+
+void
+CRingBuffer::Commit(unsigned int nBytes)
+{
+    if( nBytes > GetFree() )
+        nBytes = GetFree();
+
+    m_nCount += nBytes;
+}
+
+unsigned int
+CRingBuffer::Write(const unsigned char *rgu8Data, unsigned int nLength)
+{
+    unsigned int nStored = 0;
+
+    while( nStored < nLength )
+    {
+        unsigned int nContiguous;
+        unsigned char *pSpace = GetWriteSpace(nContiguous);
+
+        if( nContiguous == 0 )
+            break;
+
+        if( nContiguous > nLength - nStored )
+            nContiguous = nLength - nStored;
+
+        for( unsigned int i=0; i<nContiguous; i++ )
+            pSpace[i] = rgu8Data[nStored + i];
+
+        Commit(nContiguous);
+        nStored += nContiguous;
+    }
+
+    return nStored;
+}
+
+bool
+CRingBuffer::Pop(unsigned char & u8Byte)
+{
+    if( m_nCount == 0 )
+        return false;
+
+    u8Byte  = m_rgBuffer[m_nHead];
+    m_nHead = (m_nHead + 1) & RING_MASK;
+    m_nCount--;
+
+    // start from the beginning again so the next read gets the most contiguous space
+    if( m_nCount == 0 )
+        m_nHead = 0;
+
+    return true;
+}
@@ -0,0 +1,72 @@
+/*!\file  CRingBuffer.h  Fixed size byte ring buffer
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef CRING_BUFFER_H
+#define CRING_BUFFER_H
+
+//! Capacity of the ring buffer in bytes, must be a power of 2.
+#define RING_BUFFER_SIZE 1024
+
+/**
+*\class CRingBuffer
+*\brief Fixed size FIFO of bytes.
+*
+* Used as the receive buffer of a port. The data are read by the port directly into
+* GetWriteSpace() and consumed byte by byte with Pop(), so receiving never allocates
+* and never copies the data more than once.
+*/
+class CRingBuffer
+{
+private:
+    unsigned char m_rgBuffer[RING_BUFFER_SIZE];
+    //! Index of the oldest byte.
+    unsigned int m_nHead;
+    //! Number of bytes stored.
+    unsigned int m_nCount;
+
+public:
+    CRingBuffer();
+
+    //! Throws away all the stored bytes.
+    void Clear();
+
+    //! Returns the number of stored bytes.
+    unsigned int GetCount() const { return m_nCount; }
+
+    //! Returns the number of bytes which can still be stored.
+    unsigned int GetFree() const { return RING_BUFFER_SIZE - m_nCount; }
+
+    /**
+    *\brief Returns the contiguous free space at the end of the stored data.
+    *@param nContiguous Output, the size of the returned space (may be 0 if full).
+    *@return Pointer where new data can be written, followed by Commit().
+    */
+    unsigned char *GetWriteSpace(unsigned int & nContiguous);
+
+    //! Makes nBytes written to GetWriteSpace() part of the stored data.
+    void Commit(unsigned int nBytes);
+
+    /**
+    *\brief Copies the data into the buffer.
+    *@return Number of bytes actually stored (less than nLength if full).
+    */
+    unsigned int Write(const unsigned char *rgu8Data, unsigned int nLength);
+
+    /**
+    *\brief Removes the oldest byte from the buffer.
+    *@return false if the buffer is empty.
+    */
+    bool Pop(unsigned char & u8Byte);
+};
+
+#endif
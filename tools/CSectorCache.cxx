@@ -0,0 +1,213 @@
+/*!\file  CSectorCache.cxx  Host side cache of what the boards hold in their flash sectors
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <tools/CSectorCache.h>
+#include <core/defs.h>
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cctype>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/file.h>
+
+//! FNV-1a 64 bit parameters (built from halves, C++98 has no 64 bit literals).
+#define FNV_OFFSET_BASIS	(((uint64_t)0xcbf29ce4 << 32) | 0x84222325)
+#define FNV_PRIME		(((uint64_t)0x100 << 32) | 0x000001b3)
+
+//! The first line of a new cache file.
+#define CACHE_HEADER "# armflash sector hashes: PARTID:BOARDID HASH0 HASH1 ..."
+
+CSectorCache::CSectorCache(const string & strFile)
+{
+    m_strFile = strFile;
+    pthread_mutex_init(&m_stLock, NULL);
+}
+
+CSectorCache::~CSectorCache()
+{
+    pthread_mutex_destroy(&m_stLock);
+}
+
+// Opens the file and locks it, read only for LOCK_SH, created if needed for LOCK_EX
+int
+CSectorCache::OpenLocked(int nLock) const
+{
+    int fdFile = nLock == LOCK_EX ? open(m_strFile.c_str(), O_RDWR | O_CREAT, 0644)
+                                  : open(m_strFile.c_str(), O_RDONLY);
+
+    if( fdFile < 0 )
+        return FAILURE;
+
+    while( flock(fdFile, nLock) != SUCCESS )
+    {
+        if( errno != EINTR )
+        {
+            close(fdFile);
+            return FAILURE;
+        }
+    }
+
+    return fdFile;
+}
+
+bool
+CSectorCache::ReadEntries(int fdFile, vector<string> & clLines)
+{
+    string strContents;
+    char rgBuffer[4096];
+    ssize_t nRead;
+
+    while( (nRead = read(fdFile, rgBuffer, sizeof(rgBuffer))) != 0 )
+    {
+        if( nRead < 0 && errno == EINTR )
+            continue;
+
+        if( nRead < 0 )
+            return false;
+
+        strContents.append(rgBuffer, nRead);
+    }
+
+    istringstream ssContents(strContents);
+    string strLine;
+
+    while( getline(ssContents, strLine) )
+        if( !strLine.empty() )
+            clLines.push_back(strLine);
+
+    return true;
+}
+
+bool
+CSectorCache::Lookup(const string & strKey, vector<string> & clHashes)
+{
+    vector<string> clLines;
+    int fdFile;
+    bool bFound = false;
+
+    pthread_mutex_lock(&m_stLock);
+
+    if( (fdFile = OpenLocked(LOCK_SH)) >= 0 )
+    {
+        ReadEntries(fdFile, clLines);
+        close(fdFile);
+    }
+
+    pthread_mutex_unlock(&m_stLock);
+
+    for(unsigned int i=0; i<clLines.size() && !bFound; i++)
+    {
+        istringstream ssLine(clLines[i]);
+        string strLineKey, strHash;
+
+        if( !(ssLine >> strLineKey) || strLineKey != strKey )
+            continue;
+
+        clHashes.clear();
+        while( ssLine >> strHash )
+            clHashes.push_back(strHash);
+
+        bFound = true;
+    }
+
+    return bFound;
+}
+
+int
+CSectorCache::Store(const string & strKey, const vector<string> & clHashes)
+{
+    vector<string> clLines;
+    string strEntry = strKey, strContents;
+    bool bReplaced = false;
+    int fdFile, nRet = SUCCESS;
+
+    for(unsigned int i=0; i<clHashes.size(); i++)
+        strEntry += " " + clHashes[i];
+
+    pthread_mutex_lock(&m_stLock);
+
+    if( (fdFile = OpenLocked(LOCK_EX)) < 0 || !ReadEntries(fdFile, clLines) )
+    {
+        cerr << ERRSTR << "can't update the sector cache " << m_strFile << ": " << strerror(errno) << endl;
+
+        if( fdFile >= 0 )
+            close(fdFile);
+
+        pthread_mutex_unlock(&m_stLock);
+        return FAILURE;
+    }
+
+    if( clLines.empty() )
+        clLines.push_back(CACHE_HEADER);
+
+    for(unsigned int i=0; i<clLines.size(); i++)
+    {
+        if( clLines[i].compare(0, strKey.length() + 1, strKey + " ") == 0 )
+        {
+            clLines[i] = strEntry;
+            bReplaced = true;
+        }
+
+        strContents += clLines[i] + "\n";
+    }
+
+    if( !bReplaced )
+        strContents += strEntry + "\n";
+
+    // the lock is on the file itself, so it is rewritten in place
+    if( lseek(fdFile, 0, SEEK_SET) != 0 || ftruncate(fdFile, 0) != SUCCESS ||
+        write(fdFile, strContents.data(), strContents.length()) != (ssize_t)strContents.length() )
+    {
+        cerr << ERRSTR << "can't write the sector cache " << m_strFile << ": " << strerror(errno) << endl;
+        nRet = FAILURE;
+    }
+
+    close(fdFile);
+    pthread_mutex_unlock(&m_stLock);
+
+    return nRet;
+}
+
+string
+CSectorCache::MakeKey(unsigned int nPartId, const string & strBoardId)
+{
+    ostringstream ssKey;
+    string strId = strBoardId;
+
+    for(unsigned int i=0; i<strId.length(); i++)
+        if( isspace((unsigned char)strId[i]) )
+            strId[i] = '_';
+
+    ssKey << nPartId << ":" << strId;
+    return ssKey.str();
+}
+
+string
+CSectorCache::HashSector(const unsigned char *pData, unsigned int nLength)
+{
+    uint64_t u64Hash = FNV_OFFSET_BASIS;
+    char szHash[17];
+
+    for(unsigned int i=0; i<nLength; i++)
+    {
+        u64Hash ^= pData[i];
+        u64Hash *= FNV_PRIME;
+    }
+
+    snprintf(szHash, sizeof(szHash), "%08x%08x", (unsigned int)(u64Hash >> 32), (unsigned int)u64Hash);
+    return szHash;
+}
@@ -0,0 +1,88 @@
+/*!\file  CSectorCache.h  Host side cache of what the boards hold in their flash sectors
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef CSECTOR_CACHE_H
+#define CSECTOR_CACHE_H
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//! Hash of a sector whose contents are not known.
+#define SECTOR_HASH_UNKNOWN "-"
+
+/*
+* FILE FORMAT (text):
+*
+*	# comment
+*	KEY HASH0 HASH1 ... HASHn
+*
+* One line per board, KEY is "PARTID:BOARDID" (see MakeKey()) and HASHi is the FNV-1a
+* hash of sector i as 16 hex digits, or SECTOR_HASH_UNKNOWN.
+*/
+
+/**
+*\class CSectorCache
+*\brief Remembers the hashes of the sectors last programmed into every board.
+*
+* With the hashes of what a board holds the flashing can leave out the sectors the new
+* firmware does not change. The file is shared by all the flashing threads and by other
+* armflash processes, every update rereads it under an flock() and rewrites it whole.
+*/
+class CSectorCache
+{
+private:
+    string m_strFile;
+    pthread_mutex_t m_stLock;
+
+    CSectorCache(const CSectorCache &);
+    CSectorCache & operator=(const CSectorCache &);
+
+    int OpenLocked(int nLock) const;
+    static bool ReadEntries(int fdFile, vector<string> & clLines);
+
+public:
+    /**
+    *\brief Constructor, the file is created with the first Store().
+    *@param strFile Path to the cache file.
+    */
+    CSectorCache(const string & strFile);
+    ~CSectorCache();
+
+    //! Returns the path to the cache file.
+    const string & GetFile() const { return m_strFile; }
+
+    /**
+    *\brief Looks the board up.
+    *@param strKey Identity of the board, see MakeKey().
+    *@param clHashes The hashes of its sectors, untouched if it is not known.
+    *@return true if the board is known.
+    */
+    bool Lookup(const string & strKey, vector<string> & clHashes);
+
+    /**
+    *\brief Replaces the hashes of the board.
+    *@return SUCCESS or FAILURE.
+    */
+    int Store(const string & strKey, const vector<string> & clHashes);
+
+    //! Makes the key of a board from its part ID and the board ID (whitespace replaced).
+    static string MakeKey(unsigned int nPartId, const string & strBoardId);
+
+    //! Returns the hash of the sector contents.
+    static string HashSector(const unsigned char *pData, unsigned int nLength);
+};
+
+#endif
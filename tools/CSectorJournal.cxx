@@ -0,0 +1,130 @@
+/*!\file  CSectorJournal.cxx  Journal of the sectors programmed into a board
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <tools/CSectorJournal.h>
+#include <core/defs.h>
+#include <iostream>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define JOURNAL_DONE	'1'
+#define JOURNAL_TODO	'0'
+
+CSectorJournal::CSectorJournal()
+{
+    m_fdFile = FAILURE;
+    m_nSectors = 0;
+}
+
+CSectorJournal::~CSectorJournal()
+{
+    Close();
+}
+
+bool
+CSectorJournal::Open(const string & strFile, const string & strImageHash, unsigned int nSectors, vector<bool> & rgConfirmed)
+{
+    char rgBuffer[256];
+    ssize_t nRead;
+
+    Close();
+
+    m_strFile = strFile;
+    m_strImageHash = strImageHash;
+    m_nSectors = nSectors;
+    rgConfirmed.assign(nSectors, false);
+
+    if( (m_fdFile = open(strFile.c_str(), O_RDWR | O_CREAT, 0644)) < 0 )
+    {
+        cerr << ERRSTR << "can't open the journal " << strFile << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    while( (nRead = pread(m_fdFile, rgBuffer, sizeof(rgBuffer) - 1, 0)) < 0 && errno == EINTR )
+        ;
+
+    string strRecord(rgBuffer, nRead > 0 ? nRead : 0);
+
+    // a journal of this image is resumed, anything else is started over
+    if( strRecord.length() == strImageHash.length() + 1 + nSectors + 1 &&
+        strRecord.compare(0, strImageHash.length() + 1, strImageHash + " ") == 0 )
+    {
+        for(unsigned int i=0; i<nSectors; i++)
+            rgConfirmed[i] = strRecord[strImageHash.length() + 1 + i] == JOURNAL_DONE;
+
+        return true;
+    }
+
+    return WriteAll();
+}
+
+// Writes a new record with no sector confirmed
+bool
+CSectorJournal::WriteAll()
+{
+    string strRecord = m_strImageHash + " " + string(m_nSectors, JOURNAL_TODO) + "\n";
+
+    if( ftruncate(m_fdFile, 0) != SUCCESS ||
+        pwrite(m_fdFile, strRecord.data(), strRecord.length(), 0) != (ssize_t)strRecord.length() ||
+        fsync(m_fdFile) != SUCCESS )
+    {
+        cerr << ERRSTR << "can't write the journal " << m_strFile << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool
+CSectorJournal::Confirm(unsigned int nSector)
+{
+    char cDone = JOURNAL_DONE;
+
+    if( m_fdFile < 0 || nSector >= m_nSectors )
+        return false;
+
+    if( pwrite(m_fdFile, &cDone, 1, m_strImageHash.length() + 1 + nSector) != 1 || fsync(m_fdFile) != SUCCESS )
+    {
+        cerr << ERRSTR << "can't write the journal " << m_strFile << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool
+CSectorJournal::Reset()
+{
+    return m_fdFile >= 0 && WriteAll();
+}
+
+void
+CSectorJournal::Finish()
+{
+    if( m_fdFile < 0 )
+        return;
+
+    Close();
+    unlink(m_strFile.c_str());
+}
+
+void
+CSectorJournal::Close()
+{
+    if( m_fdFile >= 0 )
+        close(m_fdFile);
+
+    m_fdFile = FAILURE;
+}
@@ -0,0 +1,90 @@
+/*!\file  CSectorJournal.h  Journal of the sectors programmed into a board
+ *
+ *	This file is part of the armflash (arm flashing utility)
+ *  package.
+ *
+ *  Copyright (c) 2008-2009 by Gabriel Zabusek <gabriel.zabusek@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef CSECTOR_JOURNAL_H
+#define CSECTOR_JOURNAL_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+* FILE FORMAT (text, one line):
+*
+*	IMAGEHASH FLAGS
+*
+* IMAGEHASH identifies the firmware being flashed (see CSectorCache::HashSector()),
+* FLAGS has one character per sector, '1' once the sector is confirmed programmed
+* and '0' before. A flag is updated in place with one pwrite() and fsync().
+*/
+
+/**
+*\class CSectorJournal
+*\brief Remembers which sectors of a board were programmed by an interrupted session.
+*
+* One journal belongs to one board. A session flashing the same image again skips the
+* sectors the journal confirms, a different image starts a new journal. The journal is
+* removed once the whole image is in the board.
+*/
+class CSectorJournal
+{
+private:
+    int m_fdFile;
+    string m_strFile;
+    string m_strImageHash;
+    unsigned int m_nSectors;
+
+    CSectorJournal(const CSectorJournal &);
+    CSectorJournal & operator=(const CSectorJournal &);
+
+    bool WriteAll();
+
+public:
+    CSectorJournal();
+    ~CSectorJournal();
+
+    /**
+    *\brief Opens the journal of the board, creates it if it is not there.
+    *@param strFile Path to the journal file.
+    *@param strImageHash Identity of the image being flashed.
+    *@param nSectors Number of sectors of the flash.
+    *@param rgConfirmed Set to the sectors confirmed programmed with this image, none
+    * if the journal was made for another image (it is started over then).
+    *@return false if the file can't be opened or written.
+    */
+    bool Open(const string & strFile, const string & strImageHash, unsigned int nSectors, vector<bool> & rgConfirmed);
+
+    //! Returns true while a journal is open.
+    bool IsOpen() const { return m_fdFile >= 0; }
+
+    //! Returns the path to the journal file.
+    const string & GetFile() const { return m_strFile; }
+
+    /**
+    *\brief Records the sector as programmed, the record is on the disk on return.
+    *@return false on a write error.
+    */
+    bool Confirm(unsigned int nSector);
+
+    //! Marks all the sectors as not programmed.
+    bool Reset();
+
+    //! The whole image is in the board, closes and removes the journal.
+    void Finish();
+
+    //! Closes the journal, it stays for the next session.
+    void Close();
+};
+
+#endif
@@ -137,7 +137,7 @@ CUUcoder::UUDecode(unsigned char *rgBinaryData, string strToDecode, unsigned int
 
 		//cout << bitset<8>(rgBuffer[0]) << " " << bitset<8>(rgBuffer[1]) << " " << bitset<8>(rgBuffer[2]) << " " << bitset<8>(rgBuffer[3]) << " " << endl;
 
-		rgBinaryData[k]   = (rgBuffer[0] << 2) | ((rgBuffer[1] & 0x18) >> 3);
+		rgBinaryData[k]   = (rgBuffer[0] << 2) | ((rgBuffer[1] & 0x30) >> 4);
 		rgBinaryData[k+1] = ((rgBuffer[1] & 0x0F) << 4) | ((rgBuffer[2] & 0x3C) >> 2);
 		rgBinaryData[k+2] = ((rgBuffer[2] & 0x03) << 6) | rgBuffer[3];
 